@@ -1,17 +1,707 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <unistd.h>
+#include <time.h>
+#include <dirent.h>
 #include <pthread.h>
+#include <crypt.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
 #include <nc_server.h>
 #include "auth_callbacks.h"
+#include "metrics.h"
+#include "logger.h"
+
+const char* AUTH_USERS_PATH_DEFAULT = "configs/users";
+const char* AUTH_KEYS_PATH_DEFAULT = "configs/authorized_keys";
+const char* AUTH_HOSTKEY_DIR_DEFAULT = "/etc/ssh";
+const char* AUTH_KEYSTORE_DIR_DEFAULT = "configs/keystore";
+
+/* Users, only read once auth_init() returned. */
+const uint32_t AUTH_USER_BUCKETS = 256;
+struct auth_user
+{
+	char* name;
+	char* hash;
+	struct auth_user* next;
+};
+static struct auth_user* auth_users[AUTH_USER_BUCKETS];
+static int auth_user_count = 0;
+/* Hashed instead of an unknown user, so its failure takes as long as a wrong password. */
+static const char* AUTH_UNKNOWN_HASH = "$6$rounds=5000$nonexistentuser$";
+
+/* Verified passwords, by HMAC-SHA256 under a key drawn at startup. */
+struct auth_cache_entry
+{
+	char name[64];
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	time_t expires;
+};
+static pthread_mutex_t auth_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct auth_cache_entry auth_cache[AUTH_CACHE_SIZE];
+static unsigned char auth_cache_key[32];
+
+/* Token buckets of the source addresses. */
+struct auth_source
+{
+	char host[64];
+	int tokens;
+	time_t refilled;
+};
+static pthread_mutex_t auth_rate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct auth_source auth_sources[AUTH_SOURCES];
+
+/* One crypt() run, freed by the last of the waiter and the Verify Thread. */
+struct auth_job
+{
+	char* hash;
+	char* password;
+	int result;
+	int done;
+	int refcount;
+	struct auth_job* next;
+};
+/* Authorized keys, immutable once published, pinned by the attempts using them. */
+struct auth_key
+{
+	char* user;
+	/* Base64 of the public key blob. */
+	char* blob;
+	uint32_t hash;
+	struct auth_key* next;
+};
+struct auth_keys
+{
+	struct auth_key* buckets[AUTH_KEY_BUCKETS];
+	int count;
+	int refcount;
+};
+static pthread_mutex_t auth_keys_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct auth_keys* auth_keys_current = NULL;
+
+/* Host keys by type, the callback runs on the Accept Thread while SIGHUP reloads them. */
+struct auth_hostkey
+{
+	const char* name;
+	char path[PATH_MAX];
+	int loaded;
+};
+static pthread_mutex_t auth_hostkeys_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct auth_hostkey auth_hostkeys[AUTH_HOSTKEYS_MAX] = { {"ed25519", "", 0}, {"ecdsa", "", 0}, {"rsa", "", 0} };
+
+/* TLS keystore, only read once auth_load_keystore() returned. */
+struct auth_ctn
+{
+	uint32_t id;
+	char* fingerprint;
+	NC_TLS_CTN_MAPTYPE map_type;
+	char* name;
+};
+static char auth_tls_cert[PATH_MAX];
+static char auth_tls_key[PATH_MAX];
+static char* auth_trusted[AUTH_TRUSTED_MAX];
+static int auth_trusted_count = 0;
+static struct auth_ctn auth_ctns[AUTH_CTN_MAX];
+static int auth_ctn_count = 0;
+/* ietf-x509-cert-to-name map types, indexed by NC_TLS_CTN_MAPTYPE. */
+static const char* AUTH_CTN_NAMES[] = { "", "specified", "san-rfc822-name", "san-dns-name", "san-ip-address", "san-any", "common-name" };
+
+static pthread_mutex_t auth_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t auth_pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t auth_done_cond = PTHREAD_COND_INITIALIZER;
+static struct auth_job* auth_queue_head = NULL;
+static struct auth_job* auth_queue_tail = NULL;
+static int auth_verifiers = 0;
+static int auth_stop = 0;
+static int auth_verify_metric = -1;
+
+static uint32_t auth_hash(const char* s)
+{
+	uint32_t h = 2166136261u;
+	while(*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+/* Key of user with base64 blob. */
+static uint32_t auth_key_hash(const char* user, const char* blob)
+{
+	return auth_hash(user) * 31 + auth_hash(blob);
+}
+
+static struct auth_user* auth_user_find(const char* name)
+{
+	struct auth_user* user = auth_users[auth_hash(name) & (AUTH_USER_BUCKETS - 1)];
+	while(user && strcmp(user->name, name))
+		user = user->next;
+	return user;
+}
+
+int auth_init(const char* path)
+{
+	auth_verify_metric = metrics_histogram("netconf_auth_verify_seconds", "method", "password");
+	if(RAND_bytes(auth_cache_key, sizeof(auth_cache_key)) != 1)
+	{
+		LOGGER_ERROR("Authentication", "No random cache key.");
+		return 1;
+	}
+	
+	FILE* file = fopen(path, "r");
+	if(!file)
+	{
+		LOGGER_WARNING("Authentication", "No users file %s, every password is rejected.", path);
+		return 0;
+	}
+	char line[1024];
+	int number = 0;
+	while(fgets(line, sizeof(line), file))
+	{
+		number++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if(!line[0] || line[0] == '#')
+			continue;
+		char* colon = strchr(line, ':');
+		if(!colon || colon == line || colon - line >= (int)sizeof(auth_cache[0].name) || !colon[1])
+		{
+			LOGGER_WARNING("Authentication", "%s:%d : expected \"user:hash\", skipped.", path, number);
+			continue;
+		}
+		*colon = '\0';
+		if(auth_user_find(line))
+		{
+			LOGGER_WARNING("Authentication", "%s:%d : user %s already defined, skipped.", path, number, line);
+			continue;
+		}
+		if(!strncmp(colon + 1, "$0$", 3))
+			LOGGER_WARNING("Authentication", "%s:%d : user %s has a cleartext password.", path, number, line);
+	
+		struct auth_user* user = new auth_user;
+		user->name = strdup(line);
+		user->hash = strdup(colon + 1);
+		uint32_t bucket = auth_hash(user->name) & (AUTH_USER_BUCKETS - 1);
+		user->next = auth_users[bucket];
+		auth_users[bucket] = user;
+		auth_user_count++;
+	}
+	fclose(file);
+	LOGGER_INFO("Authentication", "%d users loaded from %s.", auth_user_count, path);
+	return 0;
+}
+
+static struct auth_keys* auth_keys_pin(void)
+{
+	pthread_mutex_lock(&auth_keys_mutex);
+	struct auth_keys* keys = auth_keys_current;
+	if(keys)
+		keys->refcount++;
+	pthread_mutex_unlock(&auth_keys_mutex);
+	return keys;
+}
+
+static void auth_keys_unpin(struct auth_keys* keys)
+{
+	if(!keys)
+		return;
+	pthread_mutex_lock(&auth_keys_mutex);
+	int last = !--keys->refcount;
+	pthread_mutex_unlock(&auth_keys_mutex);
+	if(!last)
+		return;
+	for(uint32_t i = 0; i < AUTH_KEY_BUCKETS; i++)
+	{
+		while(keys->buckets[i])
+		{
+			struct auth_key* key = keys->buckets[i];
+			keys->buckets[i] = key->next;
+			free(key->user);
+			free(key->blob);
+			delete key;
+		}
+	}
+	delete keys;
+}
+
+int auth_load_keys(const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if(!file)
+		LOGGER_WARNING("Authentication", "No authorized keys file %s, every public key is rejected.", path);
+	/* Built aside, published as a whole, a removed file publishes an empty index. */
+	struct auth_keys* keys = new auth_keys();
+	keys->refcount = 1;
+	char line[16384];
+	int number = 0;
+	while(file && fgets(line, sizeof(line), file))
+	{
+		number++;
+		if(line[0] == '#')
+			continue;
+		char* save = NULL;
+		char* user = strtok_r(line, " \t\r\n", &save);
+		char* type = user ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+		char* blob = type ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+		if(!user)
+			continue;
+		if(!blob)
+		{
+			LOGGER_WARNING("Authentication", "%s:%d : expected \"user key-type base64\", skipped.", path, number);
+			continue;
+		}
+		struct auth_key* key = new auth_key;
+		key->user = strdup(user);
+		key->blob = strdup(blob);
+		key->hash = auth_key_hash(user, blob);
+		uint32_t bucket = key->hash & (AUTH_KEY_BUCKETS - 1);
+		key->next = keys->buckets[bucket];
+		keys->buckets[bucket] = key;
+		keys->count++;
+	}
+	
+	pthread_mutex_lock(&auth_keys_mutex);
+	struct auth_keys* old = auth_keys_current;
+	auth_keys_current = keys;
+	pthread_mutex_unlock(&auth_keys_mutex);
+	auth_keys_unpin(old);
+	if(file)
+	{
+		fclose(file);
+		LOGGER_INFO("Authentication", "%d authorized keys loaded from %s.", keys->count, path);
+	}
+	return 0;
+}
+
+int auth_load_hostkeys(const char* dir)
+{
+	int count = 0;
+	for(int i = 0; i < AUTH_HOSTKEYS_MAX; i++)
+	{
+		struct auth_hostkey* hostkey = &auth_hostkeys[i];
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/ssh_host_%s_key", dir, hostkey->name);
+		/* Parsed here to check it, so a broken file is reported now and never offered. The key can
+		 * not be kept, libnetconf2 hands libssh only the path and libssh parses it again on every
+		 * handshake, "make bench" measures that cost. */
+		ssh_key key = NULL;
+		int loaded = access(path, R_OK) == 0 && ssh_pki_import_privkey_file(path, NULL, NULL, NULL, &key) == SSH_OK;
+		if(key)
+			ssh_key_free(key);
+		if(loaded)
+			count++;
+		else if(!access(path, F_OK))
+			LOGGER_WARNING("Authentication", "Host key %s can not be loaded, not offered.", path);
+		
+		pthread_mutex_lock(&auth_hostkeys_mutex);
+		snprintf(hostkey->path, sizeof(hostkey->path), "%s", path);
+		hostkey->loaded = loaded;
+		pthread_mutex_unlock(&auth_hostkeys_mutex);
+	}
+	LOGGER_INFO("Authentication", "%d host keys loaded from %s.", count, dir);
+	return count;
+}
+
+int auth_apply_hostkeys(const char* endpt)
+{
+	/* Every host key of endpt, then the loaded ones in order of preference. */
+	nc_server_ssh_endpt_del_hostkey(endpt, NULL, -1);
+	int failed = 0;
+	for(int i = 0; i < AUTH_HOSTKEYS_MAX; i++)
+	{
+		pthread_mutex_lock(&auth_hostkeys_mutex);
+		int loaded = auth_hostkeys[i].loaded;
+		pthread_mutex_unlock(&auth_hostkeys_mutex);
+		if(loaded && nc_server_ssh_endpt_add_hostkey(endpt, auth_hostkeys[i].name, -1))
+			failed = 1;
+	}
+	return failed;
+}
+
+/* Whether the certificate of cert_path is the public half of the key of key_path. */
+static int auth_tls_pair(const char* cert_path, const char* key_path)
+{
+	int matched = 0;
+	FILE* file = fopen(cert_path, "r");
+	X509* cert = file ? PEM_read_X509(file, NULL, NULL, NULL) : NULL;
+	if(file)
+		fclose(file);
+	file = fopen(key_path, "r");
+	EVP_PKEY* key = file ? PEM_read_PrivateKey(file, NULL, NULL, NULL) : NULL;
+	if(file)
+		fclose(file);
+	if(cert && key)
+		matched = X509_check_private_key(cert, key) == 1;
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	return matched;
+}
+
+static void auth_load_ctn(const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if(!file)
+		return;
+	char line[1024];
+	int number = 0;
+	while(fgets(line, sizeof(line), file) && auth_ctn_count < AUTH_CTN_MAX)
+	{
+		number++;
+		if(line[0] == '#')
+			continue;
+		char* save = NULL;
+		char* id = strtok_r(line, " \t\r\n", &save);
+		char* fingerprint = id ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+		char* map = fingerprint ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+		char* name = map ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+		if(!id)
+			continue;
+		int map_type = 0;
+		for(int i = 1; map && i < (int)(sizeof(AUTH_CTN_NAMES) / sizeof(AUTH_CTN_NAMES[0])); i++)
+			if(!strcmp(map, AUTH_CTN_NAMES[i]))
+				map_type = i;
+		/* Only "specified" names the user itself. */
+		if(!map_type || (map_type == NC_TLS_CTN_SPECIFIED) != (name != NULL))
+		{
+			LOGGER_WARNING("Authentication", "%s:%d : expected \"id fingerprint map-type [name]\", skipped.", path, number);
+			continue;
+		}
+		struct auth_ctn* ctn = &auth_ctns[auth_ctn_count++];
+		ctn->id = strtoul(id, NULL, 10);
+		ctn->fingerprint = strdup(fingerprint);
+		ctn->map_type = (NC_TLS_CTN_MAPTYPE)map_type;
+		ctn->name = name ? strdup(name) : NULL;
+	}
+	fclose(file);
+}
+
+int auth_load_keystore(const char* dir)
+{
+	snprintf(auth_tls_cert, sizeof(auth_tls_cert), "%s/server.crt", dir);
+	snprintf(auth_tls_key, sizeof(auth_tls_key), "%s/server.key", dir);
+	if(access(auth_tls_cert, R_OK) || access(auth_tls_key, R_OK))
+	{
+		LOGGER_INFO("Authentication", "No server certificate in %s, TLS disabled.", dir);
+		return 1;
+	}
+	/* Parsed here once, so a broken pair is reported now and not on every handshake. */
+	if(!auth_tls_pair(auth_tls_cert, auth_tls_key))
+	{
+		LOGGER_ERROR("Authentication", "%s does not load or does not match %s, TLS disabled.", auth_tls_cert, auth_tls_key);
+		return 1;
+	}
+	
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/trusted", dir);
+	DIR* trusted = opendir(path);
+	struct dirent* entry;
+	while(trusted && (entry = readdir(trusted)) && auth_trusted_count < AUTH_TRUSTED_MAX)
+	{
+		size_t length = strlen(entry->d_name);
+		if(length < 5 || strcmp(entry->d_name + length - 4, ".pem"))
+			continue;
+		char cert[PATH_MAX];
+		snprintf(cert, sizeof(cert), "%s/%s", path, entry->d_name);
+		auth_trusted[auth_trusted_count++] = strdup(cert);
+	}
+	if(trusted)
+		closedir(trusted);
+	
+	snprintf(path, sizeof(path), "%s/cert_to_name", dir);
+	auth_load_ctn(path);
+	if(!auth_trusted_count || !auth_ctn_count)
+		LOGGER_WARNING("Authentication", "%d trusted certificates and %d cert-to-name entries in %s, TLS clients can not log in.", auth_trusted_count, auth_ctn_count, dir);
+	else
+		LOGGER_INFO("Authentication", "TLS keystore %s, %d trusted certificates, %d cert-to-name entries.", dir, auth_trusted_count, auth_ctn_count);
+	return 0;
+}
+
+int auth_apply_keystore(const char* endpt)
+{
+	if(nc_server_tls_endpt_set_server_cert(endpt, "server"))
+		return 1;
+	if(auth_trusted_count && nc_server_tls_endpt_add_trusted_cert_list(endpt, "trusted"))
+		return 1;
+	for(int i = 0; i < auth_ctn_count; i++)
+	{
+		struct auth_ctn* ctn = &auth_ctns[i];
+		if(nc_server_tls_endpt_add_ctn(endpt, ctn->id, ctn->fingerprint, ctn->map_type, ctn->name))
+			LOGGER_WARNING("Authentication", "cert-to-name entry %u rejected.", ctn->id);
+	}
+	return 0;
+}
+
+void auth_destroy(void)
+{
+	for(uint32_t i = 0; i < AUTH_USER_BUCKETS; i++)
+	{
+		while(auth_users[i])
+		{
+			struct auth_user* user = auth_users[i];
+			auth_users[i] = user->next;
+			free(user->name);
+			OPENSSL_cleanse(user->hash, strlen(user->hash));
+			free(user->hash);
+			delete user;
+		}
+	}
+	auth_user_count = 0;
+	OPENSSL_cleanse(auth_cache, sizeof(auth_cache));
+	
+	pthread_mutex_lock(&auth_keys_mutex);
+	struct auth_keys* keys = auth_keys_current;
+	auth_keys_current = NULL;
+	pthread_mutex_unlock(&auth_keys_mutex);
+	auth_keys_unpin(keys);
+	
+	for(int i = 0; i < auth_trusted_count; i++)
+		free(auth_trusted[i]);
+	auth_trusted_count = 0;
+	for(int i = 0; i < auth_ctn_count; i++)
+	{
+		free(auth_ctns[i].fingerprint);
+		free(auth_ctns[i].name);
+	}
+	auth_ctn_count = 0;
+}
+
+/* Compared as SHA-256 digests, so neither their length nor where they differ shows in the time taken. */
+static int auth_equal(const char* first, const char* second)
+{
+	unsigned char first_digest[EVP_MAX_MD_SIZE], second_digest[EVP_MAX_MD_SIZE];
+	unsigned int length = 0;
+	EVP_Digest(first, strlen(first), first_digest, &length, EVP_sha256(), NULL);
+	EVP_Digest(second, strlen(second), second_digest, &length, EVP_sha256(), NULL);
+	return !CRYPTO_memcmp(first_digest, second_digest, length);
+}
+
+/* Whether password hashes to hash, in time independent of their content. */
+static int auth_match(struct crypt_data* data, const char* hash, const char* password)
+{
+	if(!strncmp(hash, "$0$", 3))
+		return auth_equal(password, hash + 3);
+	
+	const char* result = crypt_r(password, hash, data);
+	/* Failures are "*0" or NULL, depending on the libcrypt. */
+	if(!result || result[0] == '*')
+		return 0;
+	return auth_equal(result, hash);
+}
+
+static void auth_digest(const char* password, unsigned char* digest)
+{
+	unsigned int length = 0;
+	HMAC(EVP_sha256(), auth_cache_key, sizeof(auth_cache_key), (const unsigned char*)password, strlen(password), digest, &length);
+}
+
+static int auth_cache_hit(const char* name, const unsigned char* digest)
+{
+	struct auth_cache_entry* entry = &auth_cache[auth_hash(name) & (AUTH_CACHE_SIZE - 1)];
+	int hit = 0;
+	pthread_mutex_lock(&auth_cache_mutex);
+	if(!strcmp(entry->name, name) && entry->expires > time(NULL))
+		hit = !CRYPTO_memcmp(entry->digest, digest, EVP_MAX_MD_SIZE);
+	pthread_mutex_unlock(&auth_cache_mutex);
+	return hit;
+}
+
+static void auth_cache_store(const char* name, const unsigned char* digest)
+{
+	struct auth_cache_entry* entry = &auth_cache[auth_hash(name) & (AUTH_CACHE_SIZE - 1)];
+	pthread_mutex_lock(&auth_cache_mutex);
+	snprintf(entry->name, sizeof(entry->name), "%s", name);
+	memcpy(entry->digest, digest, EVP_MAX_MD_SIZE);
+	entry->expires = time(NULL) + AUTH_CACHE_TTL;
+	pthread_mutex_unlock(&auth_cache_mutex);
+}
+
+/* Take a token of host, 0 when its bucket is empty. A new host evicts the one sharing its slot. */
+static int auth_rate_admit(const char* host)
+{
+	struct auth_source* source = &auth_sources[auth_hash(host) & (AUTH_SOURCES - 1)];
+	time_t now = time(NULL);
+	int admitted = 0;
+	pthread_mutex_lock(&auth_rate_mutex);
+	if(strncmp(source->host, host, sizeof(source->host) - 1))
+	{
+		snprintf(source->host, sizeof(source->host), "%s", host);
+		source->tokens = AUTH_RATE_BURST;
+		source->refilled = now;
+	}
+	int refills = (int)((now - source->refilled) / AUTH_RATE_REFILL);
+	if(refills > 0)
+	{
+		source->tokens = (source->tokens + refills > AUTH_RATE_BURST) ? AUTH_RATE_BURST : source->tokens + refills;
+		source->refilled += refills * AUTH_RATE_REFILL;
+	}
+	if(source->tokens > 0)
+	{
+		source->tokens--;
+		admitted = 1;
+	}
+	pthread_mutex_unlock(&auth_rate_mutex);
+	return admitted;
+}
+
+static void auth_job_put(struct auth_job* job)
+{
+	if(--job->refcount)
+		return;
+	OPENSSL_cleanse(job->password, strlen(job->password));
+	free(job->password);
+	free(job->hash);
+	delete job;
+}
+
+/* Run crypt() on a Verify Thread, or here while none is running. -1 on timeout. */
+static int auth_verify(const char* hash, const char* password)
+{
+	pthread_mutex_lock(&auth_pool_mutex);
+	if(!auth_verifiers)
+	{
+		pthread_mutex_unlock(&auth_pool_mutex);
+		struct crypt_data* data = (struct crypt_data*)calloc(1, sizeof(struct crypt_data));
+		int result = auth_match(data, hash, password);
+		free(data);
+		return result;
+	}
+	/* The password is copied, the waiter may give up before it is hashed. */
+	struct auth_job* job = new auth_job;
+	job->hash = strdup(hash);
+	job->password = strdup(password);
+	job->result = 0;
+	job->done = 0;
+	job->refcount = 2;
+	job->next = NULL;
+	if(auth_queue_tail)
+		auth_queue_tail->next = job;
+	else
+		auth_queue_head = job;
+	auth_queue_tail = job;
+	pthread_cond_signal(&auth_pool_cond);
+	
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += AUTH_VERIFY_TIMEOUT / 1000;
+	while(!job->done)
+		if(pthread_cond_timedwait(&auth_done_cond, &auth_pool_mutex, &deadline))
+			break;
+	int result = job->done ? job->result : -1;
+	auth_job_put(job);
+	pthread_mutex_unlock(&auth_pool_mutex);
+	return result;
+}
+
+void* auth_verify_thread_entry(void* arg)
+{
+	LOGGER_INFO("Verify Thread", "Started.");
+	struct crypt_data* data = (struct crypt_data*)calloc(1, sizeof(struct crypt_data));
+	pthread_mutex_lock(&auth_pool_mutex);
+	auth_verifiers++;
+	while(1)
+	{
+		while(!auth_queue_head && !auth_stop)
+			pthread_cond_wait(&auth_pool_cond, &auth_pool_mutex);
+		struct auth_job* job = auth_queue_head;
+		if(!job)
+			break;
+		auth_queue_head = job->next;
+		if(!auth_queue_head)
+			auth_queue_tail = NULL;
+		pthread_mutex_unlock(&auth_pool_mutex);
+	
+		uint64_t start = metrics_now();
+		int result = auth_match(data, job->hash, job->password);
+		metrics_record(auth_verify_metric, metrics_now() - start);
+	
+		pthread_mutex_lock(&auth_pool_mutex);
+		job->result = result;
+		job->done = 1;
+		pthread_cond_broadcast(&auth_done_cond);
+		auth_job_put(job);
+	}
+	auth_verifiers--;
+	pthread_mutex_unlock(&auth_pool_mutex);
+	OPENSSL_cleanse(data, sizeof(struct crypt_data));
+	free(data);
+	LOGGER_INFO("Verify Thread", "Cleaning up allocated resource.");
+	return NULL;
+}
+
+void auth_shutdown(void)
+{
+	pthread_mutex_lock(&auth_pool_mutex);
+	auth_stop = 1;
+	pthread_cond_broadcast(&auth_pool_cond);
+	pthread_mutex_unlock(&auth_pool_mutex);
+}
 
 /* SSH Authentication Callbacks */
 int auth_callback_ssh_passwd
 (const struct nc_session* session, const char* password, void* user_data)
 {
-	/* TODO */
-	printf("[Authentication] Verifying SSH Password.\n");
-	return 0;
+	const char* name = nc_session_get_username(session);
+	const char* host = nc_session_get_host(session) ? nc_session_get_host(session) : "";
+	if(!name || !password)
+		return 1;
+	
+	/* Reconnects within AUTH_CACHE_TTL cost one HMAC, no crypt(). */
+	unsigned char digest[EVP_MAX_MD_SIZE] = {0};
+	auth_digest(password, digest);
+	struct auth_user* user = auth_user_find(name);
+	if(user && auth_cache_hit(name, digest))
+	{
+		LOGGER_DEBUG("Authentication", "User %s from %s, cached.", name, host);
+		return 0;
+	}
+	
+	if(!auth_rate_admit(host))
+	{
+		LOGGER_WARNING("Authentication", "User %s from %s, rate limited.", name, host);
+		return 1;
+	}
+	int result = auth_verify(user ? user->hash : AUTH_UNKNOWN_HASH, password);
+	if(result > 0 && user)
+	{
+		auth_cache_store(name, digest);
+		LOGGER_INFO("Authentication", "User %s from %s, password accepted.", name, host);
+		return 0;
+	}
+	if(result < 0)
+		LOGGER_WARNING("Authentication", "User %s from %s, verification timed out.", name, host);
+	else
+		LOGGER_WARNING("Authentication", "User %s from %s, password rejected.", name, host);
+	return 1;
+}
+
+int auth_callback_ssh_pubkey
+(const struct nc_session* session, ssh_key key, void* user_data)
+{
+	const char* name = nc_session_get_username(session);
+	char* blob = NULL;
+	if(!name || ssh_pki_export_pubkey_base64(key, &blob) != SSH_OK)
+		return 1;
+	
+	/* Called for the key offer and again for its signature, both are one lookup. */
+	int found = 0;
+	uint32_t hash = auth_key_hash(name, blob);
+	struct auth_keys* keys = auth_keys_pin();
+	if(keys)
+	{
+		for(struct auth_key* entry = keys->buckets[hash & (AUTH_KEY_BUCKETS - 1)]; entry && !found; entry = entry->next)
+			found = entry->hash == hash && !strcmp(entry->user, name) && !strcmp(entry->blob, blob);
+	}
+	auth_keys_unpin(keys);
+	ssh_string_free_char(blob);
+	
+	if(found)
+		LOGGER_DEBUG("Authentication", "User %s from %s, public key accepted.", name, nc_session_get_host(session) ? nc_session_get_host(session) : "");
+	else
+		LOGGER_DEBUG("Authentication", "User %s from %s, public key not authorized.", name, nc_session_get_host(session) ? nc_session_get_host(session) : "");
+	return found ? 0 : 1;
 }
 
 int auth_callback_ssh_hostkey(	const char* name,
@@ -20,12 +710,54 @@ int auth_callback_ssh_hostkey(	const char* name,
 								char** privkey_data,
 								int* privkey_data_rsa)
 {
-	if(!strcmp(name, "default"))
+	/* 
+	 * libnetconf2 would write privkey_data to a temporary file for libssh to read back, the
+	 * checked path is handed out instead and libssh reads the key from it.
+	 */
+	int found = 0;
+	pthread_mutex_lock(&auth_hostkeys_mutex);
+	for(int i = 0; i < AUTH_HOSTKEYS_MAX && !found; i++)
 	{
+		if(!auth_hostkeys[i].loaded || strcmp(name, auth_hostkeys[i].name))
+			continue;
 		/* WARNING: need strdup here, original pointer got no memory capacity. */
-		*privkey_path = strdup("/etc/ssh/ssh_host_rsa_key");
-		return 0;
+		*privkey_path = strdup(auth_hostkeys[i].path);
+		found = 1;
 	}
-	else
-	return 1;
+	pthread_mutex_unlock(&auth_hostkeys_mutex);
+	return found ? 0 : 1;
+}
+
+/* TLS Authentication Callbacks */
+int auth_callback_tls_server_cert(	const char* name,
+									void* user_data,
+									char** cert_path,
+									char** cert_data,
+									char** privkey_path,
+									char** privkey_data,
+									int* privkey_data_rsa)
+{
+	if(strcmp(name, "server"))
+		return 1;
+	/* Paths, as for the host keys, the data would be written to temporary files. */
+	*cert_path = strdup(auth_tls_cert);
+	*privkey_path = strdup(auth_tls_key);
+	return 0;
+}
+
+int auth_callback_tls_trusted_certs(	const char* name,
+										void* user_data,
+										char*** cert_paths,
+										int* cert_path_count,
+										char*** cert_data,
+										int* cert_data_count)
+{
+	if(strcmp(name, "trusted"))
+		return 1;
+	/* Freed by libnetconf2. */
+	*cert_paths = (char**)malloc(auth_trusted_count * sizeof(char*));
+	for(int i = 0; i < auth_trusted_count; i++)
+		(*cert_paths)[i] = strdup(auth_trusted[i]);
+	*cert_path_count = auth_trusted_count;
+	return 0;
 }
@@ -1,5 +1,78 @@
 #ifndef AUTH_CALLBACKS_H
 #define AUTH_CALLBACKS_H
+#include <stdint.h>
+
+/*
+ * Password Authentication : users and their iana-crypt-hash values ("$0$", "$1$", "$5$", "$6$"
+ * or any other scheme of crypt(3)) loaded once from a "user:hash" file. crypt() runs on the
+ * Verify Threads, so at most AUTH_VERIFIERS hashes are computed at once however many clients
+ * reconnect. A verified password is remembered by its keyed digest for AUTH_CACHE_TTL, and
+ * every source address may start at most AUTH_RATE_BURST crypt() runs, refilled by one per
+ * AUTH_RATE_REFILL seconds. Hashes and digests are compared in constant time.
+ *
+ * Public Key Authentication : "user key-type base64 [comment]" lines, indexed by user and key
+ * blob, so an attempt is one hash lookup. The file is reloaded by the Filewatch Thread into a
+ * new index, swapped in at once, attempts in progress keep the index they pinned.
+ *
+ * Host Keys : "ssh_host_<type>_key" of AUTH_HOSTKEY_DIR for ed25519, ecdsa and rsa, checked
+ * once at startup and on SIGHUP. Only the keys which parsed are offered, by path, libssh still
+ * reads the file on every handshake.
+ *
+ * TLS Keystore : "server.crt" and "server.key" (an EC key signs far cheaper than RSA), the
+ * trusted ".pem" certificates of "trusted", and the RFC 7407 cert-to-name entries of
+ * "cert_to_name", "id fingerprint map-type [name]" per line. Checked once at startup, the TLS endpoint is only
+ * created when the certificate and its key load and match.
+ */
+
+/* Users file, set by "-u". */
+extern const char* AUTH_USERS_PATH_DEFAULT;
+/* Authorized keys file, set by "-k". */
+extern const char* AUTH_KEYS_PATH_DEFAULT;
+/* Host keys directory, set by "-H". */
+extern const char* AUTH_HOSTKEY_DIR_DEFAULT;
+/* TLS keystore directory, set by "-T". */
+extern const char* AUTH_KEYSTORE_DIR_DEFAULT;
+
+/* Verify Threads. */
+const int AUTH_VERIFIERS = 2;
+/* millisec , an authentication waiting longer for a Verify Thread fails */
+const int AUTH_VERIFY_TIMEOUT = 5000;
+/* Verified passwords, a power of two. */
+const uint32_t AUTH_CACHE_SIZE = 256;
+/* sec */
+const int AUTH_CACHE_TTL = 60;
+/* Source addresses tracked by the rate limit, a power of two. */
+const uint32_t AUTH_SOURCES = 256;
+const int AUTH_RATE_BURST = 10;
+/* sec */
+const int AUTH_RATE_REFILL = 1;
+/* Authorized keys index, a power of two. */
+const uint32_t AUTH_KEY_BUCKETS = 1024;
+/* Host key types, in order of preference. */
+const int AUTH_HOSTKEYS_MAX = 3;
+/* Trusted certificates and cert-to-name entries of the keystore. */
+const int AUTH_TRUSTED_MAX = 64;
+const int AUTH_CTN_MAX = 64;
+
+/* Load the users of path and set up the cache key, before the Accept Thread is started. */
+int auth_init(const char* path);
+/* (Re)load the authorized keys of path, a filewatch_load_cb. */
+int auth_load_keys(const char* path);
+/* (Re)load the host keys of dir, returns how many parsed. */
+int auth_load_hostkeys(const char* dir);
+/* Offer the loaded host keys on the SSH endpoint endpt, instead of its previous ones. */
+int auth_apply_hostkeys(const char* endpt);
+/* Load the TLS keystore of dir, 0 when the TLS endpoint can be offered. */
+int auth_load_keystore(const char* dir);
+/* Server certificate, trusted certificates and cert-to-name of the TLS endpoint endpt. */
+int auth_apply_keystore(const char* endpt);
+/* Free the users and keys, once the Verify Threads are joined. */
+void auth_destroy(void);
+
+/* Verify Thread Entry Prototype */
+void* auth_verify_thread_entry(void* arg);
+/* Finish the queued verifications, then let the threads exit. */
+void auth_shutdown(void);
 
 /* SSH Authentication Callbacks */
 int auth_callback_ssh_passwd(	const struct nc_session* session,
@@ -13,11 +86,27 @@ int auth_callback_ssh_interactive(	const struct nc_session* session,
 int auth_callback_ssh_pubkey(	const struct nc_session* session,
 								ssh_key key,
 								void* user_data);
-							
+
 int auth_callback_ssh_hostkey(	const char* name,
 								void* user_data,
 								char** privkey_path,
 								char** privkey_data,
 								int* privkey_data_rsa);
 
+/* TLS Authentication Callbacks */
+int auth_callback_tls_server_cert(	const char* name,
+									void* user_data,
+									char** cert_path,
+									char** cert_data,
+									char** privkey_path,
+									char** privkey_data,
+									int* privkey_data_rsa);
+
+int auth_callback_tls_trusted_certs(	const char* name,
+										void* user_data,
+										char*** cert_paths,
+										int* cert_path_count,
+										char*** cert_data,
+										int* cert_data_count);
+
 #endif
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <nc_server.h>
+#include "datastore.h"
+#include "edit_config.h"
+#include "confirm.h"
+#include "logger.h"
+
+extern struct datastore g_ds_running;
+
+/* Pending confirmed commit, lock order : running write guard, then confirm_mutex. */
+static pthread_mutex_t confirm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t confirm_cond = PTHREAD_COND_INITIALIZER;
+static int confirm_active = 0;
+static uint64_t confirm_checkpoint = 0;
+static uint32_t confirm_sid = 0;
+static char* confirm_persist = NULL;
+static struct timespec confirm_deadline;
+static int confirm_stop = 0;
+
+static void confirm_clear(void)
+{
+	confirm_active = 0;
+	confirm_checkpoint = 0;
+	confirm_sid = 0;
+	free(confirm_persist);
+	confirm_persist = NULL;
+	pthread_cond_signal(&confirm_cond);
+}
+
+/* 
+ * Write the checkpoint back onto running as a new version, through the same diff, journal and
+ * change notification as <commit>. The caller holds the running write guard and confirm_mutex.
+ */
+static void confirm_rollback(const char* reason)
+{
+	struct ds_snapshot* checkpoint = ds_checkpoint_pin(&g_ds_running, confirm_checkpoint);
+	if(!checkpoint)
+	{
+		LOGGER_ERROR("Confirm Thread", "Checkpoint %llu no longer retained, running kept.", (unsigned long long)confirm_checkpoint);
+		confirm_clear();
+		return;
+	}
+	struct lyd_node* root = ds_write_begin(&g_ds_running);
+	struct lyd_difflist* diff = (root || checkpoint->root) ? lyd_diff(root, checkpoint->root, 0) : NULL;
+	struct edit_log log;
+	edit_log_init(&log, &root, EDIT_ROLLBACK_ON_ERROR);
+	int failed = (root || checkpoint->root) && (!diff || edit_apply_diff(&log, diff));
+	if(diff)
+		lyd_free_diff(diff);
+	ds_unpin(checkpoint);
+	
+	if(failed || !log.count)
+	{
+		edit_rollback(&log);
+		ds_write_abort(&g_ds_running, root);
+		if(failed)
+			LOGGER_ERROR("Confirm Thread", "Failed to restore checkpoint %llu, running kept.", (unsigned long long)confirm_checkpoint);
+	}
+	else
+	{
+		LOGGER_INFO("Confirm Thread", "Confirmed commit %s, running restored to checkpoint %llu, %d changes.", reason, (unsigned long long)confirm_checkpoint, log.count);
+		/* Only the undone changes are journaled, the restored tree is a new version. */
+		edit_journal(&log, &g_ds_running);
+		ds_write_publish(&g_ds_running, root);
+		ds_notify(&g_ds_running, &log, NULL);
+	}
+	if(log.reply)
+		nc_server_reply_free(log.reply);
+	edit_finish(&log);
+	confirm_clear();
+}
+
+static int confirm_expired(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec > confirm_deadline.tv_sec || (now.tv_sec == confirm_deadline.tv_sec && now.tv_nsec >= confirm_deadline.tv_nsec);
+}
+
+void* confirm_thread_entry(void* arg)
+{
+	pthread_mutex_lock(&confirm_mutex);
+	while(!confirm_stop)
+	{
+		if(!confirm_active)
+		{
+			pthread_cond_wait(&confirm_cond, &confirm_mutex);
+			continue;
+		}
+		struct timespec deadline = confirm_deadline;
+		if(pthread_cond_timedwait(&confirm_cond, &confirm_mutex, &deadline) != ETIMEDOUT)
+			continue;
+		
+		/* Respect the lock order, then check the deadline was not extended meanwhile. */
+		pthread_mutex_unlock(&confirm_mutex);
+		{
+			ds_write_guard writer(&g_ds_running);
+			pthread_mutex_lock(&confirm_mutex);
+			if(confirm_active && confirm_expired())
+				confirm_rollback("timed out");
+			pthread_mutex_unlock(&confirm_mutex);
+		}
+		pthread_mutex_lock(&confirm_mutex);
+	}
+	pthread_mutex_unlock(&confirm_mutex);
+	LOGGER_INFO("Confirm Thread", "Cleaning up allocated resource.");
+	return NULL;
+}
+
+void confirm_shutdown(void)
+{
+	pthread_mutex_lock(&confirm_mutex);
+	confirm_stop = 1;
+	pthread_cond_signal(&confirm_cond);
+	pthread_mutex_unlock(&confirm_mutex);
+}
+
+struct nc_server_error* confirm_check(uint32_t session_id, const char* persist_id)
+{
+	struct nc_server_error* e = NULL;
+	pthread_mutex_lock(&confirm_mutex);
+	if(persist_id && (!confirm_active || !confirm_persist || strcmp(persist_id, confirm_persist)))
+	{
+		e = nc_err(NC_ERR_INVALID_VALUE, NC_ERR_TYPE_PROT);
+		nc_err_set_msg(e, "[RPC Handler] No confirmed commit is pending with this persist-id.", "en");
+	}
+	else if(confirm_active && confirm_persist && !persist_id)
+	{
+		e = nc_err(NC_ERR_IN_USE, NC_ERR_TYPE_PROT);
+		nc_err_set_msg(e, "[RPC Handler] A persistent confirmed commit is pending, persist-id required.", "en");
+	}
+	else if(confirm_active && !confirm_persist && confirm_sid != session_id)
+	{
+		e = nc_err(NC_ERR_IN_USE, NC_ERR_TYPE_PROT);
+		nc_err_set_msg(e, "[RPC Handler] A confirmed commit of another session is pending.", "en");
+	}
+	pthread_mutex_unlock(&confirm_mutex);
+	return e;
+}
+
+int confirm_pending(void)
+{
+	pthread_mutex_lock(&confirm_mutex);
+	int active = confirm_active;
+	pthread_mutex_unlock(&confirm_mutex);
+	return active;
+}
+
+void confirm_start(uint64_t checkpoint, uint32_t session_id, const char* persist, uint32_t timeout)
+{
+	pthread_mutex_lock(&confirm_mutex);
+	if(!confirm_active)
+	{
+		confirm_active = 1;
+		confirm_checkpoint = checkpoint;
+	}
+	/* A follow-up confirmed commit moves the deadline, and may change the persist token. */
+	confirm_sid = session_id;
+	if(persist)
+	{
+		free(confirm_persist);
+		confirm_persist = strdup(persist);
+	}
+	clock_gettime(CLOCK_REALTIME, &confirm_deadline);
+	confirm_deadline.tv_sec += timeout;
+	LOGGER_RPC(LOGGER_LEVEL_INFO, session_id, "commit", -1, "Confirmed commit pending for %u seconds.", timeout);
+	pthread_cond_signal(&confirm_cond);
+	pthread_mutex_unlock(&confirm_mutex);
+}
+
+void confirm_accept(void)
+{
+	pthread_mutex_lock(&confirm_mutex);
+	if(confirm_active)
+		LOGGER_INFO("RPC Handler", "<commit> Confirmed commit accepted.");
+	confirm_clear();
+	pthread_mutex_unlock(&confirm_mutex);
+}
+
+void confirm_cancel(void)
+{
+	pthread_mutex_lock(&confirm_mutex);
+	if(confirm_active)
+		confirm_rollback("cancelled");
+	pthread_mutex_unlock(&confirm_mutex);
+}
+
+void confirm_session_closed(uint32_t session_id)
+{
+	/* Most sessions have nothing pending, skip the write guard then. */
+	pthread_mutex_lock(&confirm_mutex);
+	int owned = confirm_active && !confirm_persist && confirm_sid == session_id;
+	pthread_mutex_unlock(&confirm_mutex);
+	if(!owned)
+		return;
+	
+	ds_write_guard writer(&g_ds_running);
+	pthread_mutex_lock(&confirm_mutex);
+	if(confirm_active && !confirm_persist && confirm_sid == session_id)
+		confirm_rollback("not confirmed before the session closed");
+	pthread_mutex_unlock(&confirm_mutex);
+}
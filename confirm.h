@@ -0,0 +1,33 @@
+#ifndef CONFIRM_H
+#define CONFIRM_H
+#include <stdint.h>
+
+/* 
+ * Confirmed Commit, RFC 6241 8.4 : running is checkpointed before a <commit><confirmed/>,
+ * and the checkpoint is written back as a new version when the commit is cancelled, not
+ * confirmed before its timeout, or when the issuing session closes without <persist>.
+ */
+
+/* seconds */
+const uint32_t CONFIRM_TIMEOUT_DEFAULT = 600;
+
+/* Confirm Thread Entry Prototype, rolls back confirmed commits on timeout. */
+void* confirm_thread_entry(void* arg);
+void confirm_shutdown(void);
+
+/* The following are only called while holding the write guard of running. */
+/* NULL when the session may confirm or cancel, otherwise the error to reply. */
+struct nc_server_error* confirm_check(uint32_t session_id, const char* persist_id);
+/* Non-zero while a confirmed commit waits for its confirmation. */
+int confirm_pending(void);
+/* Start a confirmed commit restoring checkpoint, or extend the pending one. */
+void confirm_start(uint64_t checkpoint, uint32_t session_id, const char* persist, uint32_t timeout);
+/* Confirming <commit> : running is kept. */
+void confirm_accept(void);
+/* <cancel-commit> : running is restored. */
+void confirm_cancel(void);
+
+/* Session closed, its pending confirmed commit is rolled back unless persisted. */
+void confirm_session_closed(uint32_t session_id);
+
+#endif
@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <nc_server.h>
+#include "datastore.h"
+#include "metrics.h"
+#include "logger.h"
+
+/* Dropped versions, freed by the Reclaim Thread off the readers' and writers' paths. */
+static pthread_mutex_t ds_reclaim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ds_reclaim_cond = PTHREAD_COND_INITIALIZER;
+static struct ds_snapshot* ds_reclaim_head = NULL;
+static int ds_reclaim_running = 0;
+static int ds_reclaim_stop = 0;
+
+/* libyang keeps prev of the first sibling pointing to the last one. */
+static struct lyd_node* ds_first_sibling(struct lyd_node* node)
+{
+	if(!node)
+		return NULL;
+	while(node->prev->next)
+		node = node->prev;
+	return node;
+}
+
+struct ds_snapshot* ds_snapshot_new(struct lyd_node* root, uint64_t version)
+{
+	struct ds_snapshot* snap = new ds_snapshot;
+	snap->root = root;
+	snap->version = version;
+	/* The reference held by datastore->current. */
+	snap->refcount = 1;
+	snap->origin = NULL;
+	snap->xml = NULL;
+	snap->reclaim_next = NULL;
+	return snap;
+}
+
+static void ds_snapshot_delete(struct ds_snapshot* snap)
+{
+	free(snap->xml.load());
+	delete snap;
+}
+
+const char* ds_snapshot_xml(struct ds_snapshot* snap)
+{
+	char* xml = snap->xml.load();
+	if(xml || !snap->root)
+		return xml;
+	if(lyd_print_mem(&xml, snap->root, LYD_XML, LYP_WITHSIBLINGS | LYP_WD_ALL) || !xml)
+		return NULL;
+	char* printed = NULL;
+	if(!snap->xml.compare_exchange_strong(printed, xml))
+	{
+		/* Printed concurrently by another reader, keep the first one. */
+		free(xml);
+		xml = printed;
+	}
+	return xml;
+}
+
+void ds_init(struct datastore* ds, const char* name, struct lyd_node* root)
+{
+	ds->name = name;
+	pthread_mutex_init(&ds->write_mutex, NULL);
+	ds->lock_wait_metric = metrics_histogram("netconf_datastore_lock_wait_seconds", "datastore", name);
+	ds->lock_sid = 0;
+	ds->lock_time = 0;
+	pthread_mutex_init(&ds->pin_mutex, NULL);
+	pthread_cond_init(&ds->pin_cond, NULL);
+	ds->writing = 0;
+	ds->pin_wait_metric = metrics_histogram("netconf_datastore_pin_wait_seconds", "datastore", name);
+	ds->pin_waits = 0;
+	ds->pin_wait_usec = 0;
+	ds->copies = 0;
+	ds->version = 1;
+	ds->listener_count = 0;
+	ds->checkpoint_depth = DS_CHECKPOINTS_DEFAULT;
+	ds->checkpoint_head = 0;
+	ds->checkpoint_count = 0;
+	ds->current = ds_snapshot_new(ds_first_sibling(root), ds->version);
+}
+
+void ds_destroy(struct datastore* ds)
+{
+	for(int i = 0; i < ds->checkpoint_count; i++)
+		ds_unpin(ds->checkpoints[(ds->checkpoint_head + i) % DS_CHECKPOINTS_MAX]);
+	ds->checkpoint_count = 0;
+	ds_unpin(ds->current);
+	ds->current = NULL;
+	pthread_cond_destroy(&ds->pin_cond);
+	pthread_mutex_destroy(&ds->pin_mutex);
+	pthread_mutex_destroy(&ds->write_mutex);
+}
+
+struct ds_snapshot* ds_pin(struct datastore* ds)
+{
+	pthread_mutex_lock(&ds->pin_mutex);
+	/* Only an unshared snapshot is written in place, wait for it to be published. */
+	if(ds->writing)
+	{
+		uint64_t start = metrics_now();
+		while(ds->writing)
+			pthread_cond_wait(&ds->pin_cond, &ds->pin_mutex);
+		uint64_t usec = metrics_now() - start;
+		ds->pin_waits++;
+		ds->pin_wait_usec += usec;
+		metrics_record(ds->pin_wait_metric, usec);
+	}
+	struct ds_snapshot* snap = ds->current;
+	snap->refcount++;
+	pthread_mutex_unlock(&ds->pin_mutex);
+	return snap;
+}
+
+void ds_unpin(struct ds_snapshot* snap)
+{
+	if(--snap->refcount)
+		return;
+	if(snap->origin || !snap->root)
+	{
+		/* Nothing of its own to free. */
+		if(snap->origin)
+			ds_unpin(snap->origin);
+		ds_snapshot_delete(snap);
+		return;
+	}
+	pthread_mutex_lock(&ds_reclaim_mutex);
+	if(ds_reclaim_running)
+	{
+		snap->reclaim_next = ds_reclaim_head;
+		ds_reclaim_head = snap;
+		if(!snap->reclaim_next)
+			pthread_cond_signal(&ds_reclaim_cond);
+		pthread_mutex_unlock(&ds_reclaim_mutex);
+		return;
+	}
+	pthread_mutex_unlock(&ds_reclaim_mutex);
+	lyd_free_withsiblings(snap->root);
+	ds_snapshot_delete(snap);
+}
+
+void* ds_reclaim_thread_entry(void* arg)
+{
+	LOGGER_INFO("Reclaim Thread", "Started.");
+	pthread_mutex_lock(&ds_reclaim_mutex);
+	ds_reclaim_running = 1;
+	while(1)
+	{
+		struct ds_snapshot* snap = ds_reclaim_head;
+		ds_reclaim_head = NULL;
+		int stop = ds_reclaim_stop;
+		if(stop)
+			ds_reclaim_running = 0;
+		pthread_mutex_unlock(&ds_reclaim_mutex);
+		
+		while(snap)
+		{
+			struct ds_snapshot* next = snap->reclaim_next;
+			lyd_free_withsiblings(snap->root);
+			ds_snapshot_delete(snap);
+			snap = next;
+		}
+		if(stop)
+			break;
+		
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += DS_RECLAIM_TIMEOUT / 1000;
+		pthread_mutex_lock(&ds_reclaim_mutex);
+		if(!ds_reclaim_head && !ds_reclaim_stop)
+			pthread_cond_timedwait(&ds_reclaim_cond, &ds_reclaim_mutex, &deadline);
+	}
+	LOGGER_INFO("Reclaim Thread", "Cleaning up allocated resource.");
+	return NULL;
+}
+
+void ds_reclaim_shutdown(void)
+{
+	pthread_mutex_lock(&ds_reclaim_mutex);
+	ds_reclaim_stop = 1;
+	pthread_cond_signal(&ds_reclaim_cond);
+	pthread_mutex_unlock(&ds_reclaim_mutex);
+}
+
+struct lyd_node* ds_write_begin(struct datastore* ds)
+{
+	struct lyd_node* root;
+	pthread_mutex_lock(&ds->pin_mutex);
+	if(ds->current->refcount == 1 && !ds->current->origin)
+	{
+		/* Nobody else sees this version, no copy needed, its printed XML goes stale. */
+		ds->writing = 1;
+		root = ds->current->root;
+		free(ds->current->xml.exchange(NULL));
+		pthread_mutex_unlock(&ds->pin_mutex);
+		return root;
+	}
+	/* Pinned by readers, keep their version intact and write a private copy of the whole tree. */
+	struct ds_snapshot* snap = ds->current;
+	snap->refcount++;
+	ds->copies++;
+	pthread_mutex_unlock(&ds->pin_mutex);
+	
+	root = snap->root ? lyd_dup_withsiblings(snap->root, LYD_DUP_OPT_RECURSIVE) : NULL;
+	ds_unpin(snap);
+	return root;
+}
+
+void ds_write_publish(struct datastore* ds, struct lyd_node* root)
+{
+	root = ds_first_sibling(root);
+	pthread_mutex_lock(&ds->pin_mutex);
+	ds->version++;
+	if(ds->writing)
+	{
+		ds->current->root = root;
+		ds->current->version = ds->version;
+		ds->writing = 0;
+		pthread_cond_broadcast(&ds->pin_cond);
+		pthread_mutex_unlock(&ds->pin_mutex);
+		return;
+	}
+	struct ds_snapshot* old = ds->current;
+	ds->current = ds_snapshot_new(root, ds->version);
+	pthread_mutex_unlock(&ds->pin_mutex);
+	
+	/* Readers still holding the previous version free it with their last unpin. */
+	ds_unpin(old);
+}
+
+void ds_write_abort(struct datastore* ds, struct lyd_node* root)
+{
+	pthread_mutex_lock(&ds->pin_mutex);
+	if(ds->writing)
+	{
+		/* Restoring the content may still have reordered the top-level siblings. */
+		ds->current->root = ds_first_sibling(root);
+		ds->writing = 0;
+		pthread_cond_broadcast(&ds->pin_cond);
+		pthread_mutex_unlock(&ds->pin_mutex);
+		return;
+	}
+	pthread_mutex_unlock(&ds->pin_mutex);
+	lyd_free_withsiblings(root);
+}
+
+/* Make snap the current version, the previous one is dropped as a whole. */
+static void ds_write_swap(struct datastore* ds, struct ds_snapshot* snap)
+{
+	pthread_mutex_lock(&ds->pin_mutex);
+	ds->version++;
+	snap->version = ds->version;
+	struct ds_snapshot* old = ds->current;
+	ds->current = snap;
+	pthread_mutex_unlock(&ds->pin_mutex);
+	ds_unpin(old);
+}
+
+void ds_write_replace(struct datastore* ds, struct lyd_node* root)
+{
+	ds_write_swap(ds, ds_snapshot_new(ds_first_sibling(root), 0));
+}
+
+void ds_write_share(struct datastore* ds, struct ds_snapshot* source)
+{
+	struct ds_snapshot* snap = ds_snapshot_new(source->root, 0);
+	snap->origin = source;
+	ds_write_swap(ds, snap);
+}
+
+void ds_set_checkpoints(struct datastore* ds, int depth)
+{
+	if(depth < 1)
+		depth = 1;
+	if(depth > DS_CHECKPOINTS_MAX)
+		depth = DS_CHECKPOINTS_MAX;
+	ds->checkpoint_depth = depth;
+}
+
+uint64_t ds_checkpoint(struct datastore* ds)
+{
+	pthread_mutex_lock(&ds->pin_mutex);
+	struct ds_snapshot* snap = ds->current;
+	if(ds->checkpoint_count && ds->checkpoints[(ds->checkpoint_head + ds->checkpoint_count - 1) % DS_CHECKPOINTS_MAX] == snap)
+	{
+		/* Nothing written since the last checkpoint. */
+		pthread_mutex_unlock(&ds->pin_mutex);
+		return snap->version;
+	}
+	snap->refcount++;
+	struct ds_snapshot* evicted = NULL;
+	if(ds->checkpoint_count == ds->checkpoint_depth)
+	{
+		evicted = ds->checkpoints[ds->checkpoint_head];
+		ds->checkpoint_head = (ds->checkpoint_head + 1) % DS_CHECKPOINTS_MAX;
+		ds->checkpoint_count--;
+	}
+	ds->checkpoints[(ds->checkpoint_head + ds->checkpoint_count) % DS_CHECKPOINTS_MAX] = snap;
+	ds->checkpoint_count++;
+	pthread_mutex_unlock(&ds->pin_mutex);
+	
+	if(evicted)
+		ds_unpin(evicted);
+	return snap->version;
+}
+
+struct ds_snapshot* ds_checkpoint_pin(struct datastore* ds, uint64_t version)
+{
+	struct ds_snapshot* snap = NULL;
+	pthread_mutex_lock(&ds->pin_mutex);
+	for(int i = 0; i < ds->checkpoint_count; i++)
+	{
+		struct ds_snapshot* entry = ds->checkpoints[(ds->checkpoint_head + i) % DS_CHECKPOINTS_MAX];
+		if(entry->version == version)
+			snap = entry;
+	}
+	if(snap)
+		snap->refcount++;
+	pthread_mutex_unlock(&ds->pin_mutex);
+	return snap;
+}
+
+/* Take write_mutex, the clock is only read when it is contended. */
+static void ds_write_lock(struct datastore* ds)
+{
+	if(!pthread_mutex_trylock(&ds->write_mutex))
+	{
+		metrics_record(ds->lock_wait_metric, 0);
+		return;
+	}
+	uint64_t start = metrics_now();
+	pthread_mutex_lock(&ds->write_mutex);
+	metrics_record(ds->lock_wait_metric, metrics_now() - start);
+}
+
+uint32_t ds_lock(struct datastore* ds, uint32_t session_id)
+{
+	/* Not granted in the middle of a write. */
+	ds_write_lock(ds);
+	uint32_t owner = 0;
+	if(!ds->lock_sid.compare_exchange_strong(owner, session_id))
+	{
+		pthread_mutex_unlock(&ds->write_mutex);
+		return owner;
+	}
+	ds->lock_time = time(NULL);
+	pthread_mutex_unlock(&ds->write_mutex);
+	return 0;
+}
+
+int ds_unlock(struct datastore* ds, uint32_t session_id, uint32_t* owner)
+{
+	uint32_t current = session_id;
+	if(!ds->lock_sid.compare_exchange_strong(current, 0))
+	{
+		if(owner)
+			*owner = current;
+		return 1;
+	}
+	return 0;
+}
+
+int ds_listen(struct datastore* ds, ds_listener_cb cb, void* arg)
+{
+	if(ds->listener_count == DS_LISTENERS_MAX)
+		return 1;
+	ds->listeners[ds->listener_count] = cb;
+	ds->listener_args[ds->listener_count] = arg;
+	ds->listener_count++;
+	return 0;
+}
+
+void ds_notify(struct datastore* ds, const struct edit_log* log, struct nc_session* session)
+{
+	for(int i = 0; i < ds->listener_count; i++)
+		ds->listeners[i](ds, log, session, ds->listener_args[i]);
+}
+
+ds_write_guard::ds_write_guard(struct datastore* ds) : ds(ds), root(NULL), begun(0)
+{
+	ds_write_lock(ds);
+}
+
+ds_write_guard::~ds_write_guard()
+{
+	if(begun)
+		abort();
+	pthread_mutex_unlock(&ds->write_mutex);
+}
+
+uint32_t ds_write_guard::denied(uint32_t session_id) const
+{
+	uint32_t owner = ds->lock_sid;
+	return (owner == 0 || owner == session_id) ? 0 : owner;
+}
+
+struct lyd_node** ds_write_guard::begin()
+{
+	root = ds_write_begin(ds);
+	begun = 1;
+	return &root;
+}
+
+void ds_write_guard::publish()
+{
+	ds_write_publish(ds, root);
+	begun = 0;
+}
+
+void ds_write_guard::abort()
+{
+	ds_write_abort(ds, root);
+	begun = 0;
+}
+
+void ds_write_guard::replace(struct lyd_node* root)
+{
+	ds_write_replace(ds, root);
+}
+
+void ds_write_guard::share(struct ds_snapshot* source)
+{
+	ds_write_share(ds, source);
+}
@@ -0,0 +1,189 @@
+#ifndef DATASTORE_H
+#define DATASTORE_H
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <atomic>
+
+/* One immutable version of a datastore tree, freed with its last reference. */
+struct ds_snapshot
+{
+	struct lyd_node* root;
+	uint64_t version;
+	std::atomic<uint32_t> refcount;
+	/* Pinned version whose tree root is borrowed from, NULL when root is owned. */
+	struct ds_snapshot* origin;
+	/* XML of the whole tree, printed by the first ds_snapshot_xml() of this version. */
+	std::atomic<char*> xml;
+	/* Queue of the Reclaim Thread. */
+	struct ds_snapshot* reclaim_next;
+};
+
+struct datastore;
+struct edit_log;
+struct nc_session;
+
+/* 
+ * Change listener, called by the writer after publishing, still under write_mutex.
+ * The logged nodes are only valid during the call, session is NULL for server made changes.
+ */
+typedef void (*ds_listener_cb)(struct datastore* ds, const struct edit_log* log, struct nc_session* session, void* arg);
+const int DS_LISTENERS_MAX = 8;
+
+/* millisec , only bounds how fast the Reclaim Thread notices a shutdown */
+const int DS_RECLAIM_TIMEOUT = 1000;
+
+/* Confirmed-commit checkpoints retained for rollback, see ds_checkpoint(). */
+const int DS_CHECKPOINTS_DEFAULT = 8;
+const int DS_CHECKPOINTS_MAX = 64;
+
+/* 
+ * Versioned Datastore, three independent levels of access control :
+ * readers pin the current snapshot instead of copying or locking it,
+ * writers are exclusive through write_mutex (see ds_write_guard),
+ * and the NETCONF <lock> owner only decides which session may write.
+ *
+ * Reads are not lock-free. A write is done in place when nobody holds a pin, and readers
+ * arriving meanwhile wait in ds_pin() until it is published or aborted, validation included.
+ * A write while any pin is held copies the whole tree instead, libyang 1.x nodes carry parent
+ * pointers, so versions can not share unmodified subtrees. Both costs are counted below and
+ * exported as netconf_datastore_pin_wait_seconds and netconf_datastore_copies.
+ */
+struct datastore
+{
+	const char* name;
+	/* Serializes writers and NETCONF lock changes. */
+	pthread_mutex_t write_mutex;
+	/* Histogram of the time spent waiting for write_mutex. */
+	int lock_wait_metric;
+	/* NETCONF <lock> owner session id, 0 when unlocked. */
+	std::atomic<uint32_t> lock_sid;
+	/* When lock_sid took the lock, for ietf-netconf-monitoring. */
+	std::atomic<time_t> lock_time;
+	/* Guards current/writing, only held for pointer swaps. */
+	pthread_mutex_t pin_mutex;
+	pthread_cond_t pin_cond;
+	struct ds_snapshot* current;
+	/* Set while a writer modifies the unshared current snapshot in place. */
+	int writing;
+	/* Histogram of the time pins waited for an in-place write. */
+	int pin_wait_metric;
+	/* Under pin_mutex : pins which waited, their total wait, and writes which copied the tree. */
+	uint64_t pin_waits;
+	uint64_t pin_wait_usec;
+	uint64_t copies;
+	uint64_t version;
+	/* Registered before the server threads start, never changed afterwards. */
+	ds_listener_cb listeners[DS_LISTENERS_MAX];
+	void* listener_args[DS_LISTENERS_MAX];
+	int listener_count;
+	/* Ring of the last checkpoint_depth checkpoints, the oldest at checkpoint_head. */
+	struct ds_snapshot* checkpoints[DS_CHECKPOINTS_MAX];
+	int checkpoint_depth;
+	int checkpoint_head;
+	int checkpoint_count;
+};
+
+/* Datastore lifecycle, ds_init() takes the ownership of root. */
+void ds_init(struct datastore* ds, const char* name, struct lyd_node* root);
+void ds_destroy(struct datastore* ds);
+
+/* 
+ * Readers : pin the current version, the pinned tree must never be modified.
+ * The tree of a version dropped by its last ds_unpin() is freed by the Reclaim Thread.
+ */
+struct ds_snapshot* ds_pin(struct datastore* ds);
+void ds_unpin(struct ds_snapshot* snap);
+/* Standalone snapshot holding one reference, for trees versioned outside a datastore. */
+struct ds_snapshot* ds_snapshot_new(struct lyd_node* root, uint64_t version);
+/* XML of a pinned snapshot, printed once per version and freed with it. NULL for an empty tree. */
+const char* ds_snapshot_xml(struct ds_snapshot* snap);
+
+/* 
+ * Writers : only while holding ds->write_mutex, use ds_write_guard.
+ * ds_write_begin() hands out the current tree in place when nobody has it pinned,
+ * and a private copy otherwise (copy-on-write). The result must be passed to
+ * ds_write_publish(), or to ds_write_abort() with its content restored.
+ */
+struct lyd_node* ds_write_begin(struct datastore* ds);
+void ds_write_publish(struct datastore* ds, struct lyd_node* root);
+void ds_write_abort(struct datastore* ds, struct lyd_node* root);
+/* 
+ * Writers : publish a whole new version without ds_write_begin(), nothing of the previous one
+ * is copied or freed on the way. ds_write_replace() takes the ownership of root (NULL empties ds),
+ * ds_write_share() borrows the tree of source, taking over its pin, e.g. <discard-changes>.
+ */
+void ds_write_replace(struct datastore* ds, struct lyd_node* root);
+void ds_write_share(struct datastore* ds, struct ds_snapshot* source);
+
+/* 
+ * Rollback checkpoints, only while holding ds->write_mutex. Only versions explicitly
+ * checkpointed are retained, not every committed version, so rolling back is a diff
+ * against the checkpoint applied as a new version, never a pointer swap.
+ * ds_checkpoint() retains the current version in the checkpoint ring and returns its version,
+ * a retained version is never written in place, the next write copies it once, so only
+ * take one when a rollback may follow. ds_checkpoint_pin() pins a retained checkpoint, NULL
+ * when it is not retained anymore, to be written back as a new version like any other change.
+ */
+void ds_set_checkpoints(struct datastore* ds, int depth);
+uint64_t ds_checkpoint(struct datastore* ds);
+struct ds_snapshot* ds_checkpoint_pin(struct datastore* ds, uint64_t version);
+
+/* Reclaim Thread Entry Prototype, dropped versions are freed at once while it is not running. */
+void* ds_reclaim_thread_entry(void* arg);
+/* Free what is queued, then let the thread exit. */
+void ds_reclaim_shutdown(void);
+
+/* NETCONF <lock>, return 0 on success, otherwise the current owner. */
+uint32_t ds_lock(struct datastore* ds, uint32_t session_id);
+/* NETCONF <unlock>, return 0 on success, otherwise 1 and the current owner (0 : not locked). */
+int ds_unlock(struct datastore* ds, uint32_t session_id, uint32_t* owner);
+
+/* Register a change listener, returns non-zero when there is no room left. */
+int ds_listen(struct datastore* ds, ds_listener_cb cb, void* arg);
+/* Hand the changes of a published write to the listeners. */
+void ds_notify(struct datastore* ds, const struct edit_log* log, struct nc_session* session);
+
+/* Pinned snapshot for the scope of the guard. */
+class ds_read_guard
+{
+public:
+	explicit ds_read_guard(struct datastore* ds) : snap(ds_pin(ds)) {}
+	~ds_read_guard() { if(snap) ds_unpin(snap); }
+	struct lyd_node* root() const { return snap->root; }
+	/* Hand the pin over, e.g. to persist_submit(). */
+	struct ds_snapshot* release() { struct ds_snapshot* ret = snap; snap = NULL; return ret; }
+private:
+	struct ds_snapshot* snap;
+	ds_read_guard(const ds_read_guard&) = delete;
+	ds_read_guard& operator=(const ds_read_guard&) = delete;
+};
+
+/* 
+ * Exclusive writer for the scope of the guard. A write begun with begin() and
+ * neither published nor aborted is aborted by the destructor, so in place
+ * writes must have restored the tree before any early return.
+ */
+class ds_write_guard
+{
+public:
+	explicit ds_write_guard(struct datastore* ds);
+	~ds_write_guard();
+	/* 0 when session_id may write, otherwise the NETCONF lock owner. */
+	uint32_t denied(uint32_t session_id) const;
+	/* Writable root, see ds_write_begin(). */
+	struct lyd_node** begin();
+	void publish();
+	void abort();
+	/* Instead of begin(), see ds_write_replace() and ds_write_share(). */
+	void replace(struct lyd_node* root);
+	void share(struct ds_snapshot* source);
+private:
+	struct datastore* ds;
+	struct lyd_node* root;
+	int begun;
+	ds_write_guard(const ds_write_guard&) = delete;
+	ds_write_guard& operator=(const ds_write_guard&) = delete;
+};
+
+#endif
@@ -0,0 +1,540 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nc_server.h>
+#include "datastore.h"
+#include "persist.h"
+#include "edit_config.h"
+
+static struct edit_change* edit_log_add(struct edit_log* log, enum edit_change_type type, struct lyd_node* node)
+{
+	if(log->count == log->size)
+	{
+		log->size = log->size ? log->size * 2 : 16;
+		log->changes = (struct edit_change*)realloc(log->changes, log->size * sizeof(struct edit_change));
+	}
+	struct edit_change* change = &log->changes[log->count++];
+	change->type = type;
+	change->node = node;
+	change->parent = NULL;
+	change->next = NULL;
+	change->path = NULL;
+	change->anchor = NULL;
+	change->old_value = NULL;
+	return change;
+}
+
+void edit_log_init(struct edit_log* log, struct lyd_node** root, enum edit_error_option error_option)
+{
+	log->root = root;
+	log->error_option = error_option;
+	log->changes = NULL;
+	log->count = 0;
+	log->size = 0;
+	log->reply = NULL;
+	log->errors = 0;
+}
+
+/* Record an <rpc-error>, returns non-zero when the edit has to stop. */
+static int edit_error(struct edit_log* log, struct lyd_node* edit, struct nc_server_error* e)
+{
+	char* path = lyd_path(edit);
+	if(path)
+	{
+		nc_err_set_path(e, path);
+		free(path);
+	}
+	if(log->reply)
+		nc_server_reply_add_err(log->reply, e);
+	else
+		log->reply = nc_server_reply_err(e);
+	log->errors++;
+	return log->error_option != EDIT_CONTINUE_ON_ERROR;
+}
+
+static enum edit_op edit_get_op(struct lyd_node* edit, enum edit_op inherited)
+{
+	struct lyd_attr* attr;
+	LY_TREE_FOR(edit->attr, attr)
+	{
+		if(strcmp(attr->name, "operation"))
+			continue;
+		if(!strcmp(attr->value_str, "merge"))
+			return EDIT_OP_MERGE;
+		if(!strcmp(attr->value_str, "replace"))
+			return EDIT_OP_REPLACE;
+		if(!strcmp(attr->value_str, "create"))
+			return EDIT_OP_CREATE;
+		if(!strcmp(attr->value_str, "delete"))
+			return EDIT_OP_DELETE;
+		if(!strcmp(attr->value_str, "remove"))
+			return EDIT_OP_REMOVE;
+	}
+	return inherited;
+}
+
+/* Does the subtree of edit request a change of one of the given operations? */
+static int edit_has_op(struct lyd_node* edit, int write_ops)
+{
+	struct lyd_node* child;
+	LY_TREE_FOR(edit->child, child)
+	{
+		enum edit_op op = edit_get_op(child, EDIT_OP_NONE);
+		if(write_ops && (op == EDIT_OP_MERGE || op == EDIT_OP_REPLACE || op == EDIT_OP_CREATE))
+			return 1;
+		if(!write_ops && op == EDIT_OP_DELETE)
+			return 1;
+		if(!(child->schema->nodetype & (LYS_LEAF | LYS_LEAFLIST | LYS_ANYDATA)) && edit_has_op(child, write_ops))
+			return 1;
+	}
+	return 0;
+}
+
+static int edit_is_key(struct lyd_node* node)
+{
+	return (node->schema->nodetype == LYS_LEAF) && lys_is_key((const struct lys_node_leaf*)node->schema, NULL);
+}
+
+/* Unlink a target node, kept in the log until the edit is finished. */
+static void edit_remove(struct edit_log* log, struct lyd_node* node)
+{
+	struct edit_change* change = edit_log_add(log, EDIT_CHANGE_REMOVED, node);
+	change->parent = node->parent;
+	change->next = node->next;
+	change->path = lyd_path(node);
+	if(node == *log->root)
+		*log->root = node->next;
+	lyd_unlink(node);
+}
+
+static int edit_node(struct edit_log* log, struct lyd_node* edit, struct lyd_node* parent, enum edit_op op);
+
+static int edit_children(struct edit_log* log, struct lyd_node* edit, struct lyd_node* target, enum edit_op op)
+{
+	struct lyd_node* child;
+	LY_TREE_FOR(edit->child, child)
+	{
+		/* List keys identify the instance, they are never edited. */
+		if(edit_is_key(child))
+			continue;
+		if(edit_node(log, child, target, op))
+			return 1;
+	}
+	return 0;
+}
+
+/* Create the edit node under parent, then apply its children to it. */
+static int edit_create(struct edit_log* log, struct lyd_node* edit, struct lyd_node* parent, enum edit_op op)
+{
+	/* Lists are duplicated along with their keys. */
+	struct lyd_node* node = lyd_dup(edit, LYD_DUP_OPT_NO_ATTR);
+	if(!node)
+		return edit_error(log, edit, nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP));
+	if(parent)
+		lyd_insert(parent, node);
+	else if(*log->root)
+		lyd_insert_sibling(log->root, node);
+	else
+		*log->root = node;
+	edit_log_add(log, EDIT_CHANGE_CREATED, node);
+	
+	if(edit->schema->nodetype & (LYS_LEAF | LYS_LEAFLIST | LYS_ANYDATA))
+		return 0;
+	return edit_children(log, edit, node, op);
+}
+
+/* Merge the edit node into its existing instance. */
+static int edit_merge(struct edit_log* log, struct lyd_node* edit, struct lyd_node* match, enum edit_op op)
+{
+	switch(edit->schema->nodetype)
+	{
+		case LYS_LEAF:
+		{
+			struct lyd_node_leaf_list* leaf = (struct lyd_node_leaf_list*)match;
+			const char* value = ((struct lyd_node_leaf_list*)edit)->value_str;
+			if(!match->dflt && !strcmp(leaf->value_str, value))
+				return 0;
+			struct edit_change* change = edit_log_add(log, EDIT_CHANGE_VALUE, match);
+			change->old_value = strdup(leaf->value_str);
+			if(lyd_change_leaf(leaf, value) < 0)
+				return edit_error(log, edit, nc_err(NC_ERR_INVALID_VALUE, NC_ERR_TYPE_APP));
+			return 0;
+		}
+		case LYS_LEAFLIST:
+			return 0;
+		case LYS_ANYXML:
+		case LYS_ANYDATA:
+		{
+			/* No structure to merge, the value is replaced. */
+			struct lyd_node* parent = match->parent;
+			edit_remove(log, match);
+			return edit_create(log, edit, parent, op);
+		}
+		default:
+			return edit_children(log, edit, match, op);
+	}
+}
+
+static int edit_node(struct edit_log* log, struct lyd_node* edit, struct lyd_node* parent, enum edit_op op)
+{
+	op = edit_get_op(edit, op);
+	
+	/* Hashed lookup of the same instance among the target siblings. */
+	struct lyd_node* siblings = parent ? parent->child : *log->root;
+	struct lyd_node* match = NULL;
+	if(siblings && lyd_find_sibling(siblings, edit, &match))
+		match = NULL;
+	
+	switch(op)
+	{
+		case EDIT_OP_CREATE:
+			if(match)
+				return edit_error(log, edit, nc_err(NC_ERR_DATA_EXISTS));
+			return edit_create(log, edit, parent, op);
+		case EDIT_OP_MERGE:
+			if(!match)
+				return edit_create(log, edit, parent, op);
+			return edit_merge(log, edit, match, op);
+		case EDIT_OP_REPLACE:
+			if(match)
+				edit_remove(log, match);
+			return edit_create(log, edit, parent, op);
+		case EDIT_OP_DELETE:
+			if(!match)
+				return edit_error(log, edit, nc_err(NC_ERR_DATA_MISSING));
+			edit_remove(log, match);
+			return 0;
+		case EDIT_OP_REMOVE:
+			if(match)
+				edit_remove(log, match);
+			return 0;
+		case EDIT_OP_NONE:
+		default:
+			/* No children to walk, without an operation of its own it only names the node. */
+			if(edit->schema->nodetype & (LYS_LEAF | LYS_LEAFLIST | LYS_ANYXML | LYS_ANYDATA))
+				return 0;
+			if(match)
+				return edit_children(log, edit, match, op);
+			/* Missing level, only created when a descendant writes below it. */
+			if(edit_has_op(edit, 1))
+				return edit_create(log, edit, parent, op);
+			if(edit_has_op(edit, 0))
+				return edit_error(log, edit, nc_err(NC_ERR_DATA_MISSING));
+			return 0;
+	}
+}
+
+int edit_apply(struct edit_log* log, struct lyd_node* edit, enum edit_op default_op)
+{
+	struct lyd_node* node;
+	LY_TREE_FOR(edit, node)
+	{
+		if(edit_node(log, node, NULL, default_op))
+			break;
+	}
+	return log->errors;
+}
+
+/* Keep *log->root on the first top-level sibling after node was moved among them. */
+static void edit_fix_root(struct edit_log* log, struct lyd_node* node)
+{
+	if(node->parent)
+		return;
+	while(node->prev->next)
+		node = node->prev;
+	*log->root = node;
+}
+
+/* 
+ * Move a user ordered instance after prev, or in front of the instances of its list.
+ * The node itself is relinked, so the journal records a move instead of a delete and a create.
+ */
+static void edit_move(struct edit_log* log, struct lyd_node* node, struct lyd_node* prev)
+{
+	struct edit_change* change = edit_log_add(log, EDIT_CHANGE_MOVED, node);
+	change->parent = node->parent;
+	change->next = node->next;
+	change->path = lyd_path(node);
+	change->anchor = prev ? lyd_path(prev) : NULL;
+	if(prev)
+	{
+		lyd_insert_after(prev, node);
+	}
+	else
+	{
+		struct lyd_node* front = node->parent ? node->parent->child : *log->root;
+		while(front->prev->next)
+			front = front->prev;
+		while(front->schema != node->schema)
+			front = front->next;
+		if(front != node)
+			lyd_insert_before(front, node);
+	}
+	edit_fix_root(log, node);
+}
+
+/* Copy src with its subtree under parent, appended, the copy is returned in *copy. */
+static int edit_copy(struct edit_log* log, struct lyd_node* src, struct lyd_node* parent, struct lyd_node** copy)
+{
+	struct lyd_node* node = lyd_dup(src, LYD_DUP_OPT_RECURSIVE | LYD_DUP_OPT_NO_ATTR);
+	*copy = node;
+	if(!node)
+		return edit_error(log, src, nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP));
+	if(parent)
+		lyd_insert(parent, node);
+	else if(*log->root)
+		lyd_insert_sibling(log->root, node);
+	else
+		*log->root = node;
+	edit_log_add(log, EDIT_CHANGE_CREATED, node);
+	return 0;
+}
+
+/* 
+ * Move the user ordered copy node after the instance matching prev, a node of the source tree,
+ * or in front of its list when prev is NULL. Nothing is logged when it is there already.
+ */
+static int edit_place(struct edit_log* log, struct lyd_node* node, struct lyd_node* prev)
+{
+	struct lyd_node* siblings = node->parent ? node->parent->child : *log->root;
+	struct lyd_node* anchor = NULL;
+	if(prev && (lyd_find_sibling(siblings, prev, &anchor) || !anchor))
+		return edit_error(log, prev, nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP));
+	if(anchor ? anchor->next == node : (!node->prev->next || node->prev->schema != node->schema))
+		return 0;
+	edit_move(log, node, anchor);
+	return 0;
+}
+
+int edit_apply_diff(struct edit_log* log, struct lyd_difflist* diff)
+{
+	/* Created instances by the source node they were copied from, same index in both sets. */
+	struct ly_set* sources = ly_set_new();
+	struct ly_set* copies = ly_set_new();
+	for(int i = 0; diff->type[i] != LYD_DIFF_END; i++)
+	{
+		struct lyd_node* first = diff->first[i];
+		struct lyd_node* second = diff->second[i];
+		int stop = 0;
+		switch(diff->type[i])
+		{
+			case LYD_DIFF_DELETED:
+				edit_remove(log, first);
+				break;
+			case LYD_DIFF_CREATED:
+			{
+				/* first : parent in our tree, second : the whole created subtree. */
+				struct lyd_node* copy = NULL;
+				stop = edit_copy(log, second, first, &copy);
+				if(copy)
+				{
+					ly_set_add(sources, second, LY_SET_OPT_USEASLIST);
+					ly_set_add(copies, copy, LY_SET_OPT_USEASLIST);
+				}
+				break;
+			}
+			case LYD_DIFF_CHANGED:
+				if(first->schema->nodetype == LYS_LEAF)
+				{
+					stop = edit_merge(log, second, first, EDIT_OP_MERGE);
+				}
+				else
+				{
+					struct lyd_node* parent = first->parent;
+					edit_remove(log, first);
+					struct lyd_node* copy;
+					stop = edit_copy(log, second, parent, &copy);
+				}
+				break;
+			case LYD_DIFF_MOVEDAFTER1:
+				/* User ordered instance moved after second, or to the front. */
+				edit_move(log, first, second);
+				break;
+			case LYD_DIFF_MOVEDAFTER2:
+			{
+				/* 
+				 * Follows the creation of a user ordered instance, which was appended : second is
+				 * that instance and first its predecessor, both in the second tree, NULL for the front.
+				 */
+				int index = ly_set_contains(sources, second);
+				if(index < 0)
+					stop = edit_error(log, second, nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP));
+				else
+					stop = edit_place(log, copies->set.d[index], first);
+				break;
+			}
+			default:
+				break;
+		}
+		if(stop)
+			break;
+	}
+	ly_set_free(sources);
+	ly_set_free(copies);
+	return log->errors;
+}
+
+void edit_rollback(struct edit_log* log)
+{
+	for(int i = log->count - 1; i >= 0; i--)
+	{
+		struct edit_change* change = &log->changes[i];
+		switch(change->type)
+		{
+			case EDIT_CHANGE_CREATED:
+				if(change->node == *log->root)
+					*log->root = change->node->next;
+				lyd_free(change->node);
+				break;
+			case EDIT_CHANGE_REMOVED:
+				/* Later changes are undone already, the old neighbours are back in place. */
+				if(change->next)
+				{
+					lyd_insert_before(change->next, change->node);
+					if(change->next == *log->root)
+						*log->root = change->node;
+				}
+				else if(change->parent)
+					lyd_insert(change->parent, change->node);
+				else if(*log->root)
+					lyd_insert_sibling(log->root, change->node);
+				else
+					*log->root = change->node;
+				break;
+			case EDIT_CHANGE_VALUE:
+				lyd_change_leaf((struct lyd_node_leaf_list*)change->node, change->old_value);
+				break;
+			case EDIT_CHANGE_MOVED:
+			{
+				/* Still linked, back before its old next sibling or last. */
+				struct lyd_node* last = change->parent ? change->parent->child->prev : (*log->root)->prev;
+				if(change->next && change->next != change->node)
+					lyd_insert_before(change->next, change->node);
+				else if(!change->next && last != change->node)
+					lyd_insert_after(last, change->node);
+				edit_fix_root(log, change->node);
+				break;
+			}
+		}
+	}
+	for(int i = 0; i < log->count; i++)
+	{
+		free(log->changes[i].path);
+		free(log->changes[i].anchor);
+		free(log->changes[i].old_value);
+	}
+	log->count = 0;
+}
+
+/* Topmost ancestor of node, a top-level sibling unless its subtree was unlinked. */
+static struct lyd_node* edit_top(struct lyd_node* node)
+{
+	while(node->parent)
+		node = node->parent;
+	return node;
+}
+
+int edit_validate(struct edit_log* log)
+{
+	/* Top-level subtrees holding a change, a removed node counts for its former parent. */
+	struct ly_set* touched = ly_set_new();
+	for(int i = 0; i < log->count; i++)
+	{
+		struct edit_change* change = &log->changes[i];
+		struct lyd_node* node = (change->type == EDIT_CHANGE_REMOVED) ? change->parent : change->node;
+		if(node)
+			ly_set_add(touched, edit_top(node), 0);
+	}
+	
+	/* Copied, so the defaults libyang adds while validating never reach the target. */
+	struct lyd_node* scratch = NULL;
+	struct lyd_node* top;
+	int failed = 0;
+	LY_TREE_FOR(*log->root, top)
+	{
+		if(ly_set_contains(touched, top) < 0)
+			continue;
+		struct lyd_node* dup = lyd_dup(top, LYD_DUP_OPT_RECURSIVE | LYD_DUP_OPT_NO_ATTR);
+		if(!dup)
+		{
+			failed = 1;
+			break;
+		}
+		if(scratch)
+			lyd_insert_sibling(&scratch, dup);
+		else
+			scratch = dup;
+	}
+	ly_set_free(touched);
+	
+	/* References into the untouched subtrees can not resolve on the scratch copy. */
+	if(!failed && scratch)
+		failed = lyd_validate(&scratch, LYD_OPT_CONFIG | LYD_OPT_NOEXTDEPS, NULL) != 0;
+	lyd_free_withsiblings(scratch);
+	return failed;
+}
+
+void edit_journal(struct edit_log* log, struct datastore* ds)
+{
+	/* Consecutive creations and value changes share one merge record. */
+	struct lyd_node* merge = NULL;
+	/* Last created node, journaled with its final subtree. */
+	struct lyd_node* created = NULL;
+	for(int i = 0; i < log->count; i++)
+	{
+		struct edit_change* change = &log->changes[i];
+		if(change->type == EDIT_CHANGE_REMOVED || change->type == EDIT_CHANGE_MOVED)
+		{
+			/* Journaled in the order they were applied, the anchor of a move exists by then. */
+			if(merge)
+				persist_submit(ds, PERSIST_MERGE, merge, NULL);
+			merge = NULL;
+			created = NULL;
+			if(change->type == EDIT_CHANGE_REMOVED)
+				persist_submit_delete(ds, strdup(change->path));
+			else
+				persist_submit_move(ds, strdup(change->path), change->anchor ? strdup(change->anchor) : NULL);
+			continue;
+		}
+		/* Changes below the created node are part of its entry already. */
+		struct lyd_node* ancestor = change->node->parent;
+		while(created && ancestor && ancestor != created)
+			ancestor = ancestor->parent;
+		if(created && ancestor)
+			continue;
+		
+		int options = LYD_DUP_OPT_NO_ATTR | LYD_DUP_OPT_WITH_PARENTS;
+		if(change->type == EDIT_CHANGE_CREATED)
+		{
+			options |= LYD_DUP_OPT_RECURSIVE;
+			created = change->node;
+		}
+		struct lyd_node* dup = lyd_dup(change->node, options);
+		if(!dup)
+			continue;
+		while(dup->parent)
+			dup = dup->parent;
+		if(!merge)
+			merge = dup;
+		else
+			lyd_merge(merge, dup, LYD_OPT_DESTRUCT);
+	}
+	if(merge)
+		persist_submit(ds, PERSIST_MERGE, merge, NULL);
+}
+
+void edit_finish(struct edit_log* log)
+{
+	for(int i = 0; i < log->count; i++)
+	{
+		if(log->changes[i].type == EDIT_CHANGE_REMOVED)
+			lyd_free(log->changes[i].node);
+		free(log->changes[i].path);
+		free(log->changes[i].anchor);
+		free(log->changes[i].old_value);
+	}
+	free(log->changes);
+	log->changes = NULL;
+	log->count = 0;
+	log->size = 0;
+}
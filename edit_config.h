@@ -0,0 +1,90 @@
+#ifndef EDIT_CONFIG_H
+#define EDIT_CONFIG_H
+
+/* <edit-config> operations, RFC 6241 7.2 */
+enum edit_op
+{
+	EDIT_OP_NONE,
+	EDIT_OP_MERGE,
+	EDIT_OP_REPLACE,
+	EDIT_OP_CREATE,
+	EDIT_OP_DELETE,
+	EDIT_OP_REMOVE
+};
+
+enum edit_error_option
+{
+	EDIT_STOP_ON_ERROR,
+	EDIT_CONTINUE_ON_ERROR,
+	EDIT_ROLLBACK_ON_ERROR
+};
+
+/* One change applied to the target tree, with what is needed to undo it. */
+enum edit_change_type
+{
+	EDIT_CHANGE_CREATED,
+	EDIT_CHANGE_REMOVED,
+	EDIT_CHANGE_VALUE,
+	/* User ordered instance moved among its siblings. */
+	EDIT_CHANGE_MOVED
+};
+
+struct edit_change
+{
+	enum edit_change_type type;
+	struct lyd_node* node;
+	/* EDIT_CHANGE_REMOVED, EDIT_CHANGE_MOVED : former position and path of the node. */
+	struct lyd_node* parent;
+	struct lyd_node* next;
+	char* path;
+	/* EDIT_CHANGE_MOVED : path of the instance it now follows, NULL when it comes first. */
+	char* anchor;
+	/* EDIT_CHANGE_VALUE : previous leaf value. */
+	char* old_value;
+};
+
+/* Changes of one edit on a target tree, until edit_finish() or edit_rollback(). */
+struct edit_log
+{
+	struct lyd_node** root;
+	enum edit_error_option error_option;
+	struct edit_change* changes;
+	int count;
+	int size;
+	/* <rpc-error>s collected while applying. */
+	struct nc_server_reply* reply;
+	int errors;
+};
+
+void edit_log_init(struct edit_log* log, struct lyd_node** root, enum edit_error_option error_option);
+
+/* 
+ * Apply an edit tree parsed with LYD_OPT_EDIT to *log->root in place.
+ * Work is proportional to the edit, not to the target. Returns the number of errors.
+ */
+int edit_apply(struct edit_log* log, struct lyd_node* edit, enum edit_op default_op);
+
+/* 
+ * Apply a lyd_diff() whose first tree is *log->root, so it becomes equal to the second one.
+ * Only the differing nodes are touched. Returns the number of errors.
+ */
+int edit_apply_diff(struct edit_log* log, struct lyd_difflist* diff);
+
+/* 
+ * test-then-set : validate the top-level subtrees holding a logged change on a scratch copy,
+ * the target is left as it is. Used by <edit-config> and <commit> alike, so references from
+ * a changed subtree into an untouched one are not resolved. Returns non-zero when invalid,
+ * the error is left in libyang.
+ */
+int edit_validate(struct edit_log* log);
+
+/* Undo every logged change, newest first. */
+void edit_rollback(struct edit_log* log);
+
+/* Queue the logged changes as journal records of ds. */
+void edit_journal(struct edit_log* log, struct datastore* ds);
+
+/* Keep the changes, free the removed nodes and the undo data. */
+void edit_finish(struct edit_log* log);
+
+#endif
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <nc_server.h>
+#include "auth_callbacks.h"
+#include "endpoint.h"
+#include "logger.h"
+
+const char* ENDPOINT_PATH_DEFAULT = "configs/netconf-server.xml";
+
+static struct endpoint endpoints[ENDPOINTS_MAX];
+static int endpoint_count = 0;
+
+static void endpoint_add(const char* name, int transport, const char* address, uint16_t port)
+{
+	if(endpoint_count == ENDPOINTS_MAX)
+	{
+		LOGGER_WARNING("Main Thread", "Too many endpoints, %s skipped.", name);
+		return;
+	}
+	struct endpoint* endpoint = &endpoints[endpoint_count++];
+	snprintf(endpoint->name, sizeof(endpoint->name), "%s", name);
+	endpoint->transport = transport;
+	snprintf(endpoint->address, sizeof(endpoint->address), "%s", address);
+	endpoint->port = port;
+}
+
+/* Child of node named name, NULL when absent. */
+static struct lyd_node* endpoint_child(struct lyd_node* node, const char* name)
+{
+	for(struct lyd_node* child = node ? node->child : NULL; child; child = child->next)
+		if(!strcmp(child->schema->name, name))
+			return child;
+	return NULL;
+}
+
+static const char* endpoint_leaf(struct lyd_node* node, const char* name)
+{
+	struct lyd_node* leaf = endpoint_child(node, name);
+	return leaf ? ((struct lyd_node_leaf_list*)leaf)->value_str : NULL;
+}
+
+/* Port leaf value, 0 when it is not a number within 1-65535. */
+static uint16_t endpoint_port(const char* value)
+{
+	char* end = NULL;
+	long port = strtol(value, &end, 10);
+	if(end == value || *end || port < 1 || port > 65535)
+		return 0;
+	return (uint16_t)port;
+}
+
+int endpoint_load(const char* search_path, const char* path)
+{
+	if(access(path, F_OK))
+	{
+		endpoint_add("main", NC_TI_LIBSSH, "0.0.0.0", 830);
+		endpoint_add("tls", NC_TI_OPENSSL, "0.0.0.0", 6513);
+		LOGGER_INFO("Main Thread", "No %s, default endpoints.", path);
+		return 0;
+	}
+	
+	/* A context of its own, the server context never advertises ietf-netconf-server. */
+	struct ly_ctx* ctx = ly_ctx_new(search_path, LY_CTX_TRUSTED);
+	const struct lys_module* module = ctx ? ly_ctx_load_module(ctx, "ietf-netconf-server", NULL) : NULL;
+	if(!module)
+	{
+		LOGGER_ERROR("Main Thread", "Failed to load ietf-netconf-server.");
+		if(ctx)
+			ly_ctx_destroy(ctx, NULL);
+		return 1;
+	}
+	lys_features_enable(module, "listen");
+	lys_features_enable(module, "ssh-listen");
+	lys_features_enable(module, "tls-listen");
+	
+	/* The host keys and certificates it names are not loaded, their leafrefs can not resolve. */
+	ly_errno = LY_SUCCESS;
+	struct lyd_node* root = lyd_parse_path(ctx, path, LYD_XML, LYD_OPT_CONFIG | LYD_OPT_TRUSTED);
+	if(!root && ly_errno != LY_SUCCESS)
+	{
+		LOGGER_ERROR("Main Thread", "Failed to parse %s.", path);
+		ly_ctx_destroy(ctx, NULL);
+		return 1;
+	}
+	int failed = 0;
+	struct ly_set* set = root ? lyd_find_path(root, "/ietf-netconf-server:netconf-server/listen/endpoint") : NULL;
+	for(unsigned int i = 0; set && i < set->number && !failed; i++)
+	{
+		struct lyd_node* node = set->set.d[i];
+		const char* name = endpoint_leaf(node, "name");
+		struct lyd_node* ssh = endpoint_child(node, "ssh");
+		struct lyd_node* transport = ssh ? ssh : endpoint_child(node, "tls");
+		if(!name || !transport)
+			continue;
+		const char* address = endpoint_leaf(transport, "address");
+		const char* value = endpoint_leaf(transport, "port");
+		/* LYD_OPT_TRUSTED skipped the uint16 check of the port. */
+		uint16_t port = value ? endpoint_port(value) : (ssh ? 830 : 6513);
+		if(!port)
+		{
+			LOGGER_ERROR("Main Thread", "Endpoint %s : port \"%s\" is not within 1-65535.", name, value);
+			failed = 1;
+			continue;
+		}
+		endpoint_add(name, ssh ? NC_TI_LIBSSH : NC_TI_OPENSSL, address ? address : "0.0.0.0", port);
+	}
+	ly_set_free(set);
+	lyd_free_withsiblings(root);
+	ly_ctx_destroy(ctx, NULL);
+	
+	if(failed)
+		return 1;
+	if(!endpoint_count)
+	{
+		LOGGER_ERROR("Main Thread", "No endpoint in %s.", path);
+		return 1;
+	}
+	LOGGER_INFO("Main Thread", "%d endpoints from %s.", endpoint_count, path);
+	return 0;
+}
+
+int endpoint_apply(int tls)
+{
+	for(int i = 0; i < endpoint_count; i++)
+	{
+		struct endpoint* endpoint = &endpoints[i];
+		if(endpoint->transport == NC_TI_OPENSSL && !tls)
+		{
+			LOGGER_INFO("Main Thread", "Endpoint %s skipped, no TLS keystore.", endpoint->name);
+			continue;
+		}
+		if(nc_server_add_endpt(endpoint->name, (NC_TRANSPORT_IMPL)endpoint->transport)
+			|| nc_server_endpt_set_address(endpoint->name, endpoint->address)
+			|| nc_server_endpt_set_port(endpoint->name, endpoint->port))
+		{
+			LOGGER_ERROR("Main Thread", "Failed to listen on %s port %u for %s.", endpoint->address, endpoint->port, endpoint->name);
+			return 1;
+		}
+		if(endpoint->transport == NC_TI_LIBSSH)
+		{
+			if(auth_apply_hostkeys(endpoint->name) || nc_server_ssh_endpt_set_auth_methods(endpoint->name, NC_SSH_AUTH_PUBLICKEY | NC_SSH_AUTH_PASSWORD))
+				return 1;
+		}
+		/* TLS client certificates are mapped to users by cert-to-name, no password. */
+		else if(auth_apply_keystore(endpoint->name))
+		{
+			return 1;
+		}
+		LOGGER_INFO("Main Thread", "Endpoint %s : %s on %s port %u.", endpoint->name, (endpoint->transport == NC_TI_LIBSSH) ? "SSH" : "TLS", endpoint->address, endpoint->port);
+	}
+	return 0;
+}
+
+void endpoint_reload_hostkeys(void)
+{
+	for(int i = 0; i < endpoint_count; i++)
+		if(endpoints[i].transport == NC_TI_LIBSSH && auth_apply_hostkeys(endpoints[i].name))
+			LOGGER_ERROR("Accept Thread", "Failed to offer the reloaded host keys on %s.", endpoints[i].name);
+}
@@ -0,0 +1,40 @@
+#ifndef ENDPOINT_H
+#define ENDPOINT_H
+#include <stdint.h>
+
+/*
+ * Listening Endpoints : /netconf-server/listen/endpoint of an ietf-netconf-server shaped file,
+ * each an SSH or TLS address and port. Host keys come from the "-H" directory and the TLS
+ * identity from the keystore, the host-keys, certificates and cert-maps of the file are not
+ * read, nor is call-home. Without the file, SSH listens on 0.0.0.0:830 and TLS on 0.0.0.0:6513.
+ * TLS endpoints are only created when the keystore loaded.
+ *
+ * Every Accept Thread runs nc_accept() on all endpoints, so SSH and TLS handshakes of
+ * concurrent clients run on as many cores as there are Accept Threads.
+ */
+
+/* Endpoints file, set by "-e". */
+extern const char* ENDPOINT_PATH_DEFAULT;
+
+const int ENDPOINTS_MAX = 16;
+
+struct endpoint
+{
+	char name[64];
+	/* NC_TI_LIBSSH or NC_TI_OPENSSL */
+	int transport;
+	char address[64];
+	uint16_t port;
+};
+
+/* 
+ * Read the endpoints of path, parsed with ietf-netconf-server from search_path in a private
+ * context destroyed afterwards. Ports outside 1-65535 are rejected.
+ */
+int endpoint_load(const char* search_path, const char* path);
+/* Create every endpoint with its host keys or keystore, TLS ones only when tls. */
+int endpoint_apply(int tls);
+/* Offer the reloaded host keys on every SSH endpoint, see auth_load_hostkeys(). */
+void endpoint_reload_hostkeys(void);
+
+#endif
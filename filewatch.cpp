@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <nc_server.h>
+#include "datastore.h"
+#include "edit_config.h"
+#include "persist.h"
+#include "filewatch.h"
+#include "logger.h"
+
+extern struct ly_ctx* ctx;
+extern int g_ctl_server;
+
+const int FILEWATCH_TARGETS_MAX = 8;
+/* 
+ * The directory is watched, a file replaced by rename keeps being followed. A file removed
+ * or renamed away, or its whole directory, is reloaded as well.
+ */
+const uint32_t FILEWATCH_MODE = IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF;
+const int FILEWATCH_BUFSIZE = 4096;
+
+/* One datastore backing file, or a file of its own loader when ds is NULL. */
+struct filewatch_target
+{
+	struct datastore* ds;
+	filewatch_load_cb load;
+	const char* path;
+	const char* name;
+	int options;
+	filewatch_fixup_cb fixup;
+	/* Watch descriptor of the parent directory. */
+	int wd;
+	/* Written since the last reload, reloaded once the monotonic clock passes deadline. */
+	int pending;
+	uint64_t first;
+	uint64_t deadline;
+	/* Identity of the file content the datastore reflects. */
+	struct stat loaded;
+};
+
+static struct filewatch_target filewatch_targets[FILEWATCH_TARGETS_MAX];
+static int filewatch_target_count = 0;
+
+static uint64_t filewatch_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int filewatch_same(const struct stat* a, const struct stat* b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size
+		&& a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static struct filewatch_target* filewatch_add(const char* path)
+{
+	if(filewatch_target_count == FILEWATCH_TARGETS_MAX)
+	{
+		LOGGER_ERROR("Filewatch Thread", "Too many watched files.");
+		return NULL;
+	}
+	struct filewatch_target* target = &filewatch_targets[filewatch_target_count++];
+	target->ds = NULL;
+	target->load = NULL;
+	target->path = path;
+	const char* slash = strrchr(path, '/');
+	target->name = slash ? slash + 1 : path;
+	target->options = 0;
+	target->fixup = NULL;
+	target->wd = -1;
+	target->pending = 0;
+	target->first = 0;
+	target->deadline = 0;
+	/* The caller was just loaded from this content. */
+	if(stat(path, &target->loaded))
+		memset(&target->loaded, 0, sizeof(target->loaded));
+	return target;
+}
+
+void filewatch_attach(struct datastore* ds, const char* path, int options, filewatch_fixup_cb fixup)
+{
+	struct filewatch_target* target = filewatch_add(path);
+	if(!target)
+		return;
+	target->ds = ds;
+	target->options = options;
+	target->fixup = fixup;
+}
+
+void filewatch_attach_file(const char* path, filewatch_load_cb load)
+{
+	struct filewatch_target* target = filewatch_add(path);
+	if(target)
+		target->load = load;
+}
+
+/* Returns non-zero when the reload has to be retried later. */
+static int filewatch_reload(struct filewatch_target* target)
+{
+	struct stat st;
+	if(stat(target->path, &st))
+	{
+		/* Already reloaded as removed, or never there. */
+		if(!target->loaded.st_ino)
+			return 0;
+		/* Removed : its loader drops what it loaded, a datastore keeps its version. */
+		if(target->load)
+		{
+			if(target->load(target->path))
+				return 1;
+		}
+		else
+		{
+			LOGGER_WARNING("Filewatch Thread", "%s removed, keeping the %s version.", target->path, target->ds->name);
+		}
+		/* Any file created there later is new content. */
+		memset(&target->loaded, 0, sizeof(target->loaded));
+		return 0;
+	}
+	/* Repeated events for content already loaded, or a snapshot of our own. */
+	if(filewatch_same(&st, &target->loaded))
+		return 0;
+	if(target->load)
+	{
+		if(target->load(target->path))
+			return 1;
+		target->loaded = st;
+		return 0;
+	}
+	if(persist_owns(target->path, &st))
+	{
+		target->loaded = st;
+		return 0;
+	}
+	
+	/* Parsed off the datastore locks, readers and writers are not held up meanwhile. */
+	ly_errno = LY_SUCCESS;
+	struct lyd_node* root = lyd_parse_path(ctx, target->path, LYD_XML, target->options);
+	if(!root && ly_errno != LY_SUCCESS)
+	{
+		LOGGER_ERROR("Filewatch Thread", "Failed to parse %s, keeping the %s version.", target->path, target->ds->name);
+		target->loaded = st;
+		return 0;
+	}
+	if(target->fixup)
+		target->fixup(root);
+	
+	ds_write_guard writer(target->ds);
+	if(writer.denied(0))
+	{
+		/* Applied once the session holding the lock releases it. */
+		lyd_free_withsiblings(root);
+		return 1;
+	}
+	struct lyd_node** live = writer.begin();
+	if(*live || root)
+	{
+		struct lyd_difflist* diff = lyd_diff(*live, root, 0);
+		if(!diff)
+		{
+			LOGGER_ERROR("Filewatch Thread", "Failed to diff %s against %s.", target->path, target->ds->name);
+			lyd_free_withsiblings(root);
+			return 0;
+		}
+		struct edit_log log;
+		edit_log_init(&log, live, EDIT_ROLLBACK_ON_ERROR);
+		int failed = edit_apply_diff(&log, diff);
+		lyd_free_diff(diff);
+	
+		if(failed || !log.count)
+		{
+			if(failed)
+				LOGGER_ERROR("Filewatch Thread", "Failed to apply %s to %s.", target->path, target->ds->name);
+			edit_rollback(&log);
+			writer.abort();
+		}
+		else
+		{
+			LOGGER_INFO("Filewatch Thread", "%s reloaded, %d changes applied to %s.", target->path, log.count, target->ds->name);
+			/* Records journaled before the edit are replayed first, these ones win. */
+			if(persist_attached(target->ds))
+				edit_journal(&log, target->ds);
+			writer.publish();
+			ds_notify(target->ds, &log, NULL);
+		}
+		if(log.reply)
+			nc_server_reply_free(log.reply);
+		edit_finish(&log);
+	}
+	else
+	{
+		writer.abort();
+	}
+	lyd_free_withsiblings(root);
+	target->loaded = st;
+	return 0;
+}
+
+void* filewatch_thread_entry(void* arg)
+{
+	LOGGER_INFO("Filewatch Thread", "Started.");
+	int fd_filewatch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fd_filewatch < 0)
+	{
+		LOGGER_ERROR("Filewatch Thread", "Failed to initialize inotify.");
+		return NULL;
+	}
+	
+	/* Watching the same directory twice returns the same descriptor. */
+	for(int i = 0; i < filewatch_target_count; i++)
+	{
+		struct filewatch_target* target = &filewatch_targets[i];
+		char dir[PATH_MAX];
+		if(target->name == target->path)
+			strcpy(dir, ".");
+		else
+			snprintf(dir, sizeof(dir), "%.*s", (int)(target->name - target->path - 1), target->path);
+		target->wd = inotify_add_watch(fd_filewatch, dir, FILEWATCH_MODE);
+		if(target->wd < 0)
+			LOGGER_ERROR("Filewatch Thread", "Failed to watch %s.", dir);
+	}
+	
+	char event_buf[FILEWATCH_BUFSIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd poll_fds[1];
+	poll_fds[0].fd = fd_filewatch;
+	poll_fds[0].events = POLLIN;
+	while(g_ctl_server)
+	{
+		/* Sleep until the next debounced reload is due. */
+		uint64_t now = filewatch_now();
+		int timeout = FILEWATCH_POLL_TIMEOUT;
+		for(int i = 0; i < filewatch_target_count; i++)
+		{
+			if(!filewatch_targets[i].pending)
+				continue;
+			uint64_t due = filewatch_targets[i].deadline > now ? filewatch_targets[i].deadline - now : 0;
+			if(due < (uint64_t)timeout)
+				timeout = (int)due;
+		}
+	
+		if(poll(poll_fds, 1, timeout) > 0 && (poll_fds[0].revents & POLLIN))
+		{
+			ssize_t event_length;
+			while((event_length = read(fd_filewatch, event_buf, sizeof(event_buf))) > 0)
+			{
+				now = filewatch_now();
+				for(char* ptr = event_buf; ptr < event_buf + event_length; )
+				{
+					const struct inotify_event* event = (const struct inotify_event*)ptr;
+					ptr += sizeof(struct inotify_event) + event->len;
+					for(int i = 0; i < filewatch_target_count; i++)
+					{
+						struct filewatch_target* target = &filewatch_targets[i];
+						/* Events were lost, or the directory itself went away, check every file concerned. */
+						int overflow = event->mask & IN_Q_OVERFLOW;
+						int self = (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) && event->wd == target->wd;
+						if(!overflow && !self && (event->wd != target->wd || !event->len || strcmp(event->name, target->name)))
+							continue;
+						/* Every further write pushes the reload back, up to FILEWATCH_DEBOUNCE_MAX. */
+						if(!target->pending)
+							target->first = now;
+						target->pending = 1;
+						target->deadline = now + FILEWATCH_DEBOUNCE;
+						if(target->deadline > target->first + FILEWATCH_DEBOUNCE_MAX)
+							target->deadline = target->first + FILEWATCH_DEBOUNCE_MAX;
+					}
+				}
+			}
+		}
+	
+		now = filewatch_now();
+		for(int i = 0; i < filewatch_target_count; i++)
+		{
+			struct filewatch_target* target = &filewatch_targets[i];
+			if(!target->pending || target->deadline > now)
+				continue;
+			target->pending = 0;
+			if(filewatch_reload(target))
+			{
+				target->pending = 1;
+				target->first = now;
+				target->deadline = now + FILEWATCH_LOCK_RETRY;
+			}
+		}
+	}
+	
+	LOGGER_INFO("Filewatch Thread", "Cleaning up allocated resource.");
+	close(fd_filewatch);
+	nc_thread_destroy();
+	return NULL;
+}
@@ -0,0 +1,38 @@
+#ifndef FILEWATCH_H
+#define FILEWATCH_H
+
+/*
+ * Filewatch : a datastore backed by a file is reloaded when another process rewrites it.
+ * Bursts of writes are debounced, the file is parsed off the datastore locks, and only the
+ * diff against the live version is applied, journaled and published to the listeners.
+ * Snapshots written by the persistence thread are recognized and ignored. Other files, e.g.
+ * the authorized keys, are handed to their own loader with the same debouncing.
+ */
+
+/* millisec , quiet period after the last write of a file before it is reloaded */
+const int FILEWATCH_DEBOUNCE = 100;
+/* millisec , longest a file written without pause waits for its reload */
+const int FILEWATCH_DEBOUNCE_MAX = 1000;
+/* millisec , reload retry interval while a session holds the datastore lock */
+const int FILEWATCH_LOCK_RETRY = 1000;
+/* millisec , only bounds how fast g_ctl_server is noticed */
+const int FILEWATCH_POLL_TIMEOUT = 1000;
+
+/* Called on every reloaded tree before it is diffed, e.g. to patch server-owned state. */
+typedef void (*filewatch_fixup_cb)(struct lyd_node* root);
+
+/*
+ * Reload ds from path, parsed with the lyd_parse_path() options, before the filewatch
+ * thread is started. fixup may be NULL.
+ */
+void filewatch_attach(struct datastore* ds, const char* path, int options, filewatch_fixup_cb fixup);
+
+/* Loader of a file which is not a datastore, also called once the file is removed. Returns non-zero to be retried later. */
+typedef int (*filewatch_load_cb)(const char* path);
+/* Call load whenever path was rewritten, before the filewatch thread is started. */
+void filewatch_attach_file(const char* path, filewatch_load_cb load);
+
+/* FileWatch Thread Entry Prototype */
+void* filewatch_thread_entry(void* arg);
+
+#endif
@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <nc_server.h>
+#include "filter.h"
+
+static void filter_add_xpath(struct rpc_filter* filter, const char* xpath)
+{
+	filter->xpaths = (char**)realloc(filter->xpaths, (filter->count + 1) * sizeof(char*));
+	filter->xpaths[filter->count++] = strdup(xpath);
+}
+
+static int filter_is_blank(const char* str)
+{
+	if(!str)
+		return 1;
+	for(; *str; str++)
+		if(!isspace((unsigned char)*str))
+			return 0;
+	return 1;
+}
+
+/* Path step "name" or "module:name", the module is only written when it changes. */
+static void filter_append_step(char** path, const char* module, const char* parent_module, const char* name)
+{
+	size_t len = strlen(*path);
+	size_t add = strlen(module) + strlen(name) + 3;
+	*path = (char*)realloc(*path, len + add);
+	if(parent_module && !strcmp(module, parent_module))
+		sprintf(*path + len, "/%s", name);
+	else
+		sprintf(*path + len, "/%s:%s", module, name);
+}
+
+/* Content match node, appended as predicate "[name='value']". */
+static void filter_append_predicate(char** path, const char* module, const char* parent_module, const char* name, const char* value)
+{
+	size_t len = strlen(*path);
+	size_t add = strlen(module) + strlen(name) + strlen(value) + 8;
+	/* Values holding an apostrophe are quoted with double quotes. */
+	char quote = strchr(value, '\'') ? '"' : '\'';
+	*path = (char*)realloc(*path, len + add);
+	if(parent_module && !strcmp(module, parent_module))
+		sprintf(*path + len, "[%s=%c%s%c]", name, quote, value, quote);
+	else
+		sprintf(*path + len, "[%s:%s=%c%s%c]", module, name, quote, value, quote);
+}
+
+/* Append len characters of str to the growing string *out of length *len. */
+static void filter_append(char** out, size_t* len, const char* str, size_t count)
+{
+	*out = (char*)realloc(*out, *len + count + 1);
+	memcpy(*out + *len, str, count);
+	*len += count;
+	(*out)[*len] = '\0';
+}
+
+static int filter_is_name_char(char c)
+{
+	return isalnum((unsigned char)c) || c == '_' || c == '-' || c == '.';
+}
+
+/* Module of an XPath prefix, by module name first, then by YANG prefix. */
+static const char* filter_prefix_module(struct ly_ctx* ctx, const char* prefix, size_t len)
+{
+	char name[256];
+	if(len >= sizeof(name))
+		return NULL;
+	memcpy(name, prefix, len);
+	name[len] = '\0';
+	const struct lys_module* module = ly_ctx_get_module(ctx, name, NULL, 0);
+	if(module)
+		return module->name;
+	uint32_t index = 0;
+	while((module = ly_ctx_get_module_iter(ctx, &index)))
+		if(module->prefix && !strcmp(module->prefix, name))
+			return module->name;
+	return NULL;
+}
+
+/* 
+ * RFC 6241 8.9 : select uses the XML prefixes in scope on <filter>. Those namespaces are only
+ * known while the <rpc> is parsed, libyang rewrites the select attribute of the ietf-netconf
+ * filter to module names then. Prefixes still not naming a module are resolved as YANG module
+ * prefixes. Returns the XPath with module names, NULL and the prefix on an unknown one.
+ */
+static char* filter_xpath_modules(struct ly_ctx* ctx, const char* select, char* unknown, size_t unknown_size)
+{
+	char* xpath = NULL;
+	size_t len = 0;
+	filter_append(&xpath, &len, "", 0);
+	const char* p = select;
+	while(*p)
+	{
+		/* Literals are copied as they are. */
+		if(*p == '\'' || *p == '"')
+		{
+			const char* end = strchr(p + 1, *p);
+			size_t count = end ? (size_t)(end - p) + 1 : strlen(p);
+			filter_append(&xpath, &len, p, count);
+			p += count;
+			continue;
+		}
+		if(!isalpha((unsigned char)*p) && *p != '_')
+		{
+			filter_append(&xpath, &len, p, 1);
+			p++;
+			continue;
+		}
+		size_t count = 0;
+		while(filter_is_name_char(p[count]))
+			count++;
+		/* "prefix:name", neither an axis "name::" nor a variable "$name". */
+		if(p[count] == ':' && p[count + 1] != ':' && (p == select || p[-1] != '$'))
+		{
+			const char* module = filter_prefix_module(ctx, p, count);
+			if(!module)
+			{
+				snprintf(unknown, unknown_size, "%.*s", (int)count, p);
+				free(xpath);
+				return NULL;
+			}
+			filter_append(&xpath, &len, module, strlen(module));
+		}
+		else
+		{
+			filter_append(&xpath, &len, p, count);
+		}
+		p += count;
+	}
+	return xpath;
+}
+
+static const char* filter_elem_module(struct ly_ctx* ctx, const struct lyxml_elem* elem, const char* parent_module)
+{
+	if(!elem->ns || !elem->ns->value)
+		return parent_module;
+	const struct lys_module* module = ly_ctx_get_module_by_ns(ctx, elem->ns->value, NULL, 0);
+	return module ? module->name : NULL;
+}
+
+/* RFC 6241 6.2 : containment, selection and content match nodes to XPath. */
+static void filter_subtree_elem(struct ly_ctx* ctx, const struct lyxml_elem* elem, const char* parent_module, const char* parent_path, struct rpc_filter* filter)
+{
+	const char* module = filter_elem_module(ctx, elem, parent_module);
+	/* Unknown namespaces select nothing. */
+	if(!module)
+		return;
+	
+	char* path = strdup(parent_path);
+	filter_append_step(&path, module, parent_module, elem->name);
+	
+	/* Selection node, the whole subtree. */
+	if(!elem->child)
+	{
+		filter_add_xpath(filter, path);
+		free(path);
+		return;
+	}
+	
+	/* Content match nodes restrict the instances of this node. */
+	const struct lyxml_elem* child;
+	int selections = 0;
+	LY_TREE_FOR(elem->child, child)
+	{
+		const char* child_module = filter_elem_module(ctx, child, module);
+		if(!child_module)
+			continue;
+		if(!child->child && !filter_is_blank(child->content))
+			filter_append_predicate(&path, child_module, module, child->name, child->content);
+		else
+			selections++;
+	}
+	
+	/* Only content match nodes, the whole matching subtree. */
+	if(!selections)
+	{
+		filter_add_xpath(filter, path);
+		free(path);
+		return;
+	}
+	
+	LY_TREE_FOR(elem->child, child)
+	{
+		const char* child_module = filter_elem_module(ctx, child, module);
+		if(!child_module)
+			continue;
+		if(!child->child)
+		{
+			/* Selection nodes and, RFC 6241 6.2.5, the content match nodes themselves. */
+			char* child_path = strdup(path);
+			filter_append_step(&child_path, child_module, module, child->name);
+			filter_add_xpath(filter, child_path);
+			free(child_path);
+		}
+		else
+			filter_subtree_elem(ctx, child, module, path, filter);
+	}
+	free(path);
+}
+
+struct nc_server_error* filter_parse(struct ly_ctx* ctx, struct lyd_node* rpc, struct rpc_filter* filter)
+{
+	filter->all = 1;
+	filter->xpaths = NULL;
+	filter->count = 0;
+	
+	struct ly_set* nodeset = lyd_find_path(rpc, "filter");
+	if(!nodeset || !nodeset->number)
+	{
+		ly_set_free(nodeset);
+		return NULL;
+	}
+	struct lyd_node_anydata* node = (struct lyd_node_anydata*)nodeset->set.d[0];
+	ly_set_free(nodeset);
+	filter->all = 0;
+	
+	const char* type = "subtree";
+	const char* select = NULL;
+	struct lyd_attr* attr;
+	LY_TREE_FOR(node->attr, attr)
+	{
+		if(!strcmp(attr->name, "type"))
+			type = attr->value_str;
+		else if(!strcmp(attr->name, "select"))
+			select = attr->value_str;
+	}
+	
+	if(!strcmp(type, "xpath"))
+	{
+		if(!select)
+			return nc_err(NC_ERR_MISSING_ATTR, NC_ERR_TYPE_PROT, "select", "filter");
+		char prefix[256];
+		char* xpath = filter_xpath_modules(ctx, select, prefix, sizeof(prefix));
+		if(!xpath)
+		{
+			struct nc_server_error* e = nc_err(NC_ERR_INVALID_VALUE, NC_ERR_TYPE_PROT);
+			char msg[320];
+			snprintf(msg, sizeof(msg), "[RPC Handler] Unknown prefix \"%s\" in <filter> select.", prefix);
+			nc_err_set_msg(e, msg, "en");
+			return e;
+		}
+		filter_add_xpath(filter, xpath);
+		free(xpath);
+		return NULL;
+	}
+	if(strcmp(type, "subtree"))
+		return nc_err(NC_ERR_BAD_ATTR, NC_ERR_TYPE_PROT, "type", "filter");
+	
+	/* Subtree filter, the anyxml content. An empty filter selects nothing. */
+	struct lyxml_elem* xml = NULL;
+	struct lyxml_elem* parsed = NULL;
+	if(node->value_type == LYD_ANYDATA_XML)
+		xml = node->value.xml;
+	else if(node->value.str && (node->value_type == LYD_ANYDATA_CONSTSTRING || node->value_type == LYD_ANYDATA_STRING
+			|| node->value_type == LYD_ANYDATA_SXML || node->value_type == LYD_ANYDATA_SXMLD))
+		xml = parsed = lyxml_parse_mem(ctx, node->value.str, LYXML_PARSE_MULTIROOT);
+	
+	struct lyxml_elem* elem;
+	LY_TREE_FOR(xml, elem)
+		filter_subtree_elem(ctx, elem, NULL, "", filter);
+	if(parsed)
+		lyxml_free_withsiblings(ctx, parsed);
+	return NULL;
+}
+
+void filter_free(struct rpc_filter* filter)
+{
+	for(int i = 0; i < filter->count; i++)
+		free(filter->xpaths[i]);
+	free(filter->xpaths);
+	filter->xpaths = NULL;
+	filter->count = 0;
+}
+
+int filter_apply(const struct lyd_node* root, const struct rpc_filter* filter, struct lyd_node** result)
+{
+	*result = NULL;
+	if(!root)
+		return 0;
+	
+	for(int i = 0; i < filter->count; i++)
+	{
+		struct ly_set* nodeset = lyd_find_path(root, filter->xpaths[i]);
+		if(!nodeset)
+		{
+			lyd_free_withsiblings(*result);
+			*result = NULL;
+			return 1;
+		}
+		for(unsigned int j = 0; j < nodeset->number; j++)
+		{
+			/* Copy the selected subtree with its parents only. */
+			struct lyd_node* dup = lyd_dup(nodeset->set.d[j], LYD_DUP_OPT_RECURSIVE | LYD_DUP_OPT_WITH_PARENTS);
+			if(!dup)
+				continue;
+			while(dup->parent)
+				dup = dup->parent;
+			if(!*result)
+				*result = dup;
+			else
+				lyd_merge(*result, dup, LYD_OPT_DESTRUCT);
+		}
+		ly_set_free(nodeset);
+	}
+	return 0;
+}
+
+int filter_selects(const struct rpc_filter* filter, const char* top)
+{
+	if(filter->all)
+		return 1;
+	size_t len = strlen(top);
+	for(int i = 0; i < filter->count; i++)
+	{
+		const char* xpath = filter->xpaths[i];
+		if(xpath[0] != '/' || xpath[1] == '/' || strchr(xpath, '|'))
+			return 1;
+		size_t step = strcspn(xpath + 1, "/[");
+		/* Wildcards and unprefixed steps may match any module. */
+		if(!memchr(xpath + 1, ':', step) || memchr(xpath + 1, '*', step))
+			return 1;
+		if(step == len && !strncmp(xpath + 1, top, len))
+			return 1;
+	}
+	return 0;
+}
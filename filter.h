@@ -0,0 +1,30 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+/* <filter> of <get>/<get-config>, reduced to a set of XPath selections. */
+struct rpc_filter
+{
+	/* No <filter> element, the whole datastore is selected. */
+	int all;
+	char** xpaths;
+	int count;
+};
+
+/* Parse the "filter" child of rpc, subtree filters are converted to XPath. */
+/* Returns NULL, or the error to reply with. */
+struct nc_server_error* filter_parse(struct ly_ctx* ctx, struct lyd_node* rpc, struct rpc_filter* filter);
+void filter_free(struct rpc_filter* filter);
+
+/* 
+ * Build a tree holding only the selected nodes of root and their parents.
+ * Unselected branches are never duplicated. Returns non-zero on invalid XPath.
+ */
+int filter_apply(const struct lyd_node* root, const struct rpc_filter* filter, struct lyd_node** result);
+
+/* 
+ * Whether filter may select nodes under the top-level node top ("module:name").
+ * Only a leading "/module:name" step is compared, any other XPath may select it.
+ */
+int filter_selects(const struct rpc_filter* filter, const char* top);
+
+#endif
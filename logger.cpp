@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include "logger.h"
+
+std::atomic<int> g_logger_level(LOGGER_LEVEL_INFO);
+
+static const char* LOGGER_LEVEL_NAMES[] = { "ERROR", "WARNING", "INFO", "DEBUG" };
+/* Output batch, written with one fwrite() and one fflush() per drain. */
+const int LOGGER_BATCH_SIZE = 65536;
+
+struct logger_record
+{
+	/* microsec , CLOCK_REALTIME */
+	uint64_t time;
+	int64_t usec;
+	/* Static string, e.g. "Server Thread". */
+	const char* tag;
+	uint32_t session_id;
+	uint32_t suppressed;
+	int level;
+	char rpc[32];
+	char message[LOGGER_MESSAGE_MAX];
+};
+
+/* Single producer, the owning thread, single consumer, the Logger Thread. */
+struct logger_ring
+{
+	struct logger_record records[LOGGER_RING_SIZE];
+	std::atomic<uint32_t> head;
+	std::atomic<uint32_t> tail;
+	/* Written by the owner, reported by the Logger Thread. */
+	std::atomic<uint64_t> dropped;
+	uint64_t reported;
+	struct logger_ring* next;
+};
+
+/* Rings of every thread which ever logged, kept until exit. */
+static pthread_mutex_t logger_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logger_cond = PTHREAD_COND_INITIALIZER;
+static struct logger_ring* logger_rings = NULL;
+static thread_local struct logger_ring* logger_local = NULL;
+/* Messages are written at once while the Logger Thread is not running. */
+static std::atomic<int> logger_running(0);
+static std::atomic<int> logger_stop(0);
+/* Set while the Logger Thread waits on logger_cond, the first producer wakes it. */
+static std::atomic<int> logger_sleeping(0);
+
+int logger_parse_level(const char* name)
+{
+	static const char* names[] = { "error", "warning", "info", "debug" };
+	for(int i = 0; i < 4; i++)
+		if(!strcmp(name, names[i]))
+			return i;
+	return -1;
+}
+
+/* At most LOGGER_RATE_BURST messages per second, suppressed returns how many were not. */
+static int logger_admit(struct logger_site* site, uint32_t* suppressed)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	uint32_t second = (uint32_t)now.tv_sec;
+	uint32_t window = site->window.load(std::memory_order_relaxed);
+	if(window != second && site->window.compare_exchange_strong(window, second, std::memory_order_relaxed))
+		site->count.store(0, std::memory_order_relaxed);
+	if(site->count.fetch_add(1, std::memory_order_relaxed) >= LOGGER_RATE_BURST)
+	{
+		site->suppressed.fetch_add(1, std::memory_order_relaxed);
+		return 0;
+	}
+	*suppressed = site->suppressed.exchange(0, std::memory_order_relaxed);
+	return 1;
+}
+
+static int logger_format(char* buf, size_t size, const struct logger_record* record)
+{
+	time_t seconds = (time_t)(record->time / 1000000);
+	struct tm tm;
+	localtime_r(&seconds, &tm);
+	int len = (int)strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+	len += snprintf(buf + len, size - len, ".%06u %-7s [%s] %s", (unsigned)(record->time % 1000000),
+		LOGGER_LEVEL_NAMES[record->level], record->tag, record->message);
+	if(record->session_id && len < (int)size)
+		len += snprintf(buf + len, size - len, " session=%u", record->session_id);
+	if(record->rpc[0] && len < (int)size)
+		len += snprintf(buf + len, size - len, " rpc=%s", record->rpc);
+	if(record->usec >= 0 && len < (int)size)
+		len += snprintf(buf + len, size - len, " duration=%lldus", (long long)record->usec);
+	if(record->suppressed && len < (int)size)
+		len += snprintf(buf + len, size - len, " (%u similar suppressed)", record->suppressed);
+	if(len >= (int)size - 1)
+		len = (int)size - 2;
+	buf[len++] = '\n';
+	return len;
+}
+
+static struct logger_ring* logger_ring_local(void)
+{
+	struct logger_ring* ring = logger_local;
+	if(!ring)
+	{
+		/* Value-initialized, head, tail and dropped start at 0. */
+		ring = new logger_ring();
+		pthread_mutex_lock(&logger_mutex);
+		ring->next = logger_rings;
+		logger_rings = ring;
+		pthread_mutex_unlock(&logger_mutex);
+		logger_local = ring;
+	}
+	return ring;
+}
+
+void logger_write(int level, struct logger_site* site, const char* tag, uint32_t session_id, const char* rpc, int64_t usec, const char* format, ...)
+{
+	struct logger_record local;
+	struct logger_record* record = &local;
+	uint32_t suppressed = 0;
+	if(!logger_admit(site, &suppressed))
+		return;
+	
+	int running = logger_running.load(std::memory_order_acquire);
+	struct logger_ring* ring = NULL;
+	uint32_t head = 0;
+	if(running)
+	{
+		ring = logger_ring_local();
+		head = ring->head.load(std::memory_order_relaxed);
+		if(head - ring->tail.load(std::memory_order_acquire) == (uint32_t)LOGGER_RING_SIZE)
+		{
+			ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return;
+		}
+		record = &ring->records[head % LOGGER_RING_SIZE];
+	}
+	
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	record->time = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	record->usec = usec;
+	record->tag = tag;
+	record->session_id = session_id;
+	record->suppressed = suppressed;
+	record->level = level;
+	record->rpc[0] = '\0';
+	if(rpc)
+		snprintf(record->rpc, sizeof(record->rpc), "%s", rpc);
+	va_list args;
+	va_start(args, format);
+	vsnprintf(record->message, sizeof(record->message), format, args);
+	va_end(args);
+	
+	if(!running)
+	{
+		char line[512];
+		int len = logger_format(line, sizeof(line), record);
+		pthread_mutex_lock(&logger_mutex);
+		fwrite(line, 1, len, stdout);
+		fflush(stdout);
+		pthread_mutex_unlock(&logger_mutex);
+		return;
+	}
+	ring->head.store(head + 1, std::memory_order_release);
+	/* Pairs with the fence of logger_thread_entry(), either it sees the record or we see it asleep. */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(logger_sleeping.load(std::memory_order_relaxed) && logger_sleeping.exchange(0))
+	{
+		pthread_mutex_lock(&logger_mutex);
+		pthread_cond_signal(&logger_cond);
+		pthread_mutex_unlock(&logger_mutex);
+	}
+}
+
+static int logger_pending(struct logger_ring* rings)
+{
+	for(struct logger_ring* ring = rings; ring; ring = ring->next)
+		if(ring->head.load(std::memory_order_acquire) != ring->tail.load(std::memory_order_relaxed))
+			return 1;
+	return 0;
+}
+
+/* Write the queued records of every ring, merged in time order. */
+static void logger_drain(char* batch)
+{
+	pthread_mutex_lock(&logger_mutex);
+	struct logger_ring* rings = logger_rings;
+	pthread_mutex_unlock(&logger_mutex);
+	
+	int len = 0;
+	while(1)
+	{
+		struct logger_ring* first = NULL;
+		for(struct logger_ring* ring = rings; ring; ring = ring->next)
+		{
+			uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+			if(ring->head.load(std::memory_order_acquire) == tail)
+				continue;
+			if(!first || ring->records[tail % LOGGER_RING_SIZE].time < first->records[first->tail.load(std::memory_order_relaxed) % LOGGER_RING_SIZE].time)
+				first = ring;
+		}
+		if(!first)
+			break;
+		if(len > LOGGER_BATCH_SIZE - 512)
+		{
+			fwrite(batch, 1, len, stdout);
+			len = 0;
+		}
+		uint32_t tail = first->tail.load(std::memory_order_relaxed);
+		len += logger_format(batch + len, 512, &first->records[tail % LOGGER_RING_SIZE]);
+		/* The slot may be reused once the tail passed it. */
+		first->tail.store(tail + 1, std::memory_order_release);
+	}
+	for(struct logger_ring* ring = rings; ring; ring = ring->next)
+	{
+		uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+		if(dropped == ring->reported)
+			continue;
+		if(len > LOGGER_BATCH_SIZE - 512)
+		{
+			fwrite(batch, 1, len, stdout);
+			len = 0;
+		}
+		len += snprintf(batch + len, 512, "[Logger Thread] WARNING: %llu messages dropped, ring full.\n", (unsigned long long)(dropped - ring->reported));
+		ring->reported = dropped;
+	}
+	if(len)
+	{
+		fwrite(batch, 1, len, stdout);
+		fflush(stdout);
+	}
+}
+
+void logger_shutdown(void)
+{
+	/* Later messages of the Main Thread are written at once. */
+	logger_running.store(0, std::memory_order_release);
+	pthread_mutex_lock(&logger_mutex);
+	logger_stop = 1;
+	pthread_cond_signal(&logger_cond);
+	pthread_mutex_unlock(&logger_mutex);
+}
+
+void* logger_thread_entry(void* arg)
+{
+	char* batch = (char*)malloc(LOGGER_BATCH_SIZE);
+	logger_running.store(1, std::memory_order_release);
+	LOGGER_INFO("Logger Thread", "Started.");
+	
+	while(1)
+	{
+		int stop = logger_stop.load();
+		logger_drain(batch);
+		if(stop)
+			break;
+	
+		/* Sleep until a producer finds us asleep, or the timeout. */
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += LOGGER_POLL_TIMEOUT / 1000;
+		pthread_mutex_lock(&logger_mutex);
+		logger_sleeping.store(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(!logger_stop && !logger_pending(logger_rings))
+			pthread_cond_timedwait(&logger_cond, &logger_mutex, &deadline);
+		logger_sleeping.store(0, std::memory_order_relaxed);
+		pthread_mutex_unlock(&logger_mutex);
+	}
+	
+	free(batch);
+	LOGGER_INFO("Logger Thread", "Cleaning up allocated resource.");
+	return NULL;
+}
@@ -0,0 +1,77 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+#include <stdint.h>
+#include <atomic>
+
+/*
+ * Logger : leveled, structured messages, formatted by the calling thread into a ring buffer
+ * only it writes, and written to stdout by the Logger Thread. Logging never waits for the
+ * terminal or journald : a full ring drops the message and counts it, and every call site
+ * is rate limited on its own. A level below LOGGER_LEVEL_COMPILED is compiled out, a level
+ * below the "-v" level costs one relaxed load, the arguments are not evaluated.
+ */
+
+enum logger_level
+{
+	LOGGER_LEVEL_ERROR,
+	LOGGER_LEVEL_WARNING,
+	LOGGER_LEVEL_INFO,
+	LOGGER_LEVEL_DEBUG
+};
+
+/* Most verbose level compiled in, e.g. -DLOGGER_LEVEL_COMPILED=LOGGER_LEVEL_INFO */
+#ifndef LOGGER_LEVEL_COMPILED
+#define LOGGER_LEVEL_COMPILED LOGGER_LEVEL_DEBUG
+#endif
+
+/* Records buffered per thread, a full ring drops new messages. */
+const int LOGGER_RING_SIZE = 256;
+/* Longest message, longer ones are truncated. */
+const int LOGGER_MESSAGE_MAX = 160;
+/* Messages per call site and second, the suppressed ones are counted on the next. */
+const uint32_t LOGGER_RATE_BURST = 20;
+/* millisec , only bounds how fast an idle Logger Thread notices a shutdown */
+const int LOGGER_POLL_TIMEOUT = 1000;
+
+/* Level set by "-v". */
+extern std::atomic<int> g_logger_level;
+
+/* Rate limit state of one call site. */
+struct logger_site
+{
+	std::atomic<uint32_t> window;
+	std::atomic<uint32_t> count;
+	std::atomic<uint32_t> suppressed;
+};
+
+/*
+ * Queue a message of tag. session_id 0, rpc NULL and usec -1 leave that field out.
+ * Messages logged while the Logger Thread is not running are written at once.
+ */
+void logger_write(int level, struct logger_site* site, const char* tag, uint32_t session_id, const char* rpc, int64_t usec, const char* format, ...)
+	__attribute__((format(printf, 7, 8)));
+/* Level named name, or -1. */
+int logger_parse_level(const char* name);
+
+#define LOGGER_LOG(level, tag, session_id, rpc, usec, ...) do { \
+	if((level) <= LOGGER_LEVEL_COMPILED && (level) <= g_logger_level.load(std::memory_order_relaxed)) \
+	{ \
+		static struct logger_site logger_site_; \
+		logger_write((level), &logger_site_, (tag), (session_id), (rpc), (usec), __VA_ARGS__); \
+	} \
+} while(0)
+
+#define LOGGER_ERROR(tag, ...) LOGGER_LOG(LOGGER_LEVEL_ERROR, tag, 0, NULL, -1, __VA_ARGS__)
+#define LOGGER_WARNING(tag, ...) LOGGER_LOG(LOGGER_LEVEL_WARNING, tag, 0, NULL, -1, __VA_ARGS__)
+#define LOGGER_INFO(tag, ...) LOGGER_LOG(LOGGER_LEVEL_INFO, tag, 0, NULL, -1, __VA_ARGS__)
+#define LOGGER_DEBUG(tag, ...) LOGGER_LOG(LOGGER_LEVEL_DEBUG, tag, 0, NULL, -1, __VA_ARGS__)
+/* Message about an RPC of session_id, usec is its duration or -1. */
+#define LOGGER_RPC(level, session_id, rpc, usec, ...) LOGGER_LOG(level, "RPC Handler", session_id, rpc, usec, __VA_ARGS__)
+
+/* Stop the Logger Thread once every other thread has been joined, it drains the rings first. */
+void logger_shutdown(void);
+
+/* Logger Thread Entry Prototype */
+void* logger_thread_entry(void* arg);
+
+#endif
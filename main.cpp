@@ -6,11 +6,16 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <signal.h>
 #include <poll.h>
 #include <pthread.h>
-#include <sys/inotify.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <atomic>
 #include <nc_server.h>
 
 /* SSH/TLS Authentication Related Callbacks*/
@@ -19,6 +24,22 @@
 /* RPC Callbacks */
 #include "rpc_callbacks.h"
 
+/* Versioned Datastores */
+#include "datastore.h"
+
+/* Datastore Persistence */
+#include "persist.h"
+#include "confirm.h"
+#include "notif.h"
+#include "replay.h"
+#include "filewatch.h"
+#include "state.h"
+#include "monitor.h"
+#include "registry.h"
+#include "metrics.h"
+#include "logger.h"
+#include "endpoint.h"
+
 /* Error Handler Macro */
 #define nc_assert(cond) if (!(cond)) { fprintf(stderr, "[NC_ASSERT]: Failed at %s:%d\n", __FILE__, __LINE__); exit(1); }
 
@@ -28,74 +49,109 @@
 /* Constants */
 const char* 	SEARCH_PATH 	= "./modules/";
 const char* 	CONFIG_PATH 	= "./configs/";
-const char*		SSH_ENDPT 		= "main";
-const char*		SERVER_ADDR 	= "0.0.0.0";
-const uint16_t	SERVER_PORT 	= 830;
-/* millisec , 0 for non-block */
+/* Server loop mode, set by "-m". */
+enum server_mode
+{
+	/* Zero timeouts, usleep(SERVER_BUSY_SLEEP) whenever idle. */
+	SERVER_MODE_BUSY,
+	/* Block in nc_accept()/nc_ps_poll() until the sockets become ready. */
+	SERVER_MODE_EVENT
+};
+int g_server_mode = SERVER_MODE_EVENT;
+/* SERVER_MODE_BUSY : millisec , 0 for non-block */
 const int SERVER_ACCEPT_TIMEOUT = 0;
-/* millisec , 0 for non-block */
+/* SERVER_MODE_BUSY : millisec , 0 for non-block */
 const int SERVER_POLL_TIMEOUT = 0;
+/* SERVER_MODE_BUSY : microsec , back-off when nothing is ready */
+const int SERVER_BUSY_SLEEP = 10000;
+/* SERVER_MODE_EVENT : millisec , only bounds how fast g_ctl_server is noticed */
+const int SERVER_EVENT_ACCEPT_TIMEOUT = 1000;
+const int SERVER_EVENT_POLL_TIMEOUT = 1000;
+/* Threads running nc_accept() and its handshakes, set by "-a". */
+const int ACCEPT_THREADS_DEFAULT = 1;
+const int ACCEPT_THREADS_MAX = 16;
+int g_accept_threads = ACCEPT_THREADS_DEFAULT;
+/* Listening endpoints, set by "-e". */
+const char* g_endpoint_path = ENDPOINT_PATH_DEFAULT;
+/* Number of worker threads polling g_pollsession, set by "-w". */
+const int SERVER_WORKERS_DEFAULT = 4;
+const int SERVER_WORKERS_MAX = 64;
+int g_server_workers = SERVER_WORKERS_DEFAULT;
+/* Confirmed-commit checkpoints of running kept in memory for rollback, set by "-r". */
+int g_running_checkpoints = DS_CHECKPOINTS_DEFAULT;
 
 /* Global Libyang Context Pointer */
 struct ly_ctx* ctx = NULL;
 
 /* Global Pollsession Pointers */
 struct nc_pollsession* g_pollsession = NULL;
+/* SERVER_MODE_EVENT : idle workers sleep here until a session is added. */
+pthread_mutex_t g_ps_mutex;
+pthread_cond_t g_ps_cond;
+/* Usage report, see server_report_usage(). */
+std::atomic<uint64_t> g_server_idle_wakeups(0);
+struct timespec g_server_start_time;
 
-/* Global Datastore Pointers */
-struct lyd_node* g_node_running;
-struct lyd_node* g_node_candidate;
-struct lyd_node* g_node_startup;
-struct lyd_node* g_node_state;
+/* Global Datastores */
+struct datastore g_ds_running;
+struct datastore g_ds_candidate;
+struct datastore g_ds_state;
+struct datastore g_ds_startup;
 /* Global Datastore Filepath */
 const char* RUNNING_XML_PATH = "configs/userconfig.xml";
 const char* CANDIDATE_XML_PATH = "configs/userconfig_candidate.xml";
 const char* STARTUP_XML_PATH = "configs/userconfig_startup.xml";
 const char* STATE_XML_PATH = "configs/userdata.xml";
-
-/* Global Datastore Access Control */
-pthread_mutex_t g_sidmutex_running;
-volatile uint32_t g_sid_running;
-pthread_mutex_t g_sidmutex_candidate;
-volatile uint32_t g_sid_candidate;
-pthread_mutex_t g_sidmutex_startup;
-volatile uint32_t g_sid_startup;
+/* Notification Replay Store, sized by "-l" and "-t". */
+const char* REPLAY_PATH = "configs/notifications.replay";
+int g_replay_size = REPLAY_SIZE_DEFAULT;
+int g_replay_age = REPLAY_AGE_DEFAULT;
+/* Metrics endpoint, set by "-s". */
+const char* g_metrics_path = METRICS_PATH_DEFAULT;
+/* Password users, set by "-u". */
+const char* g_auth_users_path = AUTH_USERS_PATH_DEFAULT;
+/* Authorized public keys, set by "-k". */
+const char* g_auth_keys_path = AUTH_KEYS_PATH_DEFAULT;
+/* SSH host keys, set by "-H". */
+const char* g_auth_hostkey_dir = AUTH_HOSTKEY_DIR_DEFAULT;
+/* TLS keystore, set by "-T". */
+const char* g_auth_keystore_dir = AUTH_KEYSTORE_DIR_DEFAULT;
 
 /* Global Control Flags */
 int g_ctl_server = 1;
+/* SIGHUP, the Accept Thread reloads the host keys. */
+volatile sig_atomic_t g_ctl_reload = 0;
 
 /* Unix Environment Settings */
 int unixenv_init(int argc, char** argv);
 void signal_handler(int signo);
 
-/* Server Thread Entry Prototype */
-void* server_thread_entry(void* arg);
+/* Accept Thread Entry Prototype */
+void* accept_thread_entry(void* arg);
 
-/* FileWatch Thread Entry Prototype */
-void* filewatch_thread_entry(void* arg);
-const uint32_t FILEWATCH_MODE = IN_OPEN | IN_CLOSE | IN_DELETE | IN_CREATE;
-const int FILEWATCH_BUFSIZE = 4096;
-int fd_filewatch;
-int wd_running;
-int wd_candidate;
-int wd_state;
+/* Server (Worker) Thread Entry Prototype */
+void* server_thread_entry(void* arg);
+void server_session_release(struct nc_session* session);
+void server_wait_sessions(void);
+void server_report_usage(void);
 
-/* Notificator Thread Entry Prototype */
-void* notificator_thread_entry(void* arg);
-pthread_mutex_t g_notif_mutex;
 
 int main(int argc, char** argv)
 {
 	/* Unix Process Environment and CLI Argument Settings */
 	nc_assert(!unixenv_init(argc, argv));
 	
+	/* Start Logger Thread, first so no other thread ever writes to stdout itself. */
+	pthread_t logger_tid;
+	pthread_create(&logger_tid, NULL, logger_thread_entry, NULL);
+	
 	const struct lys_module* module;
     const struct lys_node* node;
 	
 	/* Create libyang Context */
 	ctx = ly_ctx_new(SEARCH_PATH, LY_CTX_TRUSTED);
 	nc_assert(ctx);
-
+	
 	
 	/* YANG Schema - Load Modules */
 	/* 
@@ -110,10 +166,17 @@ int main(int argc, char** argv)
 	nc_assert(module);
 	module = ly_ctx_load_module(ctx, "ietf-netconf", NULL);
 	nc_assert(module);
-
+	
 	/* ietf-netconf module / optional feature configuration */
 	lys_features_enable(module, "candidate");
 	lys_features_enable(module, "writable-running");
+	/* <edit-config> test-option and rollback-on-error */
+	lys_features_enable(module, "validate");
+	lys_features_enable(module, "rollback-on-error");
+	/* <commit><confirmed/> and <cancel-commit> */
+	lys_features_enable(module, "confirmed-commit");
+	/* <startup/> as a source and target of copy-config, delete-config and lock */
+	lys_features_enable(module, "startup");
 	
 	module = ly_ctx_load_module(ctx, "nc-notifications", NULL);
 	nc_assert(module);
@@ -133,21 +196,57 @@ int main(int argc, char** argv)
 	nc_assert(module);
 	module = ly_ctx_load_module(ctx, "userdata", NULL);
 	nc_assert(module);
-	
-	/* YANG Data Instance - XML Parsing */
-	g_node_running = lyd_parse_path(ctx, RUNNING_XML_PATH, LYD_XML, LYD_OPT_CONFIG);
-	nc_assert(g_node_running);
-	g_node_candidate = lyd_parse_path(ctx, CANDIDATE_XML_PATH, LYD_XML, LYD_OPT_CONFIG);
-	nc_assert(g_node_candidate);
-	g_node_state = lyd_parse_path(ctx, STATE_XML_PATH, LYD_XML, LYD_OPT_DATA_ADD_YANGLIB);
-	nc_assert(g_node_state);
+	/* Listening endpoints, ietf-netconf-server shaped, parsed in a context of their own. */
+	nc_assert(!endpoint_load(SEARCH_PATH, g_endpoint_path));
+	
+	/* YANG Data Instance - binary snapshots or XML Parsing, both validated once. */
+	struct lyd_node* node_running;
+	nc_assert(!persist_load(ctx, RUNNING_XML_PATH, LYD_OPT_CONFIG, &node_running));
+	struct lyd_node* node_candidate;
+	nc_assert(!persist_load(ctx, CANDIDATE_XML_PATH, LYD_OPT_CONFIG, &node_candidate));
+	struct lyd_node* node_startup;
+	nc_assert(!persist_load(ctx, STARTUP_XML_PATH, LYD_OPT_CONFIG, &node_startup));
+	struct lyd_node* node_state = lyd_parse_path(ctx, STATE_XML_PATH, LYD_XML, LYD_OPT_DATA_ADD_YANGLIB);
+	nc_assert(node_state);
+	
+	/* Writes journaled after the last compaction, only then is anything validated again. */
+	if(persist_replay(ctx, RUNNING_XML_PATH, &node_running))
+		lyd_validate(&node_running, LYD_OPT_CONFIG, NULL);
+	if(persist_replay(ctx, CANDIDATE_XML_PATH, &node_candidate))
+		lyd_validate(&node_candidate, LYD_OPT_CONFIG, NULL);
+	if(persist_replay(ctx, STARTUP_XML_PATH, &node_startup))
+		lyd_validate(&node_startup, LYD_OPT_CONFIG, NULL);
 	
 	//DEBUG
-	//lyd_print_file(stdout, g_node_state, LYD_XML, LYP_FORMAT);
-	
-	lyd_validate(&g_node_running, LYD_OPT_CONFIG, NULL);
-	lyd_validate(&g_node_candidate, LYD_OPT_CONFIG, NULL);
-	lyd_validate(&g_node_state, LYD_OPT_DATA, NULL);
+	//lyd_print_file(stdout, node_state, LYD_XML, LYP_FORMAT);
+	
+	/* Notification Replay Store, advertised on the NETCONF stream. */
+	if(g_replay_size)
+		replay_open(REPLAY_PATH, (size_t)g_replay_size << 20, g_replay_age);
+	replay_advertise(node_state);
+	
+	/* Publish the first version of every datastore. */
+	ds_init(&g_ds_running, "running", node_running);
+	ds_init(&g_ds_candidate, "candidate", node_candidate);
+	ds_init(&g_ds_state, "state", node_state);
+	ds_init(&g_ds_startup, "startup", node_startup);
+	ds_set_checkpoints(&g_ds_running, g_running_checkpoints);
+	/* netconf-config-change notifications for every change of running. */
+	ds_listen(&g_ds_running, notif_config_change, NULL);
+	persist_attach(&g_ds_running, RUNNING_XML_PATH);
+	persist_attach(&g_ds_candidate, CANDIDATE_XML_PATH);
+	persist_attach(&g_ds_startup, STARTUP_XML_PATH);
+	/* External edits of the files are reloaded as incremental writes. */
+	filewatch_attach(&g_ds_running, RUNNING_XML_PATH, LYD_OPT_CONFIG, NULL);
+	filewatch_attach(&g_ds_candidate, CANDIDATE_XML_PATH, LYD_OPT_CONFIG, NULL);
+	filewatch_attach(&g_ds_startup, STARTUP_XML_PATH, LYD_OPT_CONFIG, NULL);
+	filewatch_attach(&g_ds_state, STATE_XML_PATH, LYD_OPT_DATA_ADD_YANGLIB, replay_advertise);
+	/* ietf-netconf-monitoring /netconf-state, built from live counters. */
+	monitor_init();
+	/* Session records by session-id, filled by the Accept Thread. */
+	registry_init();
+	/* Latency histograms of every RPC. */
+	metrics_init();
 	
 	/* Set RPC Callbacks */
 	node = ly_ctx_get_node(ctx, NULL, "/ietf-netconf:get", 0);
@@ -190,6 +289,18 @@ int main(int argc, char** argv)
 	nc_assert(node);
 	lys_set_private(node, (void*)rpc_callback_commit);
 	
+	node = ly_ctx_get_node(ctx, NULL, "/ietf-netconf:discard-changes", 0);
+	nc_assert(node);
+	lys_set_private(node, (void*)rpc_callback_discard);
+	
+	node = ly_ctx_get_node(ctx, NULL, "/ietf-netconf:cancel-commit", 0);
+	nc_assert(node);
+	lys_set_private(node, (void*)rpc_callback_cancel_commit);
+	
+	node = ly_ctx_get_node(ctx, NULL, "/ietf-netconf-monitoring:get-schema", 0);
+	nc_assert(node);
+	lys_set_private(node, (void*)rpc_callback_get_schema);
+	
 	/* set Notifications subscription callback */
     node = ly_ctx_get_node(ctx, NULL, "/notifications:create-subscription", 0);
     lys_set_private(node, (void*)rpc_callback_subscribe);
@@ -202,23 +313,59 @@ int main(int argc, char** argv)
 	/* set capabilities for the NETCONF Notifications */
     nc_server_set_capability("urn:ietf:params:netconf:capability:notification:1.0");
     nc_server_set_capability("urn:ietf:params:netconf:capability:interleave:1.0");
+	/* <filter type="xpath"> for <get>/<get-config> */
+	nc_server_set_capability("urn:ietf:params:netconf:capability:xpath:1.0");
 	
 	/* SSH/TLS Authentication Settings */
+	nc_assert(!auth_init(g_auth_users_path));
+	nc_assert(!auth_load_keys(g_auth_keys_path));
+	filewatch_attach_file(g_auth_keys_path, auth_load_keys);
+	nc_assert(auth_load_hostkeys(g_auth_hostkey_dir) > 0);
 	nc_server_ssh_set_hostkey_clb(auth_callback_ssh_hostkey, NULL, NULL);
 	nc_server_ssh_set_passwd_auth_clb(auth_callback_ssh_passwd, NULL, NULL);
+	nc_server_ssh_set_pubkey_auth_clb(auth_callback_ssh_pubkey, NULL, NULL);
+	nc_server_tls_set_server_cert_clb(auth_callback_tls_server_cert, NULL, NULL);
+	nc_server_tls_set_trusted_cert_list_clb(auth_callback_tls_trusted_certs, NULL, NULL);
 	
 	/* SSH/TLS Endpoint Settings */
-	nc_assert(!nc_server_add_endpt(SSH_ENDPT, NC_TI_LIBSSH));
-	nc_assert(!nc_server_endpt_set_address(SSH_ENDPT, SERVER_ADDR));
-	nc_assert(!nc_server_endpt_set_port(SSH_ENDPT, SERVER_PORT));
-	nc_assert(!nc_server_ssh_endpt_add_hostkey(SSH_ENDPT, "default", -1));
-	
-	//nc_assert(!nc_server_ssh_endpt_set_auth_methods(SSH_ENDPT, NC_SSH_AUTH_PUBLICKEY | NC_SSH_AUTH_PASSWORD | NC_SSH_AUTH_INTERACTIVE));
-	nc_assert(!nc_server_ssh_endpt_set_auth_methods(SSH_ENDPT, NC_SSH_AUTH_PASSWORD));
+	nc_assert(!endpoint_apply(!auth_load_keystore(g_auth_keystore_dir)));
 		
-	/* Start Server Thread */
-	pthread_t server_tid;
-	pthread_create(&server_tid, NULL, server_thread_entry, NULL);
+	/* Poll Session, shared by every worker thread. */
+	g_pollsession = nc_ps_new();
+	nc_assert(g_pollsession);
+	
+	/* Start Persistence Thread */
+	pthread_t persist_tid;
+	pthread_create(&persist_tid, NULL, persist_thread_entry, NULL);
+	
+	/* Start Reclaim Thread */
+	pthread_t reclaim_tid;
+	pthread_create(&reclaim_tid, NULL, ds_reclaim_thread_entry, NULL);
+	
+	/* Start Verify Threads, before the Accept Thread authenticates anyone. */
+	pthread_t verify_tids[AUTH_VERIFIERS];
+	for(int i = 0; i < AUTH_VERIFIERS; i++)
+		pthread_create(&verify_tids[i], NULL, auth_verify_thread_entry, NULL);
+	
+	/* Start Confirm Thread */
+	pthread_t confirm_tid;
+	pthread_create(&confirm_tid, NULL, confirm_thread_entry, NULL);
+	
+	/* Start State Threads */
+	pthread_t state_tids[STATE_WORKERS];
+	for(int i = 0; i < STATE_WORKERS; i++)
+		pthread_create(&state_tids[i], NULL, state_thread_entry, NULL);
+	
+	/* Start Accept Threads, each accepts on every endpoint. */
+	clock_gettime(CLOCK_MONOTONIC, &g_server_start_time);
+	pthread_t accept_tids[ACCEPT_THREADS_MAX];
+	for(long i = 0; i < g_accept_threads; i++)
+		pthread_create(&accept_tids[i], NULL, accept_thread_entry, (void*)i);
+	
+	/* Start Server Worker Threads */
+	pthread_t server_tids[SERVER_WORKERS_MAX];
+	for(long i = 0; i < g_server_workers; i++)
+		pthread_create(&server_tids[i], NULL, server_thread_entry, (void*)i);
 	
 	/* Start Notificator Thread */
 	pthread_t notificator_tid;
@@ -227,295 +374,334 @@ int main(int argc, char** argv)
 	/* Start Filewatch Thread */
 	pthread_t filewatch_tid;
 	pthread_create(&filewatch_tid, NULL, filewatch_thread_entry, NULL);
-
+	
+	/* Start Metrics Thread */
+	pthread_t metrics_tid;
+	if(*g_metrics_path)
+		pthread_create(&metrics_tid, NULL, metrics_thread_entry, (void*)g_metrics_path);
+	
 	/* TODO Command Line Interface */
 	
 	/* Thread Scheduling */
+	if(*g_metrics_path)
+		pthread_join(metrics_tid, NULL);
 	pthread_join(filewatch_tid, NULL);
 	pthread_join(notificator_tid, NULL);
-	pthread_join(server_tid, NULL);
+	for(int i = 0; i < g_accept_threads; i++)
+		pthread_join(accept_tids[i], NULL);
+	auth_shutdown();
+	for(int i = 0; i < AUTH_VERIFIERS; i++)
+		pthread_join(verify_tids[i], NULL);
+	for(int i = 0; i < g_server_workers; i++)
+		pthread_join(server_tids[i], NULL);
+	state_shutdown();
+	for(int i = 0; i < STATE_WORKERS; i++)
+		pthread_join(state_tids[i], NULL);
+	confirm_shutdown();
+	pthread_join(confirm_tid, NULL);
+	/* No writers left, flush the journals. */
+	persist_shutdown();
+	pthread_join(persist_tid, NULL);
+	/* Last versions are freed by ds_destroy(). */
+	ds_reclaim_shutdown();
+	pthread_join(reclaim_tid, NULL);
+	logger_shutdown();
+	pthread_join(logger_tid, NULL);
 	
 	/* Stop NETCONF server */
-	printf("[Main Thread] Cleaning up allocated resource.\n");
+	server_report_usage();
+	LOGGER_INFO("Main Thread", "Cleaning up allocated resource.");
+	nc_ps_clear(g_pollsession, 0, NULL);
+	nc_ps_free(g_pollsession);
+	pthread_mutex_destroy(&g_ps_mutex);
+	pthread_cond_destroy(&g_ps_cond);
 	nc_server_destroy();  
-	lyd_free_withsiblings(g_node_running);
-	lyd_free_withsiblings(g_node_candidate);
-	lyd_free_withsiblings(g_node_state);
+	ds_destroy(&g_ds_running);
+	ds_destroy(&g_ds_candidate);
+	ds_destroy(&g_ds_state);
+	ds_destroy(&g_ds_startup);
+	state_destroy();
+	replay_close();
+	auth_destroy();
 	ly_ctx_clean(ctx, NULL);
 	ly_ctx_destroy(ctx, NULL);
 	return 0;
 }
 
-void* filewatch_thread_entry(void* arg)
+void* accept_thread_entry(void* arg)
 {
-	printf("[Filewatch Thread] Initializing...\n");
-	/* Add filepaths to the filewatch thread. */
-	fd_filewatch = inotify_init1(IN_NONBLOCK);
-	if(fd_filewatch <= 0)
-		printf("[Filewatch Thread] ERROR: Failed to init Inotify.\n");
-	wd_running = inotify_add_watch(fd_filewatch, RUNNING_XML_PATH, FILEWATCH_MODE);
-	if(fd_filewatch <= 0)
-		printf("[Filewatch Thread] ERROR: Failed to init Inotify.\n");
-	wd_candidate = inotify_add_watch(fd_filewatch, CANDIDATE_XML_PATH, FILEWATCH_MODE);
-	if(fd_filewatch <= 0)
-		printf("[Filewatch Thread] ERROR: Failed to init Inotify.\n");
-	wd_state = inotify_add_watch(fd_filewatch, STATE_XML_PATH, FILEWATCH_MODE);
-	if(fd_filewatch <= 0)
-		printf("[Filewatch Thread] ERROR: Failed to init Inotify.\n");
-	
-	/* Inotify Events */
-	char event_buf[FILEWATCH_BUFSIZE];  
-	int event_length;  
-	struct inotify_event *event_ptr;
-	
-	/* Poll Releated Stuff */
-	struct pollfd poll_fds[1];
-	nfds_t poll_nfds = 1;
-	int poll_number;
-	
-	poll_fds[0].fd = fd_filewatch;
-	poll_fds[0].events = POLLIN;
-	
-	printf("[Filewatch Thread] Ready.\n");
-	while(g_ctl_server)
-	{
-        /* Using poll IO multiplexing. */
-        poll_number = poll(poll_fds, poll_nfds, 500);
-        if(poll_number == 0)
-        	continue;
-        if(poll_fds[0].revents & POLLIN)
-        {
-			/* Use non-block here to support poll. */
-			event_length = read(fd_filewatch, event_buf, sizeof(event_buf));
-			if(event_length <= 0 && errno != EAGAIN)  
-        		printf("[Filewatch Thread] read() failed.\n");
-			if(event_length < (int)sizeof(struct inotify_event))
-    	    	printf("[Filewatch Thread] WARNING: Incomplete inotify event.\n");
-  	      
-  	      /* Init Buffer Pointer*/
-  	      event_ptr =(struct inotify_event *)event_buf;
-  	      
-    	    /* Handle events and TODO update YANG data instance / send notofication. */
-			while(event_length > 0)
-			{
-				if(event_ptr -> wd == wd_running)
-				{
-					if(event_ptr -> mask & IN_OPEN)
-					{
-						printf("[Filewatch Thread] Running Config File Opened.\n");
-					}
-					if(event_ptr -> mask & IN_CLOSE_NOWRITE)
-					{
-						printf("[Filewatch Thread] Running Config File Closed, not written.\n");
-					}
-					if(event_ptr -> mask & IN_CLOSE_WRITE)
-					{
-						printf("[Filewatch Thread] Running Config File Closed, written.\n");
-					}
-					if(event_ptr -> mask & IN_CREATE)
-					{
-						printf("[Filewatch Thread] Running Config File Created.\n");
-					}
-					if(event_ptr -> mask & IN_DELETE)
-					{
-						printf("[Filewatch Thread] Running Config File Deleted.\n");
-					}
-					if(event_ptr -> mask == 32768)
-					{
-						printf("[Filewatch Thread] Running Config File inode Removed, monitoring new node.\n");
-						if(fd_filewatch <= 0)
-							printf("[Filewatch Thread] ERROR: Failed to add inode.\n");
-						wd_running = inotify_add_watch(fd_filewatch, RUNNING_XML_PATH, FILEWATCH_MODE);
-					}
-				}
-				
-				if(event_ptr -> wd == wd_candidate)
-				{
-					if(event_ptr -> mask & IN_OPEN)
-					{
-						printf("[Filewatch Thread] Candidate Config File Opened.\n");
-					}
-					if(event_ptr -> mask & IN_CLOSE_NOWRITE)
-					{
-						printf("[Filewatch Thread] Candidate Config File Closed, not written.\n");
-					}
-					if(event_ptr -> mask & IN_CLOSE_WRITE)
-					{
-						printf("[Filewatch Thread] Candidate Config File Closed, written.\n");
-					}
-					if(event_ptr -> mask & IN_CREATE)
-					{
-						printf("[Filewatch Thread] Candidate Config File Created.\n");
-					}
-					if(event_ptr -> mask & IN_DELETE)
-					{
-						printf("[Filewatch Thread] Candidate Config File Deleted.\n");
-					}
-					if(event_ptr -> mask == 32768)
-					{
-						printf("[Filewatch Thread] Candidate Config File inode Removed, monitoring new node.\n");
-						if(fd_filewatch <= 0)
-							printf("[Filewatch Thread] ERROR: Failed to add inode.\n");
-						wd_running = inotify_add_watch(fd_filewatch, CANDIDATE_XML_PATH, FILEWATCH_MODE);
-					}
-				}
-				
-				if(event_ptr -> wd == wd_state)
-				{
-					if(event_ptr -> mask & IN_OPEN)
-					{
-						printf("[Filewatch Thread] State File Opened.\n");
-					}
-					if(event_ptr -> mask & IN_CLOSE_NOWRITE)
-					{
-						printf("[Filewatch Thread] State File Closed, not written.\n");
-					}
-					if(event_ptr -> mask & IN_CLOSE_WRITE)
-					{
-						printf("[Filewatch Thread] State File Closed, written.\n");
-					}
-					if(event_ptr -> mask & IN_CREATE)
-					{
-						printf("[Filewatch Thread] State File Created.\n");
-					}
-					if(event_ptr -> mask & IN_DELETE)
-					{
-						printf("[Filewatch Thread] State File Deleted.\n");
-					}
-					if(event_ptr -> mask == 32768)
-					{
-						printf("[Filewatch Thread] State File inode Removed, monitoring new node.\n");
-					if(fd_filewatch <= 0)
-						printf("[Filewatch Thread] ERROR: Failed to add inode.\n");
-						wd_running = inotify_add_watch(fd_filewatch, STATE_XML_PATH, FILEWATCH_MODE);
-					}
-				}
-				/* Flush the buffered stdout, for real-time monitoring. */
-				fflush(stdout);
-				event_length -= (sizeof(struct inotify_event) + event_ptr->len);
-				event_ptr += (sizeof(struct inotify_event) + event_ptr->len);
-			}
-		}
-	}
-	printf("[Filewatch Thread] Cleaning up allocated resource.\n");
-	inotify_rm_watch(fd_filewatch, wd_running);
-	inotify_rm_watch(fd_filewatch, wd_candidate);
-	inotify_rm_watch(fd_filewatch, wd_state);
-	close(fd_filewatch);
-	nc_thread_destroy();
-}
-
-void* server_thread_entry(void* arg)
-{
-	printf("[Server Thread] Started.\n");
+	long accept_id = (long)arg;
+	LOGGER_INFO("Accept Thread", "Acceptor %ld started.", accept_id);
 	
 	NC_MSG_TYPE msgtype;
 	struct nc_session* session = NULL;
+	/* Event mode waits in poll() on the listening sockets inside nc_accept(). */
+	int accept_timeout = (g_server_mode == SERVER_MODE_EVENT) ? SERVER_EVENT_ACCEPT_TIMEOUT : SERVER_ACCEPT_TIMEOUT;
 	
-	/* Poll Session */
-	g_pollsession = nc_ps_new();
-	nc_assert(g_pollsession);
-	
-	/* Server Thread Loop */
+	/* Accept Thread Loop, RPCs are handled by the server worker threads. */
 	while(g_ctl_server)
 	{
-		msgtype = nc_accept(SERVER_ACCEPT_TIMEOUT, &session);
+		/* The first thread reloads, libnetconf2 holds it off the endpoints while handshakes use them. */
+		if(accept_id == 0 && g_ctl_reload)
+		{
+			g_ctl_reload = 0;
+			auth_load_hostkeys(g_auth_hostkey_dir);
+			endpoint_reload_hostkeys();
+		}
+		msgtype = nc_accept(accept_timeout, &session);
 		switch(msgtype)
 		{
 			case NC_MSG_HELLO:
-				printf("[Server Thread] <hello> received.\n");
+				LOGGER_DEBUG("Accept Thread", "<hello> received.");
+				registry_add(session);
+				monitor_session_start();
 				/* Fill Poll Session with Accepted Session */
 				nc_assert(!nc_ps_add_session(g_pollsession, session));
-				printf("[Server Thread] Session Accepted, %d remaining.\n", nc_ps_session_count(g_pollsession));
+				LOGGER_INFO("Accept Thread", "Session Accepted, %d remaining.", nc_ps_session_count(g_pollsession));
+				/* Wake the workers idling on an empty poll session. */
+				pthread_mutex_lock(&g_ps_mutex);
+				pthread_cond_broadcast(&g_ps_cond);
+				pthread_mutex_unlock(&g_ps_mutex);
 				break;
 			case NC_MSG_WOULDBLOCK:
-				/* NON-BLOCK NC_ACCEPT(), UNUSED HERE */
-				//printf("[Server Thread] Timeout.\n");
+				/* Nothing pending, nc_accept() already waited in event mode. */
+				g_server_idle_wakeups++;
+				if(g_server_mode == SERVER_MODE_BUSY)
+					usleep(SERVER_BUSY_SLEEP);
 				break;
 			case NC_MSG_BAD_HELLO:
-				printf("[Server Thread] <hello> parsing failed.\n");
+				LOGGER_WARNING("Accept Thread", "<hello> parsing failed.");
+				monitor_bad_hello();
 				break;
 			case NC_MSG_ERROR:
-				printf("[Server Thread] nc_accept() Error.\n");
+				LOGGER_ERROR("Accept Thread", "nc_accept() Error.");
 				break;
 			default:
-				printf("[Server Thread] Unexpected response from nc_accept().\n");
+				LOGGER_ERROR("Accept Thread", "Unexpected response from nc_accept().");
 		}
-		int poll_ret = nc_ps_poll(g_pollsession, SERVER_POLL_TIMEOUT, &session);
+	}
+	LOGGER_INFO("Accept Thread", "Acceptor %ld cleaning up allocated resource.", accept_id);
+	nc_thread_destroy();
+	return NULL;
+}
+
+void* server_thread_entry(void* arg)
+{
+	long worker_id = (long)arg;
+	LOGGER_INFO("Server Thread", "Worker %ld started.", worker_id);
+	
+	struct nc_session* session = NULL;
+	int poll_timeout = (g_server_mode == SERVER_MODE_EVENT) ? SERVER_EVENT_POLL_TIMEOUT : SERVER_POLL_TIMEOUT;
+	
+	/* Server Thread Loop, nc_ps_poll() is thread-safe on a shared poll session. */
+	while(g_ctl_server)
+	{
+		int poll_ret = nc_ps_poll(g_pollsession, poll_timeout, &session);
+		if(poll_ret & (NC_PSPOLL_RPC | NC_PSPOLL_BAD_RPC))
+			monitor_rpc(session, poll_ret);
+		if(poll_ret & NC_PSPOLL_RPC)
+			rpc_reply_sent();
 		if(poll_ret & NC_PSPOLL_SESSION_TERM)
 		{
-			/* Access Control : Release closed session controlled datastores */
-			pthread_mutex_lock(&g_sidmutex_running);
-			if(g_sid_running == nc_session_get_id(session))
-			{
-				printf("[Server Thread] Releasing related datastore locks.\n");
-				g_sid_running = 0;
-			}
-			pthread_mutex_unlock(&g_sidmutex_running);
-			
-			pthread_mutex_lock(&g_sidmutex_candidate);
-			if(g_sid_candidate == nc_session_get_id(session))
-			{
-				printf("[Server Thread] Releasing related datastore locks.\n");
-				g_sid_candidate = 0;
-			}
-			pthread_mutex_unlock(&g_sidmutex_candidate);
-			
-			nc_assert(!nc_ps_del_session(g_pollsession, session));
-			nc_session_free(session, NULL);
-			printf("[Server Thread] Session Closed, %d remaining.\n", nc_ps_session_count(g_pollsession));
+			/* Only the worker which polled the termination gets here, once per session. */
+			server_session_release(session);
 		}
-		else
+		else if(poll_ret & (NC_PSPOLL_NOSESSIONS | NC_PSPOLL_TIMEOUT | NC_PSPOLL_ERROR))
 		{
-			if(poll_ret & (NC_PSPOLL_NOSESSIONS | NC_PSPOLL_TIMEOUT | NC_PSPOLL_ERROR))
-				usleep(10000);
+			g_server_idle_wakeups++;
+			if(g_server_mode == SERVER_MODE_BUSY)
+				usleep(SERVER_BUSY_SLEEP);
+			else if(poll_ret & NC_PSPOLL_NOSESSIONS)
+				server_wait_sessions();
 		}
-		
 	}
-	printf("[Server Thread] Cleaning up allocated resource.\n");
-	nc_ps_clear(g_pollsession, 0, NULL);
-	pthread_mutex_destroy(&g_sidmutex_running);
-    nc_ps_free(g_pollsession);
+	LOGGER_INFO("Server Thread", "Worker %ld cleaning up allocated resource.", worker_id);
 	nc_thread_destroy();
+	return NULL;
 }
 
-void* notificator_thread_entry(void* arg)
+void server_session_release(struct nc_session* session)
 {
-	printf("[Notificator Thread] Started.\n");
-	pthread_mutex_init(&g_notif_mutex,NULL);
-	sleep(10);
-	while(g_ctl_server)
+	uint32_t session_id = nc_session_get_id(session);
+	
+	/* Unregistered, with the datastore locks it held released. */
+	struct registry_session* record = registry_remove(session);
+	/* A confirmed commit without <persist> ends with its session. */
+	confirm_session_closed(session_id);
+	if(record)
+		notif_session_closed(record);
+	monitor_session_end(session);
+	
+	/* No other thread may hold this session pointer while it is freed. */
+	if(record)
+		registry_detach(record);
+	nc_assert(!nc_ps_del_session(g_pollsession, session));
+	nc_session_free(session, NULL);
+	LOGGER_INFO("Server Thread", "Session Closed, %d remaining.", nc_ps_session_count(g_pollsession));
+}
+
+void server_wait_sessions(void)
+{
+	/* nc_ps_poll() returns at once on an empty poll session, sleep until accept adds one. */
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += SERVER_EVENT_POLL_TIMEOUT / 1000;
+	pthread_mutex_lock(&g_ps_mutex);
+	while(g_ctl_server && !nc_ps_session_count(g_pollsession))
 	{
-		struct lyd_node* notif_tree = lyd_new_path(NULL, ctx, "/nc-notifications:notificationComplete", NULL, LYD_ANYDATA_DATATREE, LYD_OPT_DATA);
-		char msg_buf[64] = {0};
-		struct nc_server_notif* notif_data = nc_server_notif_new(notif_tree, nc_time2datetime(time(NULL), NULL, msg_buf), NC_PARAMTYPE_FREE);
-		for(uint16_t psid; ;psid++)
-		{
-			struct nc_session* session_ptr = nc_ps_get_session(g_pollsession, psid);
-			if(session_ptr == NULL)
-			{	
-				break;
-			}
-			else
-			{
-				printf("[Notificator Thread] Sending Notification, as you wish.\n");
-				nc_session_set_notif_status(session_ptr, 1);
-				NC_MSG_TYPE msgtype = nc_server_notif_send(session_ptr, notif_data, -1);
-				if(msgtype != NC_MSG_NOTIF)
-					printf("[Notificator Thread] Error sending notification.\n");
-			}
-		}
-		sleep(1);
+		if(pthread_cond_timedwait(&g_ps_cond, &g_ps_mutex, &deadline) == ETIMEDOUT)
+			break;
 	}
-	printf("[Notificator Thread] Cleaning up allocated resource.\n");
-	pthread_mutex_destroy(&g_notif_mutex);
-	nc_thread_destroy();
+	pthread_mutex_unlock(&g_ps_mutex);
+}
+
+void server_report_usage(void)
+{
+	/* Idle cost: process CPU time against wall time, plus loop wakeups without work. */
+	struct timespec now;
+	struct rusage usage;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	getrusage(RUSAGE_SELF, &usage);
+	double wall = (now.tv_sec - g_server_start_time.tv_sec) + (now.tv_nsec - g_server_start_time.tv_nsec) / 1e9;
+	double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	if(wall <= 0)
+		wall = 1e-9;
+	
+	LOGGER_INFO("Server Thread", "Mode : %s, %d workers.", (g_server_mode == SERVER_MODE_EVENT) ? "event" : "busy", g_server_workers);
+	LOGGER_INFO("Server Thread", "Uptime %.1f s, CPU %.2f s (%.2f%% of one core).", wall, cpu, 100 * cpu / wall);
+	LOGGER_INFO("Server Thread", "Idle wakeups %llu (%.1f/s).", (unsigned long long)g_server_idle_wakeups.load(), g_server_idle_wakeups.load() / wall);
+	/* 
+	 * The latency the loop adds is not reported : libnetconf2 does not tell when a socket
+	 * became readable, only the configured back-off is known.
+	 */
+	if(g_server_mode == SERVER_MODE_BUSY)
+		LOGGER_INFO("Server Thread", "Back-off %d us after every idle poll, its added latency is not measured.", SERVER_BUSY_SLEEP);
 }
 
 /* Unix Related Stuff */
 int unixenv_init(int argc, char** argv)
 {
-	printf("[Main Thread] Starting NETCONF Server...\n");
+	LOGGER_INFO("Main Thread", "Starting NETCONF Server...");
+	/* Command Line Arguments */
+	int opt;
+	int level;
+	while((opt = getopt(argc, argv, "a:e:w:m:r:n:l:t:s:u:k:H:T:v:bh")) != -1)
+	{
+		switch(opt)
+		{
+			case 'm':
+				if(!strcmp(optarg, "event"))
+					g_server_mode = SERVER_MODE_EVENT;
+				else if(!strcmp(optarg, "busy"))
+					g_server_mode = SERVER_MODE_BUSY;
+				else
+				{
+					fprintf(stderr, "[Main Thread] Unknown server mode \"%s\".\n", optarg);
+					return 1;
+				}
+				break;
+			case 'a':
+				g_accept_threads = atoi(optarg);
+				if(g_accept_threads < 1 || g_accept_threads > ACCEPT_THREADS_MAX)
+				{
+					fprintf(stderr, "[Main Thread] Accept thread count must be within 1-%d.\n", ACCEPT_THREADS_MAX);
+					return 1;
+				}
+				break;
+			case 'e':
+				g_endpoint_path = optarg;
+				break;
+			case 'w':
+				g_server_workers = atoi(optarg);
+				if(g_server_workers < 1 || g_server_workers > SERVER_WORKERS_MAX)
+				{
+					fprintf(stderr, "[Main Thread] Worker count must be within 1-%d.\n", SERVER_WORKERS_MAX);
+					return 1;
+				}
+				break;
+			case 'r':
+				g_running_checkpoints = atoi(optarg);
+				if(g_running_checkpoints < 1 || g_running_checkpoints > DS_CHECKPOINTS_MAX)
+				{
+					fprintf(stderr, "[Main Thread] Running checkpoint depth must be within 1-%d.\n", DS_CHECKPOINTS_MAX);
+					return 1;
+				}
+				break;
+			case 'n':
+				if(!strcmp(optarg, "drop"))
+					g_notif_policy = NOTIF_POLICY_DROP;
+				else if(!strcmp(optarg, "disconnect"))
+					g_notif_policy = NOTIF_POLICY_DISCONNECT;
+				else if(!strcmp(optarg, "coalesce"))
+					g_notif_policy = NOTIF_POLICY_COALESCE;
+				else
+				{
+					fprintf(stderr, "[Main Thread] Unknown slow subscriber policy \"%s\".\n", optarg);
+					return 1;
+				}
+				break;
+			case 'l':
+				g_replay_size = atoi(optarg);
+				if(g_replay_size < 0)
+				{
+					fprintf(stderr, "[Main Thread] Replay store size must be positive.\n");
+					return 1;
+				}
+				break;
+			case 't':
+				g_replay_age = atoi(optarg);
+				break;
+			case 's':
+				g_metrics_path = optarg;
+				break;
+			case 'u':
+				g_auth_users_path = optarg;
+				break;
+			case 'k':
+				g_auth_keys_path = optarg;
+				break;
+			case 'H':
+				g_auth_hostkey_dir = optarg;
+				break;
+			case 'T':
+				g_auth_keystore_dir = optarg;
+				break;
+			case 'b':
+				g_persist_lyb = 0;
+				break;
+			case 'v':
+				level = logger_parse_level(optarg);
+				if(level < 0)
+				{
+					fprintf(stderr, "[Main Thread] Unknown log level \"%s\".\n", optarg);
+					return 1;
+				}
+				g_logger_level = level;
+				break;
+			case 'h':
+			default:
+				printf("Usage: %s [-a threads] [-e path] [-w workers] [-m event|busy] [-r depth] [-n drop|disconnect|coalesce] [-l MB] [-t seconds] [-s path] [-u path] [-k path] [-H dir] [-T dir] [-v level] [-b]\n", argv[0]);
+				printf("  -a threads   Number of accept threads, each running SSH/TLS handshakes (default %d).\n", ACCEPT_THREADS_DEFAULT);
+				printf("  -e path      Listening endpoints, ietf-netconf-server shaped (default %s).\n", ENDPOINT_PATH_DEFAULT);
+				printf("  -w workers   Number of RPC worker threads (default %d).\n", SERVER_WORKERS_DEFAULT);
+				printf("  -m mode      event : block until sockets are ready (default).\n");
+				printf("               busy  : non-blocking polling with %d us back-off.\n", SERVER_BUSY_SLEEP);
+				printf("  -r depth     Confirmed-commit checkpoints of running kept for rollback (default %d).\n", DS_CHECKPOINTS_DEFAULT);
+				printf("  -n policy    Subscriber with %u queued notifications, drop new ones (default), disconnect, or coalesce config changes.\n", NOTIF_QUEUE_SIZE);
+				printf("  -l MB        Notification replay store size (default %d, 0 disables replay).\n", REPLAY_SIZE_DEFAULT);
+				printf("  -t seconds   Notifications older than this are dropped from the replay store (default %d, 0 : no limit).\n", REPLAY_AGE_DEFAULT);
+				printf("  -s path      Metrics endpoint unix socket (default %s, \"\" disables it).\n", METRICS_PATH_DEFAULT);
+				printf("  -u path      Password users, \"user:crypt-hash\" per line (default %s).\n", AUTH_USERS_PATH_DEFAULT);
+				printf("  -k path      Authorized public keys, \"user key-type base64\" per line, reloaded when rewritten (default %s).\n", AUTH_KEYS_PATH_DEFAULT);
+				printf("  -H dir       SSH host keys ssh_host_{ed25519,ecdsa,rsa}_key, reloaded on SIGHUP (default %s).\n", AUTH_HOSTKEY_DIR_DEFAULT);
+				printf("  -T dir       TLS keystore, server.crt/server.key, trusted/*.pem and cert_to_name (default %s).\n", AUTH_KEYSTORE_DIR_DEFAULT);
+				printf("  -v level     Log level, error, warning, info (default) or debug.\n");
+				printf("  -b           No binary snapshots, boot from the XML files only.\n");
+				return 1;
+		}
+	}
+	LOGGER_INFO("Main Thread", "%d accept threads, %d RPC worker threads, %s mode.", g_accept_threads, g_server_workers, (g_server_mode == SERVER_MODE_EVENT) ? "event" : "busy");
+	
 	/* Setting up signal handlers */
 	sigset_t block_mask;
 	sigfillset(&block_mask);
@@ -526,11 +712,12 @@ int unixenv_init(int argc, char** argv)
 	sigaction(SIGINT, &action, NULL);
 	sigaction(SIGTERM, &action, NULL);
 	sigaction(SIGSEGV, &action, NULL);
-	/* For Remote Logins, ignore SIGHUP, continue running when logout. */
+	/* For Remote Logins, continue running when logout, SIGHUP only reloads the host keys. */
 	sigaction(SIGHUP, &action, NULL);
 	
 	/* Access Control related*/
-	pthread_mutex_init(&g_sidmutex_running, NULL);
+	pthread_mutex_init(&g_ps_mutex, NULL);
+	pthread_cond_init(&g_ps_cond, NULL);
 	
 	return 0;
 }
@@ -547,6 +734,9 @@ void signal_handler(int signo)
 			printf("\nSIGTERM received, stopping server\n.");
 			g_ctl_server = 0;
 			break;
+		case SIGHUP:
+			g_ctl_reload = 1;
+			break;
 		case SIGSEGV:
 			printf("\nSIGSEGV received, stopping server.\n");
 			g_ctl_server = 0;
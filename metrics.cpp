@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/tcp.h>
+#include <atomic>
+#include <nc_server.h>
+#include "datastore.h"
+#include "notif.h"
+#include "registry.h"
+#include "metrics.h"
+#include "logger.h"
+
+extern int g_ctl_server;
+
+/* Global Datastores */
+extern struct datastore g_ds_running;
+extern struct datastore g_ds_candidate;
+extern struct datastore g_ds_startup;
+extern struct datastore g_ds_state;
+
+const char* METRICS_PATH_DEFAULT = "configs/metrics.sock";
+/* millisec , how long a scraper may take to send its request */
+const int METRICS_READ_TIMEOUT = 100;
+/* millisec , only bounds how fast g_ctl_server is noticed */
+const int METRICS_POLL_TIMEOUT = 1000;
+
+/* RPCs with their own histogram, anything else is counted as "other". */
+static const char* METRICS_RPCS[] = { "get", "get-config", "edit-config", "copy-config", "delete-config", "lock", "unlock",
+	"kill-session", "commit", "cancel-commit", "get-schema", "create-subscription", "other" };
+const int METRICS_RPC_COUNT = sizeof(METRICS_RPCS) / sizeof(METRICS_RPCS[0]);
+static int metrics_rpc_ids[METRICS_RPC_COUNT];
+
+struct metrics_family
+{
+	const char* family;
+	const char* label;
+	const char* value;
+};
+static struct metrics_family metrics_families[METRICS_HISTOGRAMS_MAX];
+static int metrics_family_count = 0;
+
+/* Histograms of one thread, only ever written by it. */
+struct metrics_shard
+{
+	std::atomic<uint64_t> buckets[METRICS_HISTOGRAMS_MAX][METRICS_BUCKETS];
+	std::atomic<uint64_t> sums[METRICS_HISTOGRAMS_MAX];
+	struct metrics_shard* next;
+};
+
+/* Shards of every thread which ever recorded, kept until exit so no count is lost. */
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_shard* metrics_shards = NULL;
+static thread_local struct metrics_shard* metrics_local = NULL;
+
+uint64_t metrics_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int metrics_histogram(const char* family, const char* label, const char* value)
+{
+	if(metrics_family_count == METRICS_HISTOGRAMS_MAX)
+	{
+		LOGGER_ERROR("Metrics Thread", "Too many histograms.");
+		return -1;
+	}
+	metrics_families[metrics_family_count].family = family;
+	metrics_families[metrics_family_count].label = label;
+	metrics_families[metrics_family_count].value = value;
+	return metrics_family_count++;
+}
+
+void metrics_init(void)
+{
+	for(int i = 0; i < METRICS_RPC_COUNT; i++)
+		metrics_rpc_ids[i] = metrics_histogram("netconf_rpc_duration_seconds", "op", METRICS_RPCS[i]);
+}
+
+int metrics_rpc(const char* name)
+{
+	for(int i = 0; i < METRICS_RPC_COUNT - 1; i++)
+		if(!strcmp(name, METRICS_RPCS[i]))
+			return metrics_rpc_ids[i];
+	return metrics_rpc_ids[METRICS_RPC_COUNT - 1];
+}
+
+static int metrics_bucket(uint64_t usec)
+{
+	if(usec < (1 << METRICS_SUB_BITS))
+		return (int)usec;
+	int exp = 63 - __builtin_clzll(usec);
+	if(exp >= 30)
+		return METRICS_BUCKETS - 1;
+	return ((exp - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) + (int)((usec >> (exp - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1));
+}
+
+/* Smallest value above bucket. */
+static uint64_t metrics_bucket_end(int bucket)
+{
+	if(bucket < (1 << METRICS_SUB_BITS))
+		return bucket + 1;
+	int exp = (bucket >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+	uint64_t lower = (uint64_t)((1 << METRICS_SUB_BITS) + (bucket & ((1 << METRICS_SUB_BITS) - 1))) << (exp - METRICS_SUB_BITS);
+	return lower + ((uint64_t)1 << (exp - METRICS_SUB_BITS));
+}
+
+void metrics_record(int id, uint64_t usec)
+{
+	if(id < 0)
+		return;
+	struct metrics_shard* shard = metrics_local;
+	if(!shard)
+	{
+		/* Value-initialized, every counter starts at 0. */
+		shard = new metrics_shard();
+		pthread_mutex_lock(&metrics_mutex);
+		shard->next = metrics_shards;
+		metrics_shards = shard;
+		pthread_mutex_unlock(&metrics_mutex);
+		metrics_local = shard;
+	}
+	/* Single writer, a plain load and store is enough and never waits. */
+	std::atomic<uint64_t>* bucket = &shard->buckets[id][metrics_bucket(usec)];
+	bucket->store(bucket->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	shard->sums[id].store(shard->sums[id].load(std::memory_order_relaxed) + usec, std::memory_order_relaxed);
+}
+
+/* Growing text buffer of one scrape. */
+struct metrics_buffer
+{
+	char* data;
+	size_t len;
+	size_t size;
+};
+
+static void metrics_printf(struct metrics_buffer* buffer, const char* format, ...)
+{
+	va_list args;
+	while(1)
+	{
+		va_start(args, format);
+		int len = vsnprintf(buffer->data + buffer->len, buffer->size - buffer->len, format, args);
+		va_end(args);
+		if(len < 0)
+			return;
+		if(buffer->len + len < buffer->size)
+		{
+			buffer->len += len;
+			return;
+		}
+		buffer->size = buffer->size ? buffer->size * 2 : 65536;
+		buffer->data = (char*)realloc(buffer->data, buffer->size);
+	}
+}
+
+static void metrics_append(struct metrics_buffer* buffer, const struct metrics_buffer* tail)
+{
+	if(tail->len)
+		metrics_printf(buffer, "%.*s", (int)tail->len, tail->data);
+}
+
+/* Histograms of one family are registered one after the other. */
+static void metrics_histograms(struct metrics_buffer* buffer)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t buckets[METRICS_BUCKETS];
+	/* Quantiles of the current family, exported as a gauge family once it is complete. */
+	struct metrics_buffer quantile = { NULL, 0, 0 };
+	for(int id = 0; id < metrics_family_count; id++)
+	{
+		const struct metrics_family* hist = &metrics_families[id];
+		const char* family = hist->family;
+		memset(buckets, 0, sizeof(buckets));
+		uint64_t sum = 0;
+		uint64_t count = 0;
+		pthread_mutex_lock(&metrics_mutex);
+		for(struct metrics_shard* shard = metrics_shards; shard; shard = shard->next)
+		{
+			for(int i = 0; i < METRICS_BUCKETS; i++)
+				buckets[i] += shard->buckets[id][i].load(std::memory_order_relaxed);
+			sum += shard->sums[id].load(std::memory_order_relaxed);
+		}
+		pthread_mutex_unlock(&metrics_mutex);
+		for(int i = 0; i < METRICS_BUCKETS; i++)
+			count += buckets[i];
+		
+		if(!id || strcmp(family, metrics_families[id - 1].family))
+			metrics_printf(buffer, "# TYPE %s histogram\n", family);
+		/* Exported bounds are the powers of two, the sub-buckets only refine the quantiles. */
+		uint64_t cumulative = 0;
+		for(int i = 0; i < METRICS_BUCKETS; i++)
+		{
+			cumulative += buckets[i];
+			uint64_t end = metrics_bucket_end(i);
+			if(end & (end - 1))
+				continue;
+			metrics_printf(buffer, "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n", family, hist->label, hist->value, end / 1e6, (unsigned long long)cumulative);
+		}
+		metrics_printf(buffer, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", family, hist->label, hist->value, (unsigned long long)count);
+		metrics_printf(buffer, "%s_sum{%s=\"%s\"} %g\n", family, hist->label, hist->value, sum / 1e6);
+		metrics_printf(buffer, "%s_count{%s=\"%s\"} %llu\n", family, hist->label, hist->value, (unsigned long long)count);
+		
+		/* Upper bound of the bucket holding the quantile, within 12.5%. */
+		for(unsigned int q = 0; count && q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+		{
+			uint64_t rank = (uint64_t)(quantiles[q] * count);
+			cumulative = 0;
+			int i = 0;
+			for(; i < METRICS_BUCKETS - 1; i++)
+			{
+				cumulative += buckets[i];
+				if(cumulative > rank)
+					break;
+			}
+			metrics_printf(&quantile, "%s_quantile{%s=\"%s\",quantile=\"%g\"} %g\n", family, hist->label, hist->value, quantiles[q], metrics_bucket_end(i) / 1e6);
+		}
+		if(id + 1 == metrics_family_count || strcmp(family, metrics_families[id + 1].family))
+		{
+			metrics_printf(buffer, "# TYPE %s_quantile gauge\n", family);
+			metrics_append(buffer, &quantile);
+			quantile.len = 0;
+		}
+	}
+	free(quantile.data);
+}
+
+/* Nodes of the pinned current version, and the writes which had to copy the whole tree. */
+static void metrics_datastore(struct metrics_buffer* buffer, struct datastore* ds)
+{
+	uint64_t nodes = 0;
+	struct ds_snapshot* snap = ds_pin(ds);
+	struct lyd_node* root;
+	LY_TREE_FOR(snap->root, root)
+	{
+		struct lyd_node *next, *elem;
+		LY_TREE_DFS_BEGIN(root, next, elem)
+		{
+			nodes++;
+			LY_TREE_DFS_END(root, next, elem);
+		}
+	}
+	uint64_t version = snap->version;
+	ds_unpin(snap);
+	pthread_mutex_lock(&ds->pin_mutex);
+	uint64_t copies = ds->copies;
+	pthread_mutex_unlock(&ds->pin_mutex);
+	metrics_printf(buffer, "netconf_datastore_nodes{datastore=\"%s\"} %llu\n", ds->name, (unsigned long long)nodes);
+	metrics_printf(buffer, "netconf_datastore_version{datastore=\"%s\"} %llu\n", ds->name, (unsigned long long)version);
+	metrics_printf(buffer, "netconf_datastore_copies{datastore=\"%s\"} %llu\n", ds->name, (unsigned long long)copies);
+}
+
+static void metrics_notif_queue(uint32_t session_id, uint32_t depth, uint64_t dropped, void* arg)
+{
+	struct metrics_buffer* buffer = (struct metrics_buffer*)arg;
+	metrics_printf(buffer, "netconf_notification_queue_depth{session=\"%u\"} %u\n", session_id, depth);
+	metrics_printf(buffer, "netconf_notification_dropped_total{session=\"%u\"} %llu\n", session_id, (unsigned long long)dropped);
+}
+
+/* Peer address of a connected TCP socket, non-zero otherwise. */
+static int metrics_peer(int fd, char* addr, size_t addr_len, uint16_t* port)
+{
+	struct sockaddr_storage peer;
+	socklen_t len = sizeof(peer);
+	if(getpeername(fd, (struct sockaddr*)&peer, &len))
+		return 1;
+	if(peer.ss_family == AF_INET)
+	{
+		inet_ntop(AF_INET, &((struct sockaddr_in*)&peer)->sin_addr, addr, addr_len);
+		*port = ntohs(((struct sockaddr_in*)&peer)->sin_port);
+		return 0;
+	}
+	if(peer.ss_family == AF_INET6)
+	{
+		inet_ntop(AF_INET6, &((struct sockaddr_in6*)&peer)->sin6_addr, addr, addr_len);
+		*port = ntohs(((struct sockaddr_in6*)&peer)->sin6_port);
+		return 0;
+	}
+	return 1;
+}
+
+/* Peer of one session, collected under its registry lock. */
+struct metrics_peer_entry
+{
+	uint32_t session_id;
+	uint16_t port;
+	char host[INET6_ADDRSTRLEN];
+	/* Socket with the same peer address, meaningful only when matches is 1. */
+	int fd;
+	int matches;
+};
+
+struct metrics_peers
+{
+	struct metrics_peer_entry* entries;
+	int count;
+	int size;
+};
+
+static void metrics_collect_peer(struct registry_session* record, struct nc_session* session, void* arg)
+{
+	struct metrics_peers* peers = (struct metrics_peers*)arg;
+	const char* host = nc_session_get_host(session);
+	if(!host)
+		return;
+	if(peers->count == peers->size)
+	{
+		peers->size = peers->size ? peers->size * 2 : 16;
+		peers->entries = (struct metrics_peer_entry*)realloc(peers->entries, peers->size * sizeof(struct metrics_peer_entry));
+	}
+	struct metrics_peer_entry* entry = &peers->entries[peers->count++];
+	entry->session_id = record->session_id;
+	entry->port = nc_session_get_port(session);
+	snprintf(entry->host, sizeof(entry->host), "%s", host);
+	entry->fd = -1;
+	entry->matches = 0;
+}
+
+/*
+ * Estimates, not per-session counters. libnetconf2 and libssh do the transport I/O and keep
+ * no byte counts, so at scrape time every socket of the process is matched to a session by
+ * its peer address only, O(sockets * sessions), and the kernel counters of the socket are
+ * read : SSH/TLS framing included, TCP retransmissions excluded, sent bytes only once acked.
+ * A session whose peer address matches no socket or several sockets (one peer connected to
+ * more than one endpoint) is not attributed at all and only counted as unmatched.
+ */
+static void metrics_sessions(struct metrics_buffer* buffer)
+{
+	struct metrics_peers peers = { NULL, 0, 0 };
+	registry_foreach(metrics_collect_peer, &peers);
+	DIR* dir = opendir("/proc/self/fd");
+	struct dirent* entry;
+	while(dir && (entry = readdir(dir)))
+	{
+		int fd = atoi(entry->d_name);
+		char addr[INET6_ADDRSTRLEN];
+		uint16_t port;
+		if(entry->d_name[0] == '.' || fd == dirfd(dir) || metrics_peer(fd, addr, sizeof(addr), &port))
+			continue;
+		for(int i = 0; i < peers.count; i++)
+		{
+			if(peers.entries[i].port != port || strcmp(peers.entries[i].host, addr))
+				continue;
+			peers.entries[i].fd = fd;
+			peers.entries[i].matches++;
+		}
+	}
+	
+	int unmatched = 0;
+	metrics_printf(buffer, "# HELP netconf_session_socket_bytes_received_estimate Kernel bytes received by the socket matched to the session by peer address.\n");
+	metrics_printf(buffer, "# TYPE netconf_session_socket_bytes_received_estimate gauge\n");
+	metrics_printf(buffer, "# HELP netconf_session_socket_bytes_acked_estimate Kernel bytes acked by the peer of the socket matched to the session by peer address.\n");
+	metrics_printf(buffer, "# TYPE netconf_session_socket_bytes_acked_estimate gauge\n");
+	for(int i = 0; i < peers.count; i++)
+	{
+		struct tcp_info info;
+		socklen_t len = sizeof(info);
+		if(peers.entries[i].matches != 1 || getsockopt(peers.entries[i].fd, IPPROTO_TCP, TCP_INFO, &info, &len))
+		{
+			unmatched++;
+			continue;
+		}
+		uint32_t session_id = peers.entries[i].session_id;
+		metrics_printf(buffer, "netconf_session_socket_bytes_received_estimate{session=\"%u\"} %llu\n", session_id, (unsigned long long)info.tcpi_bytes_received);
+		metrics_printf(buffer, "netconf_session_socket_bytes_acked_estimate{session=\"%u\"} %llu\n", session_id, (unsigned long long)info.tcpi_bytes_acked);
+	}
+	if(dir)
+		closedir(dir);
+	free(peers.entries);
+	metrics_printf(buffer, "# TYPE netconf_session_sockets_unmatched gauge\n");
+	metrics_printf(buffer, "netconf_session_sockets_unmatched %d\n", unmatched);
+	metrics_printf(buffer, "# TYPE netconf_sessions gauge\n");
+	metrics_printf(buffer, "netconf_sessions %d\n", registry_count());
+}
+
+static void metrics_scrape(struct metrics_buffer* buffer)
+{
+	metrics_histograms(buffer);
+	metrics_printf(buffer, "# TYPE netconf_datastore_nodes gauge\n");
+	metrics_datastore(buffer, &g_ds_running);
+	metrics_datastore(buffer, &g_ds_candidate);
+	metrics_datastore(buffer, &g_ds_startup);
+	metrics_datastore(buffer, &g_ds_state);
+	metrics_printf(buffer, "# TYPE netconf_notification_queue_depth gauge\n");
+	notif_queue_depths(metrics_notif_queue, buffer);
+	metrics_sessions(buffer);
+}
+
+static void metrics_serve(int client)
+{
+	/* Any request gets the same answer, only wait for it to arrive. */
+	char request[1024];
+	struct pollfd poll_fd;
+	poll_fd.fd = client;
+	poll_fd.events = POLLIN;
+	if(poll(&poll_fd, 1, METRICS_READ_TIMEOUT) > 0 && read(client, request, sizeof(request)) < 0)
+		return;
+	
+	struct metrics_buffer body = { NULL, 0, 0 };
+	metrics_scrape(&body);
+	char header[160];
+	int header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body.len);
+	if(send(client, header, header_len, MSG_NOSIGNAL) == header_len)
+	{
+		size_t sent = 0;
+		while(sent < body.len)
+		{
+			ssize_t ret = send(client, body.data + sent, body.len - sent, MSG_NOSIGNAL);
+			if(ret < 0 && errno == EINTR)
+				continue;
+			if(ret <= 0)
+				break;
+			sent += ret;
+		}
+	}
+	free(body.data);
+}
+
+void* metrics_thread_entry(void* arg)
+{
+	const char* path = (const char*)arg;
+	LOGGER_INFO("Metrics Thread", "Started.");
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	/* A socket left by a previous run. */
+	unlink(path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 8))
+	{
+		LOGGER_ERROR("Metrics Thread", "Failed to listen on %s.", path);
+		if(fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	
+	struct pollfd poll_fd;
+	poll_fd.fd = fd;
+	poll_fd.events = POLLIN;
+	while(g_ctl_server)
+	{
+		if(poll(&poll_fd, 1, METRICS_POLL_TIMEOUT) <= 0)
+			continue;
+		int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if(client < 0)
+			continue;
+		metrics_serve(client);
+		close(client);
+	}
+	
+	LOGGER_INFO("Metrics Thread", "Cleaning up allocated resource.");
+	close(fd);
+	unlink(path);
+	return NULL;
+}
@@ -0,0 +1,38 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stdint.h>
+
+/*
+ * Metrics : log-linear (HDR style) latency histograms, recorded into a shard owned by the
+ * recording thread with plain relaxed stores, so recording never waits. The Metrics Thread
+ * sums the shards when the endpoint is scraped, and adds gauges read from the datastores,
+ * the sessions and the notification queues at that time. The endpoint is a unix socket
+ * answering any request with the Prometheus text format, e.g.
+ * "curl --unix-socket configs/metrics.sock http://localhost/metrics".
+ */
+
+/* Metrics endpoint, set by "-s" ("" disables it). */
+extern const char* METRICS_PATH_DEFAULT;
+
+/* Histograms registered before the server threads start. */
+const int METRICS_HISTOGRAMS_MAX = 32;
+/* Microsecond buckets : exact below 8, then 8 sub-buckets per power of two up to 2^30. */
+const int METRICS_SUB_BITS = 3;
+const int METRICS_BUCKETS = (30 - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS;
+
+/* Register a histogram family{label="value"}, returns its id or -1 when full. */
+int metrics_histogram(const char* family, const char* label, const char* value);
+/* Record usec into histogram id, wait-free. */
+void metrics_record(int id, uint64_t usec);
+/* Monotonic clock in microseconds. */
+uint64_t metrics_now(void);
+
+/* Register the RPC histograms, before the server threads are started. */
+void metrics_init(void);
+/* Histogram of the RPC named name. */
+int metrics_rpc(const char* name);
+
+/* Metrics Thread Entry Prototype, arg is the socket path. */
+void* metrics_thread_entry(void* arg);
+
+#endif
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <nc_server.h>
+#include "datastore.h"
+#include "state.h"
+#include "registry.h"
+#include "monitor.h"
+
+/* Global Libyang Context Pointer */
+extern struct ly_ctx* ctx;
+
+/* Global Datastores */
+extern struct datastore g_ds_running;
+extern struct datastore g_ds_candidate;
+extern struct datastore g_ds_startup;
+
+/* /netconf-state/statistics, sessions add their counters here as well. */
+static time_t monitor_start_time;
+static std::atomic<uint32_t> monitor_in_bad_hellos(0);
+static std::atomic<uint32_t> monitor_in_sessions(0);
+static std::atomic<uint32_t> monitor_dropped_sessions(0);
+static std::atomic<uint32_t> monitor_in_rpcs(0);
+static std::atomic<uint32_t> monitor_in_bad_rpcs(0);
+static std::atomic<uint32_t> monitor_out_rpc_errors(0);
+static std::atomic<uint32_t> monitor_out_notifications(0);
+
+/* Counters are statistics only, no ordering with anything else is needed. */
+static inline void monitor_count(std::atomic<uint32_t>& counter)
+{
+	counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+void monitor_session_start(void)
+{
+	monitor_count(monitor_in_sessions);
+}
+
+void monitor_bad_hello(void)
+{
+	monitor_count(monitor_in_bad_hellos);
+}
+
+void monitor_rpc(struct nc_session* session, int poll_ret)
+{
+	struct registry_session* counters = registry_of(session);
+	if(!counters)
+		return;
+	if(poll_ret & NC_PSPOLL_BAD_RPC)
+	{
+		monitor_count(counters->in_bad_rpcs);
+		monitor_count(monitor_in_bad_rpcs);
+	}
+	else if(poll_ret & NC_PSPOLL_RPC)
+	{
+		monitor_count(counters->in_rpcs);
+		monitor_count(monitor_in_rpcs);
+	}
+	if(poll_ret & NC_PSPOLL_REPLY_ERROR)
+	{
+		monitor_count(counters->out_rpc_errors);
+		monitor_count(monitor_out_rpc_errors);
+	}
+}
+
+void monitor_session_end(struct nc_session* session)
+{
+	/* RFC 6022 : <close-session> and <kill-session> are not drops. */
+	NC_SESSION_TERM_REASON reason = nc_session_get_term_reason(session);
+	if(reason != NC_SESSION_TERM_CLOSED && reason != NC_SESSION_TERM_KILLED)
+		monitor_count(monitor_dropped_sessions);
+}
+
+void monitor_notification(struct registry_session* record)
+{
+	monitor_count(record->out_notifications);
+	monitor_count(monitor_out_notifications);
+}
+
+static void monitor_leaf_uint(struct lyd_node* parent, const struct lys_module* module, const char* name, uint32_t value)
+{
+	char str[16];
+	snprintf(str, sizeof(str), "%u", value);
+	lyd_new_leaf(parent, module, name, str);
+}
+
+static void monitor_leaf_time(struct lyd_node* parent, const struct lys_module* module, const char* name, time_t value)
+{
+	char* str = nc_time2datetime(value, NULL, NULL);
+	lyd_new_leaf(parent, module, name, str);
+	free(str);
+}
+
+static void monitor_datastore(struct lyd_node* datastores, const struct lys_module* module, struct datastore* ds)
+{
+	struct lyd_node* entry = lyd_new(datastores, module, "datastore");
+	lyd_new_leaf(entry, module, "name", ds->name);
+	uint32_t owner = ds->lock_sid;
+	if(!owner)
+		return;
+	struct lyd_node* locks = lyd_new(entry, module, "locks");
+	struct lyd_node* lock = lyd_new(locks, module, "global-lock");
+	monitor_leaf_uint(lock, module, "locked-by-session", owner);
+	monitor_leaf_time(lock, module, "locked-time", ds->lock_time);
+}
+
+/* Every module of the context, all served by <get-schema> as YANG and YIN. */
+static void monitor_schemas(struct lyd_node* state, const struct lys_module* module)
+{
+	static const char* formats[] = { "yang", "yin" };
+	struct lyd_node* schemas = lyd_new(state, module, "schemas");
+	const struct lys_module* schema;
+	uint32_t idx = 0;
+	while((schema = ly_ctx_get_module_iter(ctx, &idx)))
+	{
+		for(int i = 0; i < 2; i++)
+		{
+			struct lyd_node* entry = lyd_new(schemas, module, "schema");
+			lyd_new_leaf(entry, module, "identifier", schema->name);
+			lyd_new_leaf(entry, module, "version", schema->rev_size ? schema->rev[0].date : "");
+			lyd_new_leaf(entry, module, "format", formats[i]);
+			lyd_new_leaf(entry, module, "namespace", schema->ns);
+			lyd_new_leaf(entry, module, "location", "NETCONF");
+		}
+	}
+}
+
+/* One /netconf-state/sessions/session, the record is locked by registry_foreach(). */
+static void monitor_session(struct registry_session* counters, struct nc_session* session, void* arg)
+{
+	struct lyd_node* sessions = (struct lyd_node*)arg;
+	const struct lys_module* module = lyd_node_module(sessions);
+	struct lyd_node* entry = lyd_new(sessions, module, "session");
+	monitor_leaf_uint(entry, module, "session-id", counters->session_id);
+	lyd_new_leaf(entry, module, "transport", (nc_session_get_ti(session) == NC_TI_OPENSSL) ? "netconf-tls" : "netconf-ssh");
+	lyd_new_leaf(entry, module, "username", counters->username);
+	if(nc_session_get_host(session))
+		lyd_new_leaf(entry, module, "source-host", nc_session_get_host(session));
+	monitor_leaf_time(entry, module, "login-time", nc_session_get_start_time(session));
+	monitor_leaf_uint(entry, module, "in-rpcs", counters->in_rpcs.load(std::memory_order_relaxed));
+	monitor_leaf_uint(entry, module, "in-bad-rpcs", counters->in_bad_rpcs.load(std::memory_order_relaxed));
+	monitor_leaf_uint(entry, module, "out-rpc-errors", counters->out_rpc_errors.load(std::memory_order_relaxed));
+	monitor_leaf_uint(entry, module, "out-notifications", counters->out_notifications.load(std::memory_order_relaxed));
+}
+
+/* State provider of /ietf-netconf-monitoring:netconf-state. */
+static struct lyd_node* monitor_state(void* arg)
+{
+	const struct lys_module* module = ly_ctx_get_module(ctx, "ietf-netconf-monitoring", NULL, 1);
+	struct lyd_node* state = lyd_new(NULL, module, "netconf-state");
+	if(!state)
+		return NULL;
+	
+	struct lyd_node* capabilities = lyd_new(state, module, "capabilities");
+	const char** cpblts = nc_server_get_cpblts(ctx);
+	for(int i = 0; cpblts && cpblts[i]; i++)
+	{
+		lyd_new_leaf(capabilities, module, "capability", cpblts[i]);
+		lydict_remove(ctx, cpblts[i]);
+	}
+	free(cpblts);
+	
+	struct lyd_node* datastores = lyd_new(state, module, "datastores");
+	monitor_datastore(datastores, module, &g_ds_running);
+	monitor_datastore(datastores, module, &g_ds_candidate);
+	monitor_datastore(datastores, module, &g_ds_startup);
+	
+	monitor_schemas(state, module);
+	registry_foreach(monitor_session, lyd_new(state, module, "sessions"));
+	
+	struct lyd_node* statistics = lyd_new(state, module, "statistics");
+	monitor_leaf_time(statistics, module, "netconf-start-time", monitor_start_time);
+	monitor_leaf_uint(statistics, module, "in-bad-hellos", monitor_in_bad_hellos.load(std::memory_order_relaxed));
+	monitor_leaf_uint(statistics, module, "in-sessions", monitor_in_sessions.load(std::memory_order_relaxed));
+	monitor_leaf_uint(statistics, module, "dropped-sessions", monitor_dropped_sessions.load(std::memory_order_relaxed));
+	monitor_leaf_uint(statistics, module, "in-rpcs", monitor_in_rpcs.load(std::memory_order_relaxed));
+	monitor_leaf_uint(statistics, module, "in-bad-rpcs", monitor_in_bad_rpcs.load(std::memory_order_relaxed));
+	monitor_leaf_uint(statistics, module, "out-rpc-errors", monitor_out_rpc_errors.load(std::memory_order_relaxed));
+	monitor_leaf_uint(statistics, module, "out-notifications", monitor_out_notifications.load(std::memory_order_relaxed));
+	return state;
+}
+
+void monitor_init(void)
+{
+	monitor_start_time = time(NULL);
+	state_register("ietf-netconf-monitoring:netconf-state", MONITOR_TTL, monitor_state, NULL);
+}
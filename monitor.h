@@ -0,0 +1,28 @@
+#ifndef MONITOR_H
+#define MONITOR_H
+#include <stdint.h>
+
+/*
+ * NETCONF Monitoring, RFC 6022 : /netconf-state is a state provider built from live server
+ * internals. The hot path only bumps relaxed atomic counters, per session in its registry
+ * record and global, the tree itself is built at most once per MONITOR_TTL, whenever a
+ * <get> selects it.
+ */
+
+/* millisec , how long a built /netconf-state is served before it is rebuilt */
+const int MONITOR_TTL = 1000;
+
+/* Register the /netconf-state provider, before the State Threads are started. */
+void monitor_init(void);
+
+/* Accept Thread : a session completed its <hello>, or failed to. */
+void monitor_session_start(void);
+void monitor_bad_hello(void);
+/* Server Thread : count the nc_ps_poll() result of session. */
+void monitor_rpc(struct nc_session* session, int poll_ret);
+/* A session is about to be freed, counted as dropped unless closed or killed. */
+void monitor_session_end(struct nc_session* session);
+/* Notificator Thread : a notification was sent to the session of record. */
+void monitor_notification(struct registry_session* record);
+
+#endif
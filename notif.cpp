@@ -0,0 +1,599 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include <nc_server.h>
+#include "datastore.h"
+#include "filter.h"
+#include "edit_config.h"
+#include "notif.h"
+#include "replay.h"
+#include "registry.h"
+#include "monitor.h"
+#include "logger.h"
+
+extern struct ly_ctx* ctx;
+extern int g_ctl_server;
+
+const char* NOTIF_STREAM_NETCONF = "NETCONF";
+int g_notif_policy = NOTIF_POLICY_DROP;
+
+/* One published notification, shared by every queue it was fanned out to. */
+struct notif_event
+{
+	struct nc_server_notif* notif;
+	/* Owned by notif, only read for filtering. */
+	struct lyd_node* tree;
+	time_t eventtime;
+	/* notificationComplete, the subscription ends once it is sent. */
+	int complete;
+	std::atomic<uint32_t> refcount;
+};
+
+/* 
+ * Single producer ring : notif_publish() pushes under notif_mutex,
+ * the Notificator Thread pops without any lock.
+ */
+struct notif_queue
+{
+	struct notif_event* slots[NOTIF_QUEUE_SIZE];
+	std::atomic<uint32_t> head;
+	std::atomic<uint32_t> tail;
+};
+
+struct notif_subscriber
+{
+	/* Referenced, its session is only used under registry_lock(). */
+	struct registry_session* owner;
+	uint32_t session_id;
+	char* stream;
+	struct rpc_filter filter;
+	struct notif_queue queue;
+	/* Set when the session is released, the subscriber is freed by the Notificator Thread. */
+	std::atomic<int> closed;
+	/* NOTIF_POLICY_DISCONNECT : the queue overflowed. */
+	std::atomic<int> overflow;
+	std::atomic<uint64_t> dropped;
+	uint64_t sent;
+	/* <startTime> : the replay store is read up to its end before the queue is used. */
+	int replaying;
+	uint64_t replay_seq;
+	struct nc_server_notif* replay_notif;
+	/* <stopTime>, 0 when unbounded. */
+	time_t stop_time;
+	/* notificationComplete queued, nothing else is. */
+	int ending;
+	/* NOTIF_POLICY_COALESCE : netconf-config-change folded while the queue was full, under notif_mutex. */
+	struct lyd_node* pending;
+	time_t pending_time;
+	uint64_t coalesced;
+	struct notif_subscriber* next;
+};
+
+/* Registry, new subscribers are only ever added at the head. */
+static pthread_mutex_t notif_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notif_cond = PTHREAD_COND_INITIALIZER;
+static struct notif_subscriber* notif_subscribers = NULL;
+static std::atomic<int> notif_subscriber_count(0);
+
+static void notif_event_unref(struct notif_event* event);
+
+static struct notif_event* notif_event_new(struct lyd_node* tree, time_t eventtime)
+{
+	struct notif_event* event = new notif_event;
+	event->tree = tree;
+	event->eventtime = eventtime;
+	event->complete = 0;
+	event->notif = nc_server_notif_new(tree, nc_time2datetime(eventtime, NULL, NULL), NC_PARAMTYPE_FREE);
+	event->refcount = 1;
+	return event;
+}
+
+/* Producer side, under notif_mutex. */
+static int notif_full(struct notif_subscriber* sub)
+{
+	return sub->queue.tail.load(std::memory_order_relaxed) - sub->queue.head.load(std::memory_order_acquire) == NOTIF_QUEUE_SIZE;
+}
+
+/* Producer side of the queue of sub, under notif_mutex. Non-zero when it is full. */
+static int notif_enqueue(struct notif_subscriber* sub, struct notif_event* event)
+{
+	if(notif_full(sub))
+		return 1;
+	uint32_t tail = sub->queue.tail.load(std::memory_order_relaxed);
+	event->refcount++;
+	sub->queue.slots[tail % NOTIF_QUEUE_SIZE] = event;
+	sub->queue.tail.store(tail + 1, std::memory_order_release);
+	return 0;
+}
+
+/* nc-notifications replayComplete/notificationComplete of one subscription, under notif_mutex. */
+static void notif_enqueue_control(struct notif_subscriber* sub, const char* name)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/nc-notifications:%s", name);
+	struct notif_event* event = notif_event_new(lyd_new_path(NULL, ctx, path, NULL, LYD_ANYDATA_CONSTSTRING, 0), time(NULL));
+	event->complete = !strcmp(name, "notificationComplete");
+	if(event->complete)
+		sub->ending = 1;
+	if(notif_enqueue(sub, event))
+		sub->dropped++;
+	notif_event_unref(event);
+	pthread_cond_signal(&notif_cond);
+}
+
+static void notif_event_unref(struct notif_event* event)
+{
+	if(--event->refcount == 0)
+	{
+		nc_server_notif_free(event->notif);
+		delete event;
+	}
+}
+
+int notif_subscribe(struct nc_session* session, const char* stream, struct rpc_filter* filter, time_t start_time, time_t stop_time)
+{
+	struct registry_session* owner = registry_of(session);
+	uint32_t session_id = nc_session_get_id(session);
+	pthread_mutex_lock(&notif_mutex);
+	if(owner->subscription)
+	{
+		pthread_mutex_unlock(&notif_mutex);
+		filter_free(filter);
+		return 1;
+	}
+	struct notif_subscriber* sub = new notif_subscriber;
+	owner->refcount++;
+	owner->subscription = sub;
+	sub->owner = owner;
+	sub->session_id = session_id;
+	sub->stream = strdup(stream);
+	sub->filter = *filter;
+	sub->queue.head = 0;
+	sub->queue.tail = 0;
+	sub->closed = 0;
+	sub->overflow = 0;
+	sub->dropped = 0;
+	sub->sent = 0;
+	/* Seeked under notif_mutex, nothing is published in between. */
+	sub->replaying = start_time != 0;
+	sub->replay_seq = start_time ? replay_seek(start_time) : 0;
+	sub->replay_notif = NULL;
+	sub->stop_time = stop_time;
+	sub->ending = 0;
+	sub->pending = NULL;
+	sub->pending_time = 0;
+	sub->coalesced = 0;
+	sub->next = notif_subscribers;
+	notif_subscribers = sub;
+	notif_subscriber_count++;
+	pthread_mutex_unlock(&notif_mutex);
+	
+	/* From now on libnetconf2 accepts notifications on this session. */
+	nc_session_set_notif_status(session, 1);
+	LOGGER_INFO("Notificator Thread", "Session %u subscribed to stream %s.", session_id, stream);
+	return 0;
+}
+
+void notif_session_closed(struct registry_session* owner)
+{
+	pthread_mutex_lock(&notif_mutex);
+	struct notif_subscriber* sub = (struct notif_subscriber*)owner->subscription;
+	if(sub)
+	{
+		sub->closed = 1;
+		owner->subscription = NULL;
+		notif_subscriber_count--;
+		pthread_cond_signal(&notif_cond);
+	}
+	pthread_mutex_unlock(&notif_mutex);
+}
+
+int notif_listening(void)
+{
+	return notif_subscriber_count > 0 || replay_enabled();
+}
+
+void notif_queue_depths(notif_depth_cb cb, void* arg)
+{
+	pthread_mutex_lock(&notif_mutex);
+	for(struct notif_subscriber* sub = notif_subscribers; sub; sub = sub->next)
+	{
+		if(sub->closed)
+			continue;
+		uint32_t depth = sub->queue.tail.load(std::memory_order_relaxed) - sub->queue.head.load(std::memory_order_relaxed);
+		cb(sub->session_id, depth, sub->dropped, arg);
+	}
+	pthread_mutex_unlock(&notif_mutex);
+}
+
+/* Does the filter of sub select anything of the notification? */
+static int notif_match(struct notif_subscriber* sub, const char* stream, struct lyd_node* tree)
+{
+	if(strcmp(sub->stream, stream))
+		return 0;
+	if(sub->filter.all)
+		return 1;
+	struct lyd_node* selected = NULL;
+	if(filter_apply(tree, &sub->filter, &selected) || !selected)
+		return 0;
+	lyd_free_withsiblings(selected);
+	return 1;
+}
+
+static struct lyd_node* notif_child(struct lyd_node* node, const char* name)
+{
+	struct lyd_node* child;
+	LY_TREE_FOR(node->child, child)
+	{
+		if(!strcmp(child->schema->name, name))
+			return child;
+	}
+	return NULL;
+}
+
+static const char* notif_child_value(struct lyd_node* node, const char* name)
+{
+	struct lyd_node* child = notif_child(node, name);
+	return child ? ((struct lyd_node_leaf_list*)child)->value_str : NULL;
+}
+
+static int notif_is_config_change(struct lyd_node* tree)
+{
+	return !strcmp(tree->schema->name, "netconf-config-change") && !strcmp(lyd_node_module(tree)->name, "ietf-netconf-notifications");
+}
+
+/* 
+ * Fold a netconf-config-change into the pending one of sub, under notif_mutex. One edit per
+ * target with the last operation, changed-by of the last change. Non-zero when it can not be
+ * folded : another notification, or a change of another datastore.
+ */
+static int notif_coalesce(struct notif_subscriber* sub, struct lyd_node* tree, time_t eventtime)
+{
+	if(!notif_is_config_change(tree))
+		return 1;
+	if(!sub->pending)
+	{
+		sub->pending = lyd_dup(tree, 1);
+		sub->pending_time = eventtime;
+		return !sub->pending;
+	}
+	const char* datastore = notif_child_value(tree, "datastore");
+	const char* pending_datastore = notif_child_value(sub->pending, "datastore");
+	if(!datastore || !pending_datastore || strcmp(datastore, pending_datastore))
+		return 1;
+	
+	struct lyd_node* changed_by = notif_child(tree, "changed-by");
+	struct lyd_node* pending_changed_by = notif_child(sub->pending, "changed-by");
+	struct lyd_node* copy = changed_by ? lyd_dup(changed_by, 1) : NULL;
+	if(copy && pending_changed_by)
+	{
+		/* Freed first, only one instance of the container may exist. */
+		struct lyd_node* after = pending_changed_by->next;
+		lyd_free(pending_changed_by);
+		if(after ? lyd_insert_before(after, copy) : lyd_insert(sub->pending, copy))
+			lyd_free(copy);
+	}
+	else if(copy)
+		lyd_free(copy);
+	struct lyd_node* edit;
+	LY_TREE_FOR(tree->child, edit)
+	{
+		if(strcmp(edit->schema->name, "edit"))
+			continue;
+		const char* target = notif_child_value(edit, "target");
+		struct lyd_node* pending_edit;
+		struct lyd_node* next;
+		LY_TREE_FOR_SAFE(sub->pending->child, next, pending_edit)
+		{
+			const char* pending_target = strcmp(pending_edit->schema->name, "edit") ? NULL : notif_child_value(pending_edit, "target");
+			if(target && pending_target && !strcmp(target, pending_target))
+				lyd_free(pending_edit);
+		}
+		copy = lyd_dup(edit, 1);
+		if(copy && lyd_insert(sub->pending, copy))
+			lyd_free(copy);
+	}
+	sub->pending_time = eventtime;
+	sub->coalesced++;
+	return 0;
+}
+
+/* Queue the pending netconf-config-change of sub once there is room, under notif_mutex. */
+static void notif_flush(struct notif_subscriber* sub)
+{
+	if(!sub->pending || notif_full(sub))
+		return;
+	struct notif_event* event = notif_event_new(sub->pending, sub->pending_time);
+	sub->pending = NULL;
+	notif_enqueue(sub, event);
+	notif_event_unref(event);
+}
+
+void notif_publish(const char* stream, struct lyd_node* tree)
+{
+	/* Built once, libnetconf2 only reads it while sending. */
+	struct notif_event* event = notif_event_new(tree, time(NULL));
+	
+	pthread_mutex_lock(&notif_mutex);
+	/* Stored first, a replaying subscriber reads it from the store instead of its queue. */
+	replay_append(event->eventtime, tree);
+	for(struct notif_subscriber* sub = notif_subscribers; sub; sub = sub->next)
+	{
+		if(sub->closed || sub->ending || sub->replaying || (sub->stop_time && event->eventtime > sub->stop_time))
+			continue;
+		if(!notif_match(sub, stream, tree))
+			continue;
+		/* What was folded goes first, nothing newer may overtake it. */
+		notif_flush(sub);
+		if(sub->pending && !notif_coalesce(sub, tree, event->eventtime))
+			continue;
+		if(notif_enqueue(sub, event))
+		{
+			/* Slow consumer, never wait for it. */
+			if(g_notif_policy != NOTIF_POLICY_COALESCE || notif_coalesce(sub, tree, event->eventtime))
+				sub->dropped++;
+			if(g_notif_policy == NOTIF_POLICY_DISCONNECT)
+				sub->overflow = 1;
+		}
+	}
+	pthread_cond_signal(&notif_cond);
+	pthread_mutex_unlock(&notif_mutex);
+	notif_event_unref(event);
+}
+
+/* Free the closed subscribers, only called by the Notificator Thread under notif_mutex. */
+static void notif_reap(void)
+{
+	struct notif_subscriber** link = &notif_subscribers;
+	while(*link)
+	{
+		struct notif_subscriber* sub = *link;
+		if(!sub->closed)
+		{
+			link = &sub->next;
+			continue;
+		}
+		*link = sub->next;
+		for(uint32_t i = sub->queue.head; i != sub->queue.tail; i++)
+			notif_event_unref(sub->queue.slots[i % NOTIF_QUEUE_SIZE]);
+		if(sub->replay_notif)
+			nc_server_notif_free(sub->replay_notif);
+		lyd_free_withsiblings(sub->pending);
+		LOGGER_INFO("Notificator Thread", "Session %u unsubscribed, %llu sent, %llu dropped, %llu coalesced.", sub->session_id,
+			(unsigned long long)sub->sent, (unsigned long long)sub->dropped, (unsigned long long)sub->coalesced);
+		filter_free(&sub->filter);
+		free(sub->stream);
+		registry_put(sub->owner);
+		delete sub;
+	}
+}
+
+/* Subscriptions past their <stopTime> get their notificationComplete, under notif_mutex. */
+static void notif_expire(void)
+{
+	time_t now = time(NULL);
+	for(struct notif_subscriber* sub = notif_subscribers; sub; sub = sub->next)
+	{
+		if(!sub->closed && !sub->ending && !sub->replaying && sub->stop_time && now > sub->stop_time)
+			notif_enqueue_control(sub, "notificationComplete");
+	}
+}
+
+/* Leave the replay when the store is read up to its end (or stop), returns non-zero otherwise. */
+static int notif_replay_done(struct notif_subscriber* sub, int stop)
+{
+	pthread_mutex_lock(&notif_mutex);
+	int done = stop || sub->replay_seq >= replay_end();
+	if(done)
+	{
+		sub->replaying = 0;
+		notif_enqueue_control(sub, "replayComplete");
+	}
+	pthread_mutex_unlock(&notif_mutex);
+	return !done;
+}
+
+/* Send stored notifications to sub without blocking, returns non-zero when something is left. */
+static int notif_replay(struct notif_subscriber* sub, struct nc_session* session)
+{
+	for(int i = 0; i < NOTIF_REPLAY_BATCH; i++)
+	{
+		if(!sub->replay_notif)
+		{
+			time_t eventtime = 0;
+			struct lyd_node* tree = replay_read(&sub->replay_seq, &eventtime);
+			if(!tree)
+				return notif_replay_done(sub, 0);
+			if(sub->stop_time && eventtime > sub->stop_time)
+			{
+				lyd_free_withsiblings(tree);
+				return notif_replay_done(sub, 1);
+			}
+			if(!notif_match(sub, sub->stream, tree))
+			{
+				lyd_free_withsiblings(tree);
+				sub->replay_seq++;
+				continue;
+			}
+			sub->replay_notif = nc_server_notif_new(tree, nc_time2datetime(eventtime, NULL, NULL), NC_PARAMTYPE_FREE);
+		}
+		NC_MSG_TYPE msgtype = nc_server_notif_send(session, sub->replay_notif, 0);
+		if(msgtype == NC_MSG_WOULDBLOCK)
+			return 1;
+		if(msgtype == NC_MSG_NOTIF)
+		{
+			sub->sent++;
+			monitor_notification(sub->owner);
+		}
+		else
+			sub->dropped++;
+		nc_server_notif_free(sub->replay_notif);
+		sub->replay_notif = NULL;
+		sub->replay_seq++;
+	}
+	return 1;
+}
+
+/* Send what is queued for sub without blocking, returns non-zero when something is left. */
+static int notif_drain(struct notif_subscriber* sub)
+{
+	/* The record lock keeps the session from being freed while it is used. */
+	struct nc_session* session = registry_lock(sub->owner);
+	if(sub->closed || !session)
+	{
+		registry_unlock(sub->owner);
+		return 0;
+	}
+	if(sub->overflow)
+	{
+		LOGGER_WARNING("Notificator Thread", "Session %u does not keep up, disconnecting.", sub->session_id);
+		nc_session_set_status(session, NC_STATUS_INVALID);
+		nc_session_set_term_reason(session, NC_SESSION_TERM_OTHER);
+		sub->overflow = 0;
+		registry_unlock(sub->owner);
+		return 0;
+	}
+	int left = 0;
+	if(sub->replaying && notif_replay(sub, session))
+	{
+		registry_unlock(sub->owner);
+		return 1;
+	}
+	uint32_t head = sub->queue.head.load(std::memory_order_relaxed);
+	while(head != sub->queue.tail.load(std::memory_order_acquire))
+	{
+		struct notif_event* event = sub->queue.slots[head % NOTIF_QUEUE_SIZE];
+		NC_MSG_TYPE msgtype = nc_server_notif_send(session, event->notif, 0);
+		if(msgtype == NC_MSG_WOULDBLOCK)
+		{
+			/* The session is busy with a reply, retried shortly. */
+			left = 1;
+			break;
+		}
+		if(msgtype == NC_MSG_NOTIF)
+		{
+			sub->sent++;
+			monitor_notification(sub->owner);
+		}
+		else
+			sub->dropped++;
+		head++;
+		sub->queue.head.store(head, std::memory_order_release);
+		if(event->complete)
+		{
+			/* <stopTime> reached, the session may subscribe again. */
+			nc_session_set_notif_status(session, 0);
+			pthread_mutex_lock(&notif_mutex);
+			sub->closed = 1;
+			sub->owner->subscription = NULL;
+			notif_subscriber_count--;
+			pthread_mutex_unlock(&notif_mutex);
+			notif_event_unref(event);
+			break;
+		}
+		notif_event_unref(event);
+	}
+	registry_unlock(sub->owner);
+	return left;
+}
+
+void* notificator_thread_entry(void* arg)
+{
+	LOGGER_INFO("Notificator Thread", "Started.");
+	int left = 0;
+	while(g_ctl_server)
+	{
+		/* Subscribers are only freed here, the list can be walked without notif_mutex. */
+		replay_expire();
+		pthread_mutex_lock(&notif_mutex);
+		notif_reap();
+		notif_expire();
+		for(struct notif_subscriber* sub = notif_subscribers; sub; sub = sub->next)
+		{
+			if(!sub->ending)
+				notif_flush(sub);
+		}
+		struct notif_subscriber* subscribers = notif_subscribers;
+		pthread_mutex_unlock(&notif_mutex);
+		
+		left = 0;
+		for(struct notif_subscriber* sub = subscribers; sub; sub = sub->next)
+			left |= notif_drain(sub);
+		
+		/* Sleep until something is published, or a busy session can be retried. */
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		long wait_ms = left ? NOTIF_RETRY_INTERVAL : 1000;
+		deadline.tv_sec += wait_ms / 1000;
+		deadline.tv_nsec += (wait_ms % 1000) * 1000000;
+		if(deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_mutex_lock(&notif_mutex);
+		int ready = 0;
+		for(struct notif_subscriber* sub = notif_subscribers; sub && !ready; sub = sub->next)
+			ready = sub->closed || sub->overflow || sub->replaying || sub->queue.head != sub->queue.tail || (sub->pending && !sub->ending && !notif_full(sub));
+		if(!ready || left)
+			pthread_cond_timedwait(&notif_cond, &notif_mutex, &deadline);
+		pthread_mutex_unlock(&notif_mutex);
+	}
+	pthread_mutex_lock(&notif_mutex);
+	for(struct notif_subscriber* sub = notif_subscribers; sub; sub = sub->next)
+		sub->closed = 1;
+	notif_reap();
+	pthread_mutex_unlock(&notif_mutex);
+	LOGGER_INFO("Notificator Thread", "Cleaning up allocated resource.");
+	nc_thread_destroy();
+	return NULL;
+}
+
+void notif_config_change(struct datastore* ds, const struct edit_log* log, struct nc_session* session, void* arg)
+{
+	if(!notif_listening())
+		return;
+	const struct lys_module* module = ly_ctx_get_module(ctx, "ietf-netconf-notifications", NULL, 1);
+	struct lyd_node* notif = lyd_new(NULL, module, "netconf-config-change");
+	if(!notif)
+		return;
+	
+	/* RFC 6470 : who made the change, and what changed. */
+	struct lyd_node* changed_by = lyd_new(notif, module, "changed-by");
+	if(session)
+	{
+		char session_id[16];
+		snprintf(session_id, sizeof(session_id), "%u", nc_session_get_id(session));
+		lyd_new_leaf(changed_by, module, "username", nc_session_get_username(session));
+		lyd_new_leaf(changed_by, module, "session-id", session_id);
+		if(nc_session_get_host(session))
+			lyd_new_leaf(changed_by, module, "source-host", nc_session_get_host(session));
+	}
+	else
+	{
+		lyd_new_leaf(changed_by, module, "server", NULL);
+	}
+	lyd_new_leaf(notif, module, "datastore", ds->name);
+	
+	for(int i = 0; i < log->count; i++)
+	{
+		const struct edit_change* change = &log->changes[i];
+		char* path = (change->type == EDIT_CHANGE_REMOVED) ? strdup(change->path) : lyd_path(change->node);
+		if(!path)
+			continue;
+		struct lyd_node* edit = lyd_new(notif, module, "edit");
+		lyd_new_leaf(edit, module, "target", path);
+		if(change->type == EDIT_CHANGE_CREATED)
+			lyd_new_leaf(edit, module, "operation", "create");
+		else if(change->type == EDIT_CHANGE_REMOVED)
+			lyd_new_leaf(edit, module, "operation", "delete");
+		else
+			lyd_new_leaf(edit, module, "operation", "replace");
+		free(path);
+	}
+	notif_publish(NOTIF_STREAM_NETCONF, notif);
+}
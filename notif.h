@@ -0,0 +1,62 @@
+#ifndef NOTIF_H
+#define NOTIF_H
+#include <stdint.h>
+#include <time.h>
+
+/* 
+ * Notification Engine, RFC 5277 : <create-subscription> registers a subscriber with its
+ * stream and filter. A published notification is built once, and a reference to it is
+ * queued to every matching subscriber. The Notificator Thread drains the queues with
+ * non-blocking sends, so a stalled client only ever fills its own queue.
+ */
+
+/* The only event stream. */
+extern const char* NOTIF_STREAM_NETCONF;
+
+/* Notifications queued per subscriber, the queue is a lock-free single producer ring. */
+const uint32_t NOTIF_QUEUE_SIZE = 256;
+/* millisec , retry interval while a session was busy */
+const int NOTIF_RETRY_INTERVAL = 50;
+/* Stored notifications sent to one replaying subscriber before the others get their turn. */
+const int NOTIF_REPLAY_BATCH = 64;
+
+/* What happens to a subscriber whose queue is full, set by "-n". */
+enum notif_policy
+{
+	/* The new notification is dropped for this subscriber. */
+	NOTIF_POLICY_DROP,
+	/* The subscriber's session is terminated. */
+	NOTIF_POLICY_DISCONNECT,
+	/* 
+	 * netconf-config-change is folded into one pending notification per subscriber, one edit
+	 * per target with its last operation, queued as soon as there is room again and before
+	 * anything newer. Other notifications are dropped.
+	 */
+	NOTIF_POLICY_COALESCE
+};
+extern int g_notif_policy;
+
+/* Notificator Thread Entry Prototype */
+void* notificator_thread_entry(void* arg);
+
+/* 
+ * Register session, the filter ownership is taken. Non-zero when it is subscribed already.
+ * With start_time, stored notifications are replayed first. 0 : no replay, no stop time.
+ */
+int notif_subscribe(struct nc_session* session, const char* stream, struct rpc_filter* filter, time_t start_time, time_t stop_time);
+/* The session of owner is about to be freed, its subscription is dropped. */
+void notif_session_closed(struct registry_session* owner);
+
+/* Non-zero when anybody is subscribed, checked before building a notification. */
+int notif_listening(void);
+/* Queue a notification tree (ownership taken) to the matching subscribers of stream. */
+void notif_publish(const char* stream, struct lyd_node* tree);
+
+/* Queue depth and drops of every subscriber, cb is called under the registry lock. */
+typedef void (*notif_depth_cb)(uint32_t session_id, uint32_t depth, uint64_t dropped, void* arg);
+void notif_queue_depths(notif_depth_cb cb, void* arg);
+
+/* ietf-netconf-notifications:netconf-config-change producer, see ds_listen(). */
+void notif_config_change(struct datastore* ds, const struct edit_log* log, struct nc_session* session, void* arg);
+
+#endif
@@ -0,0 +1,615 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <nc_server.h>
+#include "datastore.h"
+#include "persist.h"
+#include "logger.h"
+
+const int PERSIST_TARGETS_MAX = 4;
+int g_persist_lyb = 1;
+
+/* "<path>.lyb" : this header, then the LYB of the version printed to the XML file at path. */
+struct persist_lyb_header
+{
+	char magic[8];
+	/* Identity of that XML file, the binary snapshot is stale once it changes. */
+	uint64_t xml_dev;
+	uint64_t xml_ino;
+	uint64_t xml_size;
+	int64_t xml_mtime_sec;
+	int64_t xml_mtime_nsec;
+	uint64_t length;
+};
+static const char PERSIST_LYB_MAGIC[8] = "NCLYB01";
+
+/* Whether header was written for the XML file described by xml. */
+static int persist_lyb_matches(const struct persist_lyb_header* header, const struct stat* xml)
+{
+	return !memcmp(header->magic, PERSIST_LYB_MAGIC, sizeof(header->magic)) && header->xml_dev == (uint64_t)xml->st_dev
+		&& header->xml_ino == (uint64_t)xml->st_ino && header->xml_size == (uint64_t)xml->st_size
+		&& header->xml_mtime_sec == xml->st_mtim.tv_sec && header->xml_mtime_nsec == xml->st_mtim.tv_nsec;
+}
+
+/* One persisted datastore. */
+struct persist_target
+{
+	struct datastore* ds;
+	const char* path;
+	char journal_path[PATH_MAX];
+	int journal_fd;
+	/* Records appended since the last compaction. */
+	int records;
+	/* Identity of the last compacted snapshot, guarded by persist_mutex. */
+	struct stat written;
+	/* "<path>.lyb" does not mirror the snapshot loaded at boot. */
+	int lyb_stale;
+};
+
+/* One queued journal record. */
+struct persist_job
+{
+	struct persist_target* target;
+	enum persist_op op;
+	struct lyd_node* data;
+	struct ds_snapshot* snap;
+	char* path;
+	struct persist_job* next;
+};
+
+static struct persist_target persist_targets[PERSIST_TARGETS_MAX];
+static int persist_target_count = 0;
+
+/* FIFO of persist_job, drained by the persistence thread. */
+static pthread_mutex_t persist_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t persist_cond = PTHREAD_COND_INITIALIZER;
+static struct persist_job* persist_head = NULL;
+static struct persist_job* persist_tail = NULL;
+static int persist_stop = 0;
+/* Jobs queued and jobs appended, for persist_sync(). */
+static pthread_cond_t persist_done_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t persist_queued = 0;
+static uint64_t persist_done = 0;
+static int persist_running = 0;
+
+static const char* PERSIST_OP_NAMES[] = { "merge", "replace", "delete", "move" };
+
+static int persist_write_all(int fd, const char* buf, size_t len)
+{
+	while(len)
+	{
+		ssize_t ret = write(fd, buf, len);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return 1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Make the rename of a file durable. */
+static void persist_sync_dir(const char* path)
+{
+	char dir[PATH_MAX];
+	const char* slash = strrchr(path, '/');
+	if(!slash)
+		strcpy(dir, ".");
+	else
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if(fd < 0)
+		return;
+	fsync(fd);
+	close(fd);
+}
+
+static struct persist_target* persist_find(struct datastore* ds)
+{
+	for(int i = 0; i < persist_target_count; i++)
+		if(persist_targets[i].ds == ds)
+			return &persist_targets[i];
+	return NULL;
+}
+
+void persist_attach(struct datastore* ds, const char* path)
+{
+	if(persist_target_count == PERSIST_TARGETS_MAX)
+	{
+		LOGGER_ERROR("Persist Thread", "Too many persisted datastores.");
+		return;
+	}
+	struct persist_target* target = &persist_targets[persist_target_count++];
+	target->ds = ds;
+	target->path = path;
+	snprintf(target->journal_path, sizeof(target->journal_path), "%s.journal", path);
+	target->journal_fd = open(target->journal_path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if(target->journal_fd < 0)
+		LOGGER_ERROR("Persist Thread", "Failed to open %s.", target->journal_path);
+	target->records = 0;
+	/* What was loaded at boot, nothing has been written since. */
+	memset(&target->written, 0, sizeof(target->written));
+	target->lyb_stale = 0;
+	if(!g_persist_lyb || stat(path, &target->written))
+		return;
+	char lyb_path[PATH_MAX];
+	struct persist_lyb_header header;
+	snprintf(lyb_path, sizeof(lyb_path), "%s.lyb", path);
+	int fd = open(lyb_path, O_RDONLY);
+	target->lyb_stale = fd < 0 || read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) || !persist_lyb_matches(&header, &target->written);
+	if(fd >= 0)
+		close(fd);
+}
+
+int persist_attached(struct datastore* ds)
+{
+	return persist_find(ds) != NULL;
+}
+
+int persist_owns(const char* path, const struct stat* st)
+{
+	int owned = 0;
+	pthread_mutex_lock(&persist_mutex);
+	for(int i = 0; i < persist_target_count; i++)
+	{
+		const struct stat* written = &persist_targets[i].written;
+		if(strcmp(persist_targets[i].path, path))
+			continue;
+		owned = written->st_dev == st->st_dev && written->st_ino == st->st_ino && written->st_size == st->st_size
+			&& written->st_mtim.tv_sec == st->st_mtim.tv_sec && written->st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+	}
+	pthread_mutex_unlock(&persist_mutex);
+	return owned;
+}
+
+static void persist_enqueue(struct persist_job* job)
+{
+	pthread_mutex_lock(&persist_mutex);
+	if(persist_tail)
+		persist_tail->next = job;
+	else
+		persist_head = job;
+	persist_tail = job;
+	persist_queued++;
+	pthread_cond_signal(&persist_cond);
+	pthread_mutex_unlock(&persist_mutex);
+}
+
+void persist_submit(struct datastore* ds, enum persist_op op, struct lyd_node* data, struct ds_snapshot* snap)
+{
+	struct persist_job* job = new persist_job;
+	job->target = persist_find(ds);
+	job->op = op;
+	job->data = data;
+	job->snap = snap;
+	job->path = NULL;
+	job->next = NULL;
+	persist_enqueue(job);
+}
+
+void persist_submit_delete(struct datastore* ds, char* path)
+{
+	struct persist_job* job = new persist_job;
+	job->target = persist_find(ds);
+	job->op = PERSIST_DELETE;
+	job->data = NULL;
+	job->snap = NULL;
+	job->path = path;
+	job->next = NULL;
+	persist_enqueue(job);
+}
+
+void persist_submit_move(struct datastore* ds, char* path, char* anchor)
+{
+	/* "<path>\n<anchor>", the record payload as it is written. */
+	size_t len = strlen(path) + (anchor ? strlen(anchor) : 0) + 2;
+	char* payload = (char*)malloc(len);
+	snprintf(payload, len, "%s\n%s", path, anchor ? anchor : "");
+	free(path);
+	free(anchor);
+	
+	struct persist_job* job = new persist_job;
+	job->target = persist_find(ds);
+	job->op = PERSIST_MOVE;
+	job->data = NULL;
+	job->snap = NULL;
+	job->path = payload;
+	job->next = NULL;
+	persist_enqueue(job);
+}
+
+void persist_sync(void)
+{
+	pthread_mutex_lock(&persist_mutex);
+	uint64_t queued = persist_queued;
+	while(persist_running && persist_done < queued)
+		pthread_cond_wait(&persist_done_cond, &persist_mutex);
+	pthread_mutex_unlock(&persist_mutex);
+}
+
+static void persist_job_free(struct persist_job* job)
+{
+	if(job->snap)
+		ds_unpin(job->snap);
+	else
+		lyd_free_withsiblings(job->data);
+	free(job->path);
+	delete job;
+}
+
+/* Record : "<op> <length>\n<payload>\n", synced before the next one. */
+static void persist_append(struct persist_job* job)
+{
+	struct persist_target* target = job->target;
+	const struct lyd_node* data = job->snap ? job->snap->root : job->data;
+	char* payload = NULL;
+	if(job->path)
+		payload = strdup(job->path);
+	else if(data)
+		lyd_print_mem(&payload, data, LYD_XML, LYP_WITHSIBLINGS);
+	size_t payload_len = payload ? strlen(payload) : 0;
+	
+	char header[64];
+	int header_len = snprintf(header, sizeof(header), "%s %zu\n", PERSIST_OP_NAMES[job->op], payload_len);
+	if(target->journal_fd < 0 || persist_write_all(target->journal_fd, header, header_len)
+		|| persist_write_all(target->journal_fd, payload ? payload : "", payload_len)
+		|| persist_write_all(target->journal_fd, "\n", 1))
+		LOGGER_ERROR("Persist Thread", "Failed to append to %s.", target->journal_path);
+	else
+		fdatasync(target->journal_fd);
+	free(payload);
+	target->records++;
+}
+
+/* Binary copy of root next to the XML snapshot described by xml, for a fast boot. */
+static void persist_write_lyb(struct persist_target* target, const struct lyd_node* root, const struct stat* xml)
+{
+	char* lyb = NULL;
+	if(root && (lyd_print_mem(&lyb, root, LYD_LYB, LYP_WITHSIBLINGS) || !lyb))
+	{
+		LOGGER_ERROR("Persist Thread", "Failed to print %s as LYB.", target->path);
+		return;
+	}
+	struct persist_lyb_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PERSIST_LYB_MAGIC, sizeof(header.magic));
+	header.xml_dev = xml->st_dev;
+	header.xml_ino = xml->st_ino;
+	header.xml_size = xml->st_size;
+	header.xml_mtime_sec = xml->st_mtim.tv_sec;
+	header.xml_mtime_nsec = xml->st_mtim.tv_nsec;
+	header.length = lyb ? lyd_lyb_data_length(lyb) : 0;
+	
+	char path[PATH_MAX], tmp_path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s.lyb", target->path);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.lyb.tmp", target->path);
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || persist_write_all(fd, (const char*)&header, sizeof(header))
+		|| persist_write_all(fd, lyb ? lyb : "", header.length) || fsync(fd) || rename(tmp_path, path))
+	{
+		LOGGER_ERROR("Persist Thread", "Failed to write %s.", tmp_path);
+		unlink(tmp_path);
+	}
+	if(fd >= 0)
+		close(fd);
+	free(lyb);
+}
+
+/* Full snapshot to a temporary file renamed over path, then an empty journal. */
+static void persist_compact(struct persist_target* target)
+{
+	char tmp_path[PATH_MAX];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", target->path);
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+	{
+		LOGGER_ERROR("Persist Thread", "Failed to open %s.", tmp_path);
+		return;
+	}
+	
+	/* Snapshots are immutable, printing needs no datastore lock. */
+	struct ds_snapshot* snap = ds_pin(target->ds);
+	int ret = snap->root ? lyd_print_fd(fd, snap->root, LYD_XML, LYP_FORMAT | LYP_WITHSIBLINGS) : 0;
+	struct stat written;
+	if(ret || fsync(fd) || fstat(fd, &written))
+	{
+		LOGGER_ERROR("Persist Thread", "Failed to write %s.", tmp_path);
+		ds_unpin(snap);
+		close(fd);
+		unlink(tmp_path);
+		return;
+	}
+	close(fd);
+	/* Recorded before the rename, so the filewatch thread never sees it as an external write. */
+	pthread_mutex_lock(&persist_mutex);
+	target->written = written;
+	pthread_mutex_unlock(&persist_mutex);
+	if(rename(tmp_path, target->path))
+	{
+		LOGGER_ERROR("Persist Thread", "Failed to rename %s.", tmp_path);
+		ds_unpin(snap);
+		unlink(tmp_path);
+		return;
+	}
+	/* Same version as the XML file, a crash in between leaves a stale one which is ignored. */
+	if(g_persist_lyb)
+		persist_write_lyb(target, snap->root, &written);
+	ds_unpin(snap);
+	target->lyb_stale = 0;
+	persist_sync_dir(target->path);
+	
+	/* Records already in the snapshot would be replayed again, they are idempotent. */
+	if(target->journal_fd >= 0 && !ftruncate(target->journal_fd, 0))
+		fdatasync(target->journal_fd);
+	target->records = 0;
+}
+
+/* Nothing journaled, only the binary snapshot is missing : write it for the unchanged XML file. */
+static void persist_refresh_lyb(struct persist_target* target)
+{
+	struct stat xml;
+	struct ds_snapshot* snap = ds_pin(target->ds);
+	/* Not while an external edit of the file waits for its reload. */
+	if(!stat(target->path, &xml) && persist_owns(target->path, &xml))
+		persist_write_lyb(target, snap->root, &xml);
+	ds_unpin(snap);
+	target->lyb_stale = 0;
+}
+
+/* Compact what has been journaled meanwhile, or write a missing binary snapshot. */
+static void persist_idle(struct persist_target* target)
+{
+	if(target->records)
+		persist_compact(target);
+	else if(target->lyb_stale)
+		persist_refresh_lyb(target);
+}
+
+void* persist_thread_entry(void* arg)
+{
+	LOGGER_INFO("Persist Thread", "Started.");
+	pthread_mutex_lock(&persist_mutex);
+	persist_running = 1;
+	while(1)
+	{
+		if(!persist_head)
+		{
+			if(persist_stop)
+				break;
+			/* Idle, compact what has been journaled meanwhile. */
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += PERSIST_COMPACT_IDLE;
+			if(pthread_cond_timedwait(&persist_cond, &persist_mutex, &deadline) == ETIMEDOUT)
+			{
+				pthread_mutex_unlock(&persist_mutex);
+				for(int i = 0; i < persist_target_count; i++)
+					persist_idle(&persist_targets[i]);
+				pthread_mutex_lock(&persist_mutex);
+			}
+			continue;
+		}
+		struct persist_job* job = persist_head;
+		persist_head = job->next;
+		if(!persist_head)
+			persist_tail = NULL;
+		pthread_mutex_unlock(&persist_mutex);
+		
+		if(job->target)
+		{
+			persist_append(job);
+			if(job->target->records >= PERSIST_COMPACT_RECORDS)
+				persist_compact(job->target);
+		}
+		persist_job_free(job);
+		pthread_mutex_lock(&persist_mutex);
+		persist_done++;
+		pthread_cond_broadcast(&persist_done_cond);
+	}
+	persist_running = 0;
+	pthread_cond_broadcast(&persist_done_cond);
+	pthread_mutex_unlock(&persist_mutex);
+	
+	LOGGER_INFO("Persist Thread", "Cleaning up allocated resource.");
+	for(int i = 0; i < persist_target_count; i++)
+	{
+		persist_idle(&persist_targets[i]);
+		if(persist_targets[i].journal_fd >= 0)
+			close(persist_targets[i].journal_fd);
+	}
+	return NULL;
+}
+
+void persist_shutdown(void)
+{
+	pthread_mutex_lock(&persist_mutex);
+	persist_stop = 1;
+	pthread_cond_signal(&persist_cond);
+	pthread_mutex_unlock(&persist_mutex);
+}
+
+static char* persist_read_file(const char* path, size_t* len)
+{
+	FILE* file = fopen(path, "r");
+	if(!file)
+		return NULL;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char* buf = (char*)malloc(size + 1);
+	*len = fread(buf, 1, size, file);
+	buf[*len] = '\0';
+	fclose(file);
+	return buf;
+}
+
+/* Root of the binary snapshot of path when it mirrors the XML file described by xml, non-zero otherwise. */
+static int persist_load_lyb(struct ly_ctx* ctx, const char* path, const struct stat* xml, int options, struct lyd_node** root)
+{
+	char lyb_path[PATH_MAX];
+	snprintf(lyb_path, sizeof(lyb_path), "%s.lyb", path);
+	int fd = open(lyb_path, O_RDONLY);
+	if(fd < 0)
+		return 1;
+	struct stat st;
+	if(fstat(fd, &st) || (size_t)st.st_size < sizeof(struct persist_lyb_header))
+	{
+		close(fd);
+		return 1;
+	}
+	/* Parsed straight from the page cache, nothing is read into a buffer first. */
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return 1;
+	
+	const struct persist_lyb_header* header = (const struct persist_lyb_header*)map;
+	int ret = 1;
+	if(persist_lyb_matches(header, xml) && sizeof(*header) + header->length <= (uint64_t)st.st_size)
+	{
+		/* Validated when it was written, and the schemas are checked by the LYB parser. */
+		ly_errno = LY_SUCCESS;
+		*root = header->length ? lyd_parse_mem(ctx, (const char*)(header + 1), LYD_LYB, options | LYD_OPT_TRUSTED) : NULL;
+		ret = !*root && ly_errno != LY_SUCCESS;
+	}
+	munmap(map, st.st_size);
+	if(!ret)
+		LOGGER_INFO("Main Thread", "Loaded %s from its binary snapshot.", path);
+	return ret;
+}
+
+int persist_load(struct ly_ctx* ctx, const char* path, int options, struct lyd_node** root)
+{
+	*root = NULL;
+	struct stat xml;
+	if(stat(path, &xml))
+		return errno != ENOENT;
+	if(g_persist_lyb && !persist_load_lyb(ctx, path, &xml, options, root))
+		return 0;
+	ly_errno = LY_SUCCESS;
+	*root = lyd_parse_path(ctx, path, LYD_XML, options);
+	return !*root && ly_errno != LY_SUCCESS;
+}
+
+static struct lyd_node* persist_find_node(struct lyd_node* root, const char* path)
+{
+	struct ly_set* nodeset = root ? lyd_find_path(root, path) : NULL;
+	struct lyd_node* node = (nodeset && nodeset->number) ? nodeset->set.d[0] : NULL;
+	ly_set_free(nodeset);
+	return node;
+}
+
+/* Move the instance at path after the one at anchor, or in front of its instances when anchor is empty. */
+static void persist_replay_move(struct lyd_node** root, const char* path, const char* anchor)
+{
+	struct lyd_node* node = persist_find_node(*root, path);
+	struct lyd_node* prev = (anchor && anchor[0]) ? persist_find_node(*root, anchor) : NULL;
+	if(!node || (anchor && anchor[0] && !prev))
+		return;
+	if(prev)
+	{
+		lyd_insert_after(prev, node);
+	}
+	else
+	{
+		struct lyd_node* front = node->parent ? node->parent->child : *root;
+		while(front->prev->next)
+			front = front->prev;
+		while(front->schema != node->schema)
+			front = front->next;
+		if(front != node)
+			lyd_insert_before(front, node);
+	}
+	/* The moved node may have been the first top-level sibling. */
+	while((*root)->prev->next)
+		*root = (*root)->prev;
+}
+
+int persist_replay(struct ly_ctx* ctx, const char* path, struct lyd_node** root)
+{
+	char journal_path[PATH_MAX];
+	snprintf(journal_path, sizeof(journal_path), "%s.journal", path);
+	size_t len = 0;
+	char* journal = persist_read_file(journal_path, &len);
+	if(!journal)
+		return 0;
+	
+	int records = 0;
+	size_t pos = 0;
+	while(pos < len)
+	{
+		char op_name[16];
+		size_t payload_len;
+		int header_len;
+		if(sscanf(journal + pos, "%15s %zu\n%n", op_name, &payload_len, &header_len) != 2)
+			break;
+		/* A record cut short by a crash ends the replay. */
+		if(pos + header_len + payload_len + 1 > len)
+		{
+			LOGGER_WARNING("Main Thread", "Ignoring incomplete record at the end of %s.", journal_path);
+			break;
+		}
+		char* payload = journal + pos + header_len;
+		payload[payload_len] = '\0';
+		pos += header_len + payload_len + 1;
+		
+		if(!strcmp(op_name, "move"))
+		{
+			char* anchor = strchr(payload, '\n');
+			if(anchor)
+				*anchor++ = '\0';
+			persist_replay_move(root, payload, anchor);
+			records++;
+			continue;
+		}
+		if(!strcmp(op_name, "delete"))
+		{
+			struct ly_set* nodeset = *root ? lyd_find_path(*root, payload) : NULL;
+			for(unsigned int i = 0; nodeset && i < nodeset->number; i++)
+			{
+				if(nodeset->set.d[i] == *root)
+					*root = (*root)->next;
+				lyd_free(nodeset->set.d[i]);
+			}
+			ly_set_free(nodeset);
+			records++;
+			continue;
+		}
+		
+		struct lyd_node* data = payload_len ? lyd_parse_mem(ctx, payload, LYD_XML, LYD_OPT_CONFIG | LYD_OPT_TRUSTED) : NULL;
+		if(!strcmp(op_name, "replace"))
+		{
+			lyd_free_withsiblings(*root);
+			*root = data;
+		}
+		else if(!strcmp(op_name, "merge"))
+		{
+			if(!*root)
+				*root = data;
+			else if(data)
+				lyd_merge(*root, data, LYD_OPT_DESTRUCT | LYD_OPT_EXPLICIT);
+		}
+		else
+		{
+			LOGGER_WARNING("Main Thread", "Unknown record \"%s\" in %s.", op_name, journal_path);
+			lyd_free_withsiblings(data);
+			break;
+		}
+		records++;
+	}
+	free(journal);
+	if(records)
+		LOGGER_INFO("Main Thread", "Replayed %d journal records onto %s.", records, path);
+	return records;
+}
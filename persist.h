@@ -0,0 +1,64 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+/* 
+ * Datastore Persistence : every write is appended to "<path>.journal" by the
+ * persistence thread, and the journal is periodically compacted into a full
+ * snapshot at <path>, written to a temporary file and renamed over it. The same version
+ * is also written in LYB to "<path>.lyb", which boots without XML parsing or validation.
+ */
+
+/* Journal record operations. */
+enum persist_op
+{
+	/* Payload is a config tree merged into the datastore. */
+	PERSIST_MERGE,
+	/* Payload is a config tree replacing the whole datastore. */
+	PERSIST_REPLACE,
+	/* Payload is the path of the data node removed from the datastore. */
+	PERSIST_DELETE,
+	/* Payload is the path of a user ordered instance, a newline and the path of the instance it now follows (empty : first). */
+	PERSIST_MOVE
+};
+
+/* Compaction after this many journal records, or after PERSIST_COMPACT_IDLE seconds without writes. */
+const int PERSIST_COMPACT_RECORDS = 256;
+const int PERSIST_COMPACT_IDLE = 5;
+
+/* Binary snapshots, "-b" disables them. */
+extern int g_persist_lyb;
+
+/* Persistence Thread Entry Prototype */
+void* persist_thread_entry(void* arg);
+/* Drain the queue, compact every journal, then let the thread exit. */
+void persist_shutdown(void);
+
+/* Persist ds at path, before the persistence thread is started. */
+void persist_attach(struct datastore* ds, const char* path);
+
+/* 
+ * Queue a journal record for ds, serialized off the writer's critical section.
+ * Payload is either data (ownership taken) or the root of snap (pin taken over).
+ */
+void persist_submit(struct datastore* ds, enum persist_op op, struct lyd_node* data, struct ds_snapshot* snap);
+/* Queue a PERSIST_DELETE record, ownership of path taken. */
+void persist_submit_delete(struct datastore* ds, char* path);
+/* Queue a PERSIST_MOVE record, ownership of path and anchor (NULL : first) taken. */
+void persist_submit_move(struct datastore* ds, char* path, char* anchor);
+/* Wait until the records queued so far are appended to their journals. */
+void persist_sync(void);
+
+/* Whether ds is journaled. */
+int persist_attached(struct datastore* ds);
+/* Whether the file at path, as described by st, is the last snapshot written by the persistence thread. */
+int persist_owns(const char* path, const struct stat* st);
+
+/*
+ * At boot : the snapshot at path, from its binary snapshot when that mirrors the XML file,
+ * parsed from XML otherwise. A missing file is empty, non-zero when it does not parse.
+ */
+int persist_load(struct ly_ctx* ctx, const char* path, int options, struct lyd_node** root);
+/* At boot : apply the journal of path on top of its loaded snapshot root, returns the records applied. */
+int persist_replay(struct ly_ctx* ctx, const char* path, struct lyd_node** root);
+
+#endif
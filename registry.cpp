@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <atomic>
+#include <nc_server.h>
+#include "datastore.h"
+#include "registry.h"
+#include "logger.h"
+
+struct registry_bucket
+{
+	pthread_mutex_t mutex;
+	struct registry_session* head;
+};
+
+static struct registry_bucket registry_table[REGISTRY_BUCKETS];
+static std::atomic<int> registry_sessions(0);
+
+void registry_init(void)
+{
+	for(uint32_t i = 0; i < REGISTRY_BUCKETS; i++)
+	{
+		pthread_mutex_init(&registry_table[i].mutex, NULL);
+		registry_table[i].head = NULL;
+	}
+}
+
+static inline struct registry_bucket* registry_bucket_of(uint32_t session_id)
+{
+	return &registry_table[session_id & (REGISTRY_BUCKETS - 1)];
+}
+
+struct registry_session* registry_add(struct nc_session* session)
+{
+	struct registry_session* record = new registry_session;
+	record->session_id = nc_session_get_id(session);
+	record->session = session;
+	pthread_mutex_init(&record->mutex, NULL);
+	record->username = strdup(nc_session_get_username(session) ? nc_session_get_username(session) : "");
+	memset(record->locks, 0, sizeof(record->locks));
+	record->subscription = NULL;
+	record->in_rpcs = 0;
+	record->in_bad_rpcs = 0;
+	record->out_rpc_errors = 0;
+	record->out_notifications = 0;
+	record->refcount = 1;
+	nc_session_set_data(session, record);
+	
+	struct registry_bucket* bucket = registry_bucket_of(record->session_id);
+	pthread_mutex_lock(&bucket->mutex);
+	record->next = bucket->head;
+	bucket->head = record;
+	pthread_mutex_unlock(&bucket->mutex);
+	registry_sessions++;
+	return record;
+}
+
+struct registry_session* registry_of(const struct nc_session* session)
+{
+	return (struct registry_session*)nc_session_get_data(session);
+}
+
+struct registry_session* registry_get(uint32_t session_id)
+{
+	struct registry_bucket* bucket = registry_bucket_of(session_id);
+	pthread_mutex_lock(&bucket->mutex);
+	struct registry_session* record = bucket->head;
+	while(record && record->session_id != session_id)
+		record = record->next;
+	if(record)
+		record->refcount++;
+	pthread_mutex_unlock(&bucket->mutex);
+	return record;
+}
+
+void registry_put(struct registry_session* record)
+{
+	if(--record->refcount)
+		return;
+	pthread_mutex_destroy(&record->mutex);
+	free(record->username);
+	delete record;
+}
+
+struct nc_session* registry_lock(struct registry_session* record)
+{
+	pthread_mutex_lock(&record->mutex);
+	return record->session;
+}
+
+void registry_unlock(struct registry_session* record)
+{
+	pthread_mutex_unlock(&record->mutex);
+}
+
+void registry_lock_taken(struct registry_session* record, struct datastore* ds)
+{
+	pthread_mutex_lock(&record->mutex);
+	for(int i = 0; i < REGISTRY_LOCKS_MAX; i++)
+	{
+		if(record->locks[i] == ds)
+			break;
+		if(!record->locks[i])
+		{
+			record->locks[i] = ds;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&record->mutex);
+}
+
+void registry_lock_dropped(struct registry_session* record, struct datastore* ds)
+{
+	pthread_mutex_lock(&record->mutex);
+	for(int i = 0; i < REGISTRY_LOCKS_MAX; i++)
+		if(record->locks[i] == ds)
+			record->locks[i] = NULL;
+	pthread_mutex_unlock(&record->mutex);
+}
+
+struct registry_session* registry_remove(struct nc_session* session)
+{
+	struct registry_session* record = registry_of(session);
+	if(!record)
+		return NULL;
+	struct registry_bucket* bucket = registry_bucket_of(record->session_id);
+	pthread_mutex_lock(&bucket->mutex);
+	struct registry_session** link = &bucket->head;
+	while(*link && *link != record)
+		link = &(*link)->next;
+	if(*link)
+		*link = record->next;
+	pthread_mutex_unlock(&bucket->mutex);
+	registry_sessions--;
+	
+	/* Access Control : release the datastores this session locked, and only those. */
+	pthread_mutex_lock(&record->mutex);
+	for(int i = 0; i < REGISTRY_LOCKS_MAX; i++)
+	{
+		if(record->locks[i] && !ds_unlock(record->locks[i], record->session_id, NULL))
+			LOGGER_INFO("Server Thread", "Session %u : %s lock released.", record->session_id, record->locks[i]->name);
+		record->locks[i] = NULL;
+	}
+	pthread_mutex_unlock(&record->mutex);
+	return record;
+}
+
+void registry_detach(struct registry_session* record)
+{
+	pthread_mutex_lock(&record->mutex);
+	record->session = NULL;
+	pthread_mutex_unlock(&record->mutex);
+	/* The reference of the table. */
+	registry_put(record);
+}
+
+void registry_foreach(registry_cb cb, void* arg)
+{
+	for(uint32_t i = 0; i < REGISTRY_BUCKETS; i++)
+	{
+		struct registry_bucket* bucket = registry_bucket_of(i);
+		pthread_mutex_lock(&bucket->mutex);
+		for(struct registry_session* record = bucket->head; record; record = record->next)
+		{
+			pthread_mutex_lock(&record->mutex);
+			if(record->session)
+				cb(record, record->session, arg);
+			pthread_mutex_unlock(&record->mutex);
+		}
+		pthread_mutex_unlock(&bucket->mutex);
+	}
+}
+
+int registry_count(void)
+{
+	return registry_sessions;
+}
@@ -0,0 +1,69 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+
+/*
+ * Session Registry : every accepted session by session-id, in a hash table with a lock per
+ * bucket. A record holds what the session owns, its datastore locks and its subscription,
+ * so releasing a session touches only its own record. The nc_session pointer is only used
+ * under the record mutex, and is cleared under it before the session is freed.
+ */
+
+/* Hash buckets, a power of two. Session ids are sequential, so each bucket gets its share. */
+const uint32_t REGISTRY_BUCKETS = 64;
+/* Datastore locks a session may hold at once. */
+const int REGISTRY_LOCKS_MAX = 4;
+
+struct registry_session
+{
+	uint32_t session_id;
+	/* Valid under mutex until registry_detach(). */
+	struct nc_session* session;
+	pthread_mutex_t mutex;
+	char* username;
+	/* Datastores locked by <lock>, under mutex. */
+	struct datastore* locks[REGISTRY_LOCKS_MAX];
+	/* Its notif_subscriber, under the notification registry lock. */
+	void* subscription;
+	/* RFC 6022 per-session counters, relaxed. */
+	std::atomic<uint32_t> in_rpcs;
+	std::atomic<uint32_t> in_bad_rpcs;
+	std::atomic<uint32_t> out_rpc_errors;
+	std::atomic<uint32_t> out_notifications;
+	/* The table holds one reference until registry_remove(). */
+	std::atomic<uint32_t> refcount;
+	struct registry_session* next;
+};
+
+/* Set up the table, before the Accept Thread is started. */
+void registry_init(void);
+/* Accept Thread : register a session which completed its <hello>, its nc_session_set_data(). */
+struct registry_session* registry_add(struct nc_session* session);
+/* Record of session, NULL before registry_add(). */
+struct registry_session* registry_of(const struct nc_session* session);
+/* Referenced record of session_id or NULL, release it with registry_put(). */
+struct registry_session* registry_get(uint32_t session_id);
+void registry_put(struct registry_session* record);
+
+/* Lock record and return its session, NULL once it is detached. Always registry_unlock(). */
+struct nc_session* registry_lock(struct registry_session* record);
+void registry_unlock(struct registry_session* record);
+
+/* Track the datastore locks of record. */
+void registry_lock_taken(struct registry_session* record, struct datastore* ds);
+void registry_lock_dropped(struct registry_session* record, struct datastore* ds);
+
+/* Session terminated : unregister it and release its datastore locks, returns the record. */
+struct registry_session* registry_remove(struct nc_session* session);
+/* No thread uses the session any more once this returns, it may be freed. */
+void registry_detach(struct registry_session* record);
+
+/* Live sessions, cb runs with the record locked. */
+typedef void (*registry_cb)(struct registry_session* record, struct nc_session* session, void* arg);
+void registry_foreach(registry_cb cb, void* arg);
+/* Number of registered sessions. */
+int registry_count(void);
+
+#endif
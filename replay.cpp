@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <nc_server.h>
+#include "replay.h"
+#include "logger.h"
+
+extern struct ly_ctx* ctx;
+
+static const char REPLAY_MAGIC[8] = { 'N', 'C', 'R', 'P', 'L', 'Y', '0', '1' };
+/* Record length marking the unused end of the ring, the next record is at offset 0. */
+const uint32_t REPLAY_WRAP = 0xFFFFFFFF;
+
+/* File layout : header, then the ring. */
+struct replay_header
+{
+	char magic[8];
+	uint64_t capacity;
+	uint64_t created;
+	/* Ring offsets of the oldest record and of the next one. */
+	uint64_t head;
+	uint64_t tail;
+	uint64_t count;
+	/* Sequence number of the oldest record. */
+	uint64_t first_seq;
+};
+
+struct replay_record
+{
+	uint32_t len;
+	uint32_t reserved;
+	int64_t eventtime;
+	/* len bytes of LYB, padded to 8 bytes. */
+};
+
+/* Index entry of one record, in sequence order. */
+struct replay_entry
+{
+	time_t eventtime;
+	uint64_t offset;
+};
+
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int replay_fd = -1;
+static struct replay_header* replay_hdr = NULL;
+static char* replay_ring = NULL;
+static size_t replay_map_len = 0;
+static uint32_t replay_max_age = 0;
+/* Ring of index entries, replay_index[(replay_index_head + i) % replay_index_size] is record first_seq + i. */
+static struct replay_entry* replay_index = NULL;
+static uint64_t replay_index_head = 0;
+static uint64_t replay_index_size = 0;
+
+static uint64_t replay_record_size(uint32_t len)
+{
+	return sizeof(struct replay_record) + ((len + 7) & ~7u);
+}
+
+static struct replay_entry* replay_entry_at(uint64_t i)
+{
+	return &replay_index[(replay_index_head + i) % replay_index_size];
+}
+
+static void replay_index_push(time_t eventtime, uint64_t offset)
+{
+	uint64_t count = replay_hdr->count;
+	if(count == replay_index_size)
+	{
+		/* Unroll into a larger ring. */
+		uint64_t size = replay_index_size ? replay_index_size * 2 : 1024;
+		struct replay_entry* index = (struct replay_entry*)malloc(size * sizeof(struct replay_entry));
+		for(uint64_t i = 0; i < count; i++)
+			index[i] = *replay_entry_at(i);
+		free(replay_index);
+		replay_index = index;
+		replay_index_head = 0;
+		replay_index_size = size;
+	}
+	struct replay_entry* entry = &replay_index[(replay_index_head + count) % replay_index_size];
+	entry->eventtime = eventtime;
+	entry->offset = offset;
+}
+
+/* Drop the oldest record. */
+static void replay_evict(void)
+{
+	struct replay_header* hdr = replay_hdr;
+	if(hdr->head + sizeof(struct replay_record) > hdr->capacity || ((struct replay_record*)(replay_ring + hdr->head))->len == REPLAY_WRAP)
+		hdr->head = 0;
+	struct replay_record* record = (struct replay_record*)(replay_ring + hdr->head);
+	hdr->head = (hdr->head + replay_record_size(record->len)) % hdr->capacity;
+	hdr->count--;
+	hdr->first_seq++;
+	replay_index_head = (replay_index_head + 1) % replay_index_size;
+	if(!hdr->count)
+		hdr->head = hdr->tail;
+}
+
+/* Does [begin, end) overlap a stored record? */
+static int replay_overlaps(uint64_t begin, uint64_t end)
+{
+	struct replay_header* hdr = replay_hdr;
+	if(!hdr->count)
+		return 0;
+	if(hdr->head < hdr->tail)
+		return begin < hdr->tail && hdr->head < end;
+	return end > hdr->head || begin < hdr->tail;
+}
+
+int replay_open(const char* path, size_t capacity, uint32_t max_age)
+{
+	capacity &= ~(size_t)7;
+	replay_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(replay_fd < 0)
+	{
+		LOGGER_ERROR("Main Thread", "Failed to open %s.", path);
+		return 1;
+	}
+	replay_map_len = sizeof(struct replay_header) + capacity;
+	struct stat st;
+	fstat(replay_fd, &st);
+	int fresh = (size_t)st.st_size != replay_map_len;
+	if(fresh && ftruncate(replay_fd, replay_map_len))
+	{
+		close(replay_fd);
+		replay_fd = -1;
+		return 1;
+	}
+	void* map = mmap(NULL, replay_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, replay_fd, 0);
+	if(map == MAP_FAILED)
+	{
+		close(replay_fd);
+		replay_fd = -1;
+		return 1;
+	}
+	replay_hdr = (struct replay_header*)map;
+	replay_ring = (char*)map + sizeof(struct replay_header);
+	replay_max_age = max_age;
+	
+	if(fresh || memcmp(replay_hdr->magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC)) || replay_hdr->capacity != capacity)
+	{
+		/* New store, or one of another size : start over. */
+		memcpy(replay_hdr->magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+		replay_hdr->capacity = capacity;
+		replay_hdr->created = time(NULL);
+		replay_hdr->head = 0;
+		replay_hdr->tail = 0;
+		replay_hdr->count = 0;
+		replay_hdr->first_seq = 0;
+		return 0;
+	}
+	
+	/* Rebuild the time index from the records, no payload is parsed. */
+	uint64_t count = replay_hdr->count;
+	uint64_t offset = replay_hdr->head;
+	replay_hdr->count = 0;
+	for(uint64_t i = 0; i < count; i++)
+	{
+		if(offset + sizeof(struct replay_record) > capacity || ((struct replay_record*)(replay_ring + offset))->len == REPLAY_WRAP)
+			offset = 0;
+		struct replay_record* record = (struct replay_record*)(replay_ring + offset);
+		replay_index_push(record->eventtime, offset);
+		replay_hdr->count++;
+		offset = (offset + replay_record_size(record->len)) % capacity;
+	}
+	LOGGER_INFO("Main Thread", "Replay store %s : %llu notifications.", path, (unsigned long long)count);
+	return 0;
+}
+
+void replay_close(void)
+{
+	if(!replay_hdr)
+		return;
+	msync(replay_hdr, replay_map_len, MS_SYNC);
+	munmap(replay_hdr, replay_map_len);
+	close(replay_fd);
+	replay_hdr = NULL;
+	replay_ring = NULL;
+	replay_fd = -1;
+	free(replay_index);
+	replay_index = NULL;
+	replay_index_size = 0;
+}
+
+int replay_enabled(void)
+{
+	return replay_hdr != NULL;
+}
+
+time_t replay_created(void)
+{
+	return replay_hdr ? (time_t)replay_hdr->created : 0;
+}
+
+void replay_advertise(struct lyd_node* state)
+{
+	if(!state)
+		return;
+	struct ly_set* nodeset = lyd_find_path(state, "/nc-notifications:netconf/streams/stream[name='NETCONF']/replaySupport");
+	if(nodeset && nodeset->number)
+		lyd_change_leaf((struct lyd_node_leaf_list*)nodeset->set.d[0], replay_enabled() ? "true" : "false");
+	ly_set_free(nodeset);
+	nodeset = lyd_find_path(state, "/nc-notifications:netconf/streams/stream[name='NETCONF']/replayLogCreationTime");
+	if(nodeset && nodeset->number && replay_enabled())
+	{
+		char* created = nc_time2datetime(replay_created(), NULL, NULL);
+		lyd_change_leaf((struct lyd_node_leaf_list*)nodeset->set.d[0], created);
+		free(created);
+	}
+	ly_set_free(nodeset);
+}
+
+void replay_append(time_t eventtime, const struct lyd_node* tree)
+{
+	if(!replay_hdr)
+		return;
+	char* lyb = NULL;
+	if(lyd_print_mem(&lyb, tree, LYD_LYB, 0) || !lyb)
+		return;
+	uint32_t len = lyd_lyb_data_length(lyb);
+	uint64_t size = replay_record_size(len);
+	
+	pthread_mutex_lock(&replay_mutex);
+	struct replay_header* hdr = replay_hdr;
+	if(size > hdr->capacity / 2)
+	{
+		pthread_mutex_unlock(&replay_mutex);
+		free(lyb);
+		LOGGER_WARNING("Notificator Thread", "Notification of %u bytes too large for the replay store.", len);
+		return;
+	}
+	/* Keep the index sorted, the wall clock may step back. */
+	if(hdr->count && eventtime < replay_entry_at(hdr->count - 1)->eventtime)
+		eventtime = replay_entry_at(hdr->count - 1)->eventtime;
+	
+	/* A record never crosses the end of the ring, the remainder is skipped. */
+	uint64_t offset = hdr->tail;
+	int wrap = offset + size > hdr->capacity;
+	while(hdr->count && (wrap ? (replay_overlaps(offset, hdr->capacity) || replay_overlaps(0, size)) : replay_overlaps(offset, offset + size)))
+		replay_evict();
+	if(wrap)
+	{
+		if(offset + sizeof(uint32_t) <= hdr->capacity)
+			((struct replay_record*)(replay_ring + offset))->len = REPLAY_WRAP;
+		offset = 0;
+		if(!hdr->count)
+			hdr->head = 0;
+	}
+	struct replay_record* record = (struct replay_record*)(replay_ring + offset);
+	record->len = len;
+	record->reserved = 0;
+	record->eventtime = eventtime;
+	memcpy(record + 1, lyb, len);
+	replay_index_push(eventtime, offset);
+	hdr->count++;
+	hdr->tail = (offset + size) % hdr->capacity;
+	pthread_mutex_unlock(&replay_mutex);
+	free(lyb);
+}
+
+void replay_expire(void)
+{
+	if(!replay_hdr || !replay_max_age)
+		return;
+	time_t limit = time(NULL) - replay_max_age;
+	pthread_mutex_lock(&replay_mutex);
+	while(replay_hdr->count && replay_entry_at(0)->eventtime < limit)
+		replay_evict();
+	pthread_mutex_unlock(&replay_mutex);
+}
+
+uint64_t replay_seek(time_t start)
+{
+	if(!replay_hdr)
+		return 0;
+	pthread_mutex_lock(&replay_mutex);
+	/* Lower bound on the event times. */
+	uint64_t low = 0;
+	uint64_t high = replay_hdr->count;
+	while(low < high)
+	{
+		uint64_t mid = low + (high - low) / 2;
+		if(replay_entry_at(mid)->eventtime < start)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	uint64_t seq = replay_hdr->first_seq + low;
+	pthread_mutex_unlock(&replay_mutex);
+	return seq;
+}
+
+uint64_t replay_end(void)
+{
+	if(!replay_hdr)
+		return 0;
+	pthread_mutex_lock(&replay_mutex);
+	uint64_t seq = replay_hdr->first_seq + replay_hdr->count;
+	pthread_mutex_unlock(&replay_mutex);
+	return seq;
+}
+
+struct lyd_node* replay_read(uint64_t* seq, time_t* eventtime)
+{
+	if(!replay_hdr)
+		return NULL;
+	pthread_mutex_lock(&replay_mutex);
+	if(*seq < replay_hdr->first_seq)
+		*seq = replay_hdr->first_seq;
+	if(*seq >= replay_hdr->first_seq + replay_hdr->count)
+	{
+		pthread_mutex_unlock(&replay_mutex);
+		return NULL;
+	}
+	struct replay_entry* entry = replay_entry_at(*seq - replay_hdr->first_seq);
+	*eventtime = entry->eventtime;
+	/* LYB is decoded straight from the mapping, stored data is trusted. */
+	struct replay_record* record = (struct replay_record*)(replay_ring + entry->offset);
+	struct lyd_node* tree = lyd_parse_mem(ctx, (const char*)(record + 1), LYD_LYB, LYD_OPT_NOTIF | LYD_OPT_TRUSTED, NULL);
+	pthread_mutex_unlock(&replay_mutex);
+	return tree;
+}
@@ -0,0 +1,42 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* 
+ * Notification Replay Store, RFC 5277 3.2 : every published notification is appended to an
+ * mmap'ed ring file in libyang binary format (LYB). An in-memory index of event times gives
+ * O(log n) seeks for <startTime>, the oldest records are overwritten when the ring is full
+ * or older than the configured age.
+ */
+
+/* Replay store size and age, set by "-l" (MB, 0 disables it) and "-t" (seconds, 0 : no limit). */
+const int REPLAY_SIZE_DEFAULT = 16;
+const int REPLAY_AGE_DEFAULT = 86400;
+
+/* Open path, or create it with capacity bytes. Returns non-zero on failure. */
+int replay_open(const char* path, size_t capacity, uint32_t max_age);
+void replay_close(void);
+int replay_enabled(void);
+/* Creation time of the store, as advertised in replayLogCreationTime. */
+time_t replay_created(void);
+/* Set replaySupport and replayLogCreationTime of the NETCONF stream in the state tree. */
+void replay_advertise(struct lyd_node* state);
+
+/* Store a notification, event times never go backwards. */
+void replay_append(time_t eventtime, const struct lyd_node* tree);
+/* Drop the records older than the configured age. */
+void replay_expire(void);
+
+/* Sequence number of the first record at or after start. */
+uint64_t replay_seek(time_t start);
+/* Sequence number the next appended record will get. */
+uint64_t replay_end(void);
+/* 
+ * Record *seq as a notification tree, or NULL past the end. When *seq has been
+ * overwritten already, it is moved forward to the oldest record.
+ */
+struct lyd_node* replay_read(uint64_t* seq, time_t* eventtime);
+
+#endif
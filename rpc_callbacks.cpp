@@ -3,292 +3,660 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <nc_server.h>
 #include "rpc_callbacks.h"
+#include "datastore.h"
+#include "filter.h"
+#include "persist.h"
+#include "edit_config.h"
+#include "confirm.h"
+#include "notif.h"
+#include "replay.h"
+#include "state.h"
+#include "registry.h"
+#include "metrics.h"
+#include "logger.h"
 
 /* Global Libyang Context Pointer */
 extern struct ly_ctx* ctx;
 
-/* Global Pollsession Pointers */
-extern struct nc_pollsession* g_pollsession;
+/* Global Datastores, written under ds_write_guard, read by pinning a snapshot. */
+extern struct datastore g_ds_running;
+extern struct datastore g_ds_candidate;
+extern struct datastore g_ds_state;
+extern struct datastore g_ds_startup;
 
-/* Global Datastore Pointer, maintained by fdmonitor thread. */
-extern struct lyd_node* g_node_running;
-extern struct lyd_node* g_node_candidate;
-extern struct lyd_node* g_node_state;
+/* Lifetime of an RPC callback, recorded in its histogram and logged with its duration. */
+class rpc_trace
+{
+public:
+	rpc_trace(struct lyd_node* rpc, struct nc_session* session) : name(rpc->schema->name), session_id(nc_session_get_id(session)),
+		metric(metrics_rpc(name)), start(metrics_now())
+	{
+		LOGGER_RPC(LOGGER_LEVEL_DEBUG, session_id, name, -1, "<%s> RPC Received.", name);
+	}
+	~rpc_trace()
+	{
+		uint64_t usec = metrics_now() - start;
+		metrics_record(metric, usec);
+		LOGGER_RPC(LOGGER_LEVEL_INFO, session_id, name, (int64_t)usec, "<%s> done.", name);
+	}
+private:
+	const char* name;
+	uint32_t session_id;
+	int metric;
+	uint64_t start;
+	rpc_trace(const rpc_trace&) = delete;
+	rpc_trace& operator=(const rpc_trace&) = delete;
+};
+
+/* Datastore named by the single child of the <target>/<source> container at path. */
+static struct datastore* rpc_get_datastore(struct lyd_node* rpc, const char* path)
+{
+	struct datastore* ds = NULL;
+	struct ly_set* nodeset = lyd_find_path(rpc, path);
+	if(nodeset && nodeset->number)
+	{
+		if (!strcmp(nodeset->set.d[0]->schema->name, "running"))
+			ds = &g_ds_running;
+		else if (!strcmp(nodeset->set.d[0]->schema->name, "candidate"))
+			ds = &g_ds_candidate;
+		else if (!strcmp(nodeset->set.d[0]->schema->name, "startup"))
+			ds = &g_ds_startup;
+	}
+	ly_set_free(nodeset);
+	return ds;
+}
+
+/* 
+ * Reply of the last <get>/<get-config> of this worker thread. A reply printed straight
+ * from a pinned snapshot is handed to libnetconf2 as NC_PARAMTYPE_CONST, and released
+ * by rpc_reply_sent() once nc_ps_poll() has written it to the transport.
+ */
+struct rpc_stream
+{
+	struct lyd_node* reply;
+	struct lyd_node_anydata* data;
+	struct ds_snapshot* snap;
+	const char* name;
+	long rss_kb;
+	long peak_kb;
+};
+static thread_local struct rpc_stream rpc_stream_slot;
+
+/* Resident set size, current from /proc and the process peak from getrusage(). */
+static void rpc_rss(long* rss_kb, long* peak_kb)
+{
+	long pages = 0;
+	FILE* file = fopen("/proc/self/statm", "r");
+	if(file)
+	{
+		if(fscanf(file, "%*d %ld", &pages) != 1)
+			pages = 0;
+		fclose(file);
+	}
+	*rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	*peak_kb = usage.ru_maxrss;
+}
+
+void rpc_reply_sent(void)
+{
+	struct rpc_stream* stream = &rpc_stream_slot;
+	if(!stream->name)
+		return;
+	if(stream->reply)
+	{
+		/* The snapshot is only borrowed by the <data> anydata. */
+		stream->data->value.tree = NULL;
+		lyd_free_withsiblings(stream->reply);
+		ds_unpin(stream->snap);
+	}
+	long rss_kb, peak_kb;
+	rpc_rss(&rss_kb, &peak_kb);
+	LOGGER_DEBUG("Server Thread", "<%s> reply sent, RSS %ld kB (%+ld kB), peak RSS %ld kB%s.", stream->name, rss_kb, rss_kb - stream->rss_kb, peak_kb, (peak_kb > stream->peak_kb) ? " (raised by this reply)" : "");
+	memset(stream, 0, sizeof(struct rpc_stream));
+}
+
+/* Only the selected branches of root are duplicated, merged into *selected. */
+static int rpc_select_tree(struct lyd_node** selected, const struct lyd_node* root, const struct rpc_filter* filter)
+{
+	struct lyd_node* result = NULL;
+	if(filter_apply(root, filter, &result))
+		return 1;
+	if(!result)
+		return 0;
+	if(!*selected)
+		*selected = result;
+	else
+		lyd_merge(*selected, result, LYD_OPT_DESTRUCT);
+	return 0;
+}
 
-/* Global Datastore Access Control */
-extern pthread_mutex_t g_sidmutex_running;
-extern volatile uint32_t g_sid_running;
-extern pthread_mutex_t g_sidmutex_candidate;
-extern volatile uint32_t g_sid_candidate;
-/* File Sync Flags */
-bool syncflag_running = 0;
-bool syncflag_candidate = 0;
+/* Same, from the pinned current version of ds. */
+static int rpc_select(struct lyd_node** selected, struct datastore* ds, const struct rpc_filter* filter)
+{
+	ds_read_guard snap(ds);
+	return rpc_select_tree(selected, snap.root(), filter);
+}
 
 struct nc_server_reply* rpc_callback_get(struct lyd_node* rpc,struct nc_session *session)
 {
-	printf("<get>/<get-config> RPC Received.\n");
+	rpc_trace trace(rpc, session);
 	
-	/* Duplicate the <rpc> data, directly get the correct XPath in schema. */
-	struct lyd_node* data = lyd_dup(rpc, LYD_DUP_OPT_RECURSIVE);
-	struct lyd_node* source_data = NULL;
-	struct lyd_node* data_state = NULL;
+	struct datastore* source_ds = NULL;
+	struct datastore* state_ds = NULL;
 	
 	/* Add state data for <get> operation. */
 	if(!strcmp(rpc->schema->name, "get"))
 	{
-		source_data = lyd_dup(g_node_running,LYD_DUP_OPT_RECURSIVE);
-		data_state = lyd_dup(g_node_state,LYD_DUP_OPT_RECURSIVE);
-		/* Combine Return Data. */
-		lyd_insert_after(source_data, data_state);
+		source_ds = &g_ds_running;
+		state_ds = &g_ds_state;
 	}
 	/* Choose correct datastore for <get-config> operation. */
 	else
 	{
-		struct ly_set* nodeset = lyd_find_path(rpc, "/ietf-netconf:get-config/source/*");
-		if (!strcmp(nodeset->set.d[0]->schema->name, "running"))
-			source_data = lyd_dup(g_node_running,LYD_DUP_OPT_RECURSIVE);
-		else if (!strcmp(nodeset->set.d[0]->schema->name, "candidate"))
-			source_data = lyd_dup(g_node_candidate,LYD_DUP_OPT_RECURSIVE);
-		//else if (!strcmp(nodeset->set.d[0]->schema->name, "startup"))
-		//	source_data = NULL;
-		else
-			printf("[RPC Handler] <get-config> Unexpected datastore source.");	
-		ly_set_free(nodeset);
+		source_ds = rpc_get_datastore(rpc, "/ietf-netconf:get-config/source/*");
+		if(!source_ds)
+		{
+			LOGGER_RPC(LOGGER_LEVEL_WARNING, nc_session_get_id(session), rpc->schema->name, -1, "Unexpected datastore source.");
+			return nc_server_reply_err(nc_err(NC_ERR_OP_NOT_SUPPORTED, NC_ERR_TYPE_PROT));
+		}
+	}
+	
+	/* YANG Data Instance Filter */
+	struct rpc_filter filter;
+	struct nc_server_error* e = filter_parse(ctx, rpc, &filter);
+	if(e)
+	{
+		filter_free(&filter);
+		return nc_server_reply_err(e);
 	}
 	
-	/* TODO YANG Data Instance Filter */
+	/* Any reply still held by this thread has been sent already. */
+	rpc_reply_sent();
+	struct rpc_stream* stream = &rpc_stream_slot;
+	stream->name = rpc->schema->name;
+	rpc_rss(&stream->rss_kb, &stream->peak_kb);
 	
-	/* Link the data node to the <rpc-reply> YANG Data Instance. */
-	lyd_new_output_anydata(data, NULL, "data", source_data, LYD_ANYDATA_DATATREE);
-	lyd_validate(&data, LYD_OPT_RPCREPLY, NULL);
+	/* <rpc-reply> wrapper, the operation node alone, the <data> is already valid. */
+	struct lyd_node* reply = lyd_dup(rpc, 0);
 	
-	/* Send <rpc-reply> */
-	return nc_server_reply_data(data, NC_WD_ALL, NC_PARAMTYPE_FREE);
+	if(filter.all && !state_ds)
+	{
+		/* libnetconf2 prints the pinned snapshot to the transport in chunks, no copy at all. */
+		filter_free(&filter);
+		struct ds_snapshot* snap = ds_pin(source_ds);
+		if(!snap->root)
+		{
+			ds_unpin(snap);
+			lyd_new_output_anydata(reply, NULL, "data", (void*)"", LYD_ANYDATA_CONSTSTRING);
+			return nc_server_reply_data(reply, NC_WD_ALL, NC_PARAMTYPE_FREE);
+		}
+		stream->snap = snap;
+		stream->data = (struct lyd_node_anydata*)lyd_new_output_anydata(reply, NULL, "data", snap->root, LYD_ANYDATA_DATATREE);
+		stream->reply = reply;
+		return nc_server_reply_data(reply, NC_WD_ALL, NC_PARAMTYPE_CONST);
+	}
+	
+	/* State providers the filter may select, rebuilt only when their TTL has expired. */
+	struct ds_snapshot* provided[STATE_PROVIDERS_MAX];
+	int provided_count = state_ds ? state_collect(&filter, provided) : 0;
+	
+	if(filter.all)
+	{
+		/* 
+		 * <get> spans several snapshots, each one is printed once per version and shared by
+		 * every <get> of that version, the reply only concatenates them in one exact allocation.
+		 */
+		struct ds_snapshot* snaps[STATE_PROVIDERS_MAX + 2];
+		const char* parts[STATE_PROVIDERS_MAX + 2];
+		size_t lengths[STATE_PROVIDERS_MAX + 2];
+		int count = 0;
+		snaps[count++] = ds_pin(source_ds);
+		snaps[count++] = ds_pin(state_ds);
+		for(int i = 0; i < provided_count; i++)
+			snaps[count++] = provided[i];
+		size_t total = 0;
+		for(int i = 0; i < count; i++)
+		{
+			parts[i] = ds_snapshot_xml(snaps[i]);
+			lengths[i] = parts[i] ? strlen(parts[i]) : 0;
+			total += lengths[i];
+		}
+		char* data = (char*)malloc(total + 1);
+		size_t offset = 0;
+		for(int i = 0; i < count; i++)
+		{
+			memcpy(data + offset, parts[i], lengths[i]);
+			offset += lengths[i];
+			ds_unpin(snaps[i]);
+		}
+		data[offset] = '\0';
+		filter_free(&filter);
+		lyd_new_output_anydata(reply, NULL, "data", data, LYD_ANYDATA_SXMLD);
+		return nc_server_reply_data(reply, NC_WD_ALL, NC_PARAMTYPE_FREE);
+	}
+	
+	/* Filtered : the selected branches are owned by the reply, printed by libnetconf2 and freed with it. */
+	struct lyd_node* selected = NULL;
+	int failed = rpc_select(&selected, source_ds, &filter) || (state_ds && rpc_select(&selected, state_ds, &filter));
+	for(int i = 0; i < provided_count; i++)
+	{
+		if(!failed)
+			failed = rpc_select_tree(&selected, provided[i]->root, &filter);
+		ds_unpin(provided[i]);
+	}
+	if(failed)
+	{
+		lyd_free_withsiblings(selected);
+		lyd_free(reply);
+		filter_free(&filter);
+		memset(stream, 0, sizeof(struct rpc_stream));
+		e = nc_err(NC_ERR_INVALID_VALUE, NC_ERR_TYPE_PROT);
+		nc_err_set_msg(e, "[RPC Handler] Invalid XPath in <filter>.", "en");
+		return nc_server_reply_err(e);
+	}
+	filter_free(&filter);
+	if(selected)
+		lyd_new_output_anydata(reply, NULL, "data", selected, LYD_ANYDATA_DATATREE);
+	else
+		lyd_new_output_anydata(reply, NULL, "data", (void*)"", LYD_ANYDATA_CONSTSTRING);
+	return nc_server_reply_data(reply, NC_WD_ALL, NC_PARAMTYPE_FREE);
 }
 
-struct nc_server_reply* rpc_callback_edit(struct lyd_node* rpc, struct nc_session *session)
+/* Value of an optional leaf parameter of rpc, NULL when absent. */
+static const char* rpc_leaf_value(struct lyd_node* rpc, const char* path)
 {
-	printf("<edit-config> RPC Received.\n");
-	/* TODO Too many complicated operations. */
-	return nc_server_reply_ok();
+	const char* value = NULL;
+	struct ly_set* nodeset = lyd_find_path(rpc, path);
+	if(nodeset && nodeset->number && nodeset->set.d[0]->schema->nodetype == LYS_LEAF)
+		value = ((struct lyd_node_leaf_list*)nodeset->set.d[0])->value_str;
+	ly_set_free(nodeset);
+	return value;
 }
 
-struct nc_server_reply* rpc_callback_copy(struct lyd_node* rpc, struct nc_session *session)
+struct nc_server_reply* rpc_callback_get_schema(struct lyd_node* rpc, struct nc_session *session)
 {
-	printf("<copy-config> RPC Received.\n");
-	struct lyd_node* source_data = NULL;
-	struct lyd_node* target_node = NULL;
-	struct ly_set* nodeset = NULL;
+	rpc_trace trace(rpc, session);
+	const char* identifier = rpc_leaf_value(rpc, "/ietf-netconf-monitoring:get-schema/identifier");
+	const char* version = rpc_leaf_value(rpc, "/ietf-netconf-monitoring:get-schema/version");
+	const char* format = rpc_leaf_value(rpc, "/ietf-netconf-monitoring:get-schema/format");
+	/* Identityref values may carry the module prefix. */
+	if(format && strchr(format, ':'))
+		format = strchr(format, ':') + 1;
+	if(!format)
+		format = "yang";
+	if(!identifier || strchr(identifier, '\'') || (version && strchr(version, '\'')))
+	{
+		struct nc_server_error* e = nc_err(NC_ERR_INVALID_VALUE, NC_ERR_TYPE_APP);
+		nc_err_set_msg(e, "[RPC Handler] Invalid schema identifier.", "en");
+		return nc_server_reply_err(e);
+	}
 	
-	/* Processing target argument, check permission */
-	nodeset = lyd_find_path(rpc, "/ietf-netconf:copy-config/target/*");
-	if (!strcmp(nodeset->set.d[0]->schema->name, "running"))
+	/* Resolved against the advertised /netconf-state/schemas, rebuilt at most once per MONITOR_TTL. */
+	char state_path[] = "/ietf-netconf-monitoring:netconf-state";
+	char* state_xpath = state_path;
+	struct rpc_filter filter = { 0, &state_xpath, 1 };
+	struct ds_snapshot* provided[STATE_PROVIDERS_MAX];
+	int provided_count = state_collect(&filter, provided);
+	
+	char path[256];
+	if(version)
+		snprintf(path, sizeof(path), "/ietf-netconf-monitoring:netconf-state/schemas/schema[identifier='%s'][version='%s']", identifier, version);
+	else
+		snprintf(path, sizeof(path), "/ietf-netconf-monitoring:netconf-state/schemas/schema[identifier='%s']", identifier);
+	char* found_version = NULL;
+	int matches = 0;
+	for(int i = 0; i < provided_count; i++)
 	{
-		/* Keep holding sid 0 unchanged until write operation complete. */
-		pthread_mutex_lock(&g_sidmutex_running);
-		if(g_sid_running == 0)
-		{
-			// Do NOT unlock here or the write operation may be interrupted.
-			target_node = g_node_running;
-			syncflag_running = 1;
-		}
-		else
+		struct ly_set* nodeset = lyd_find_path(provided[i]->root, path);
+		for(unsigned int j = 0; nodeset && j < nodeset->number; j++)
 		{
-			pthread_mutex_unlock(&g_sidmutex_running);
-			return nc_server_reply_err(nc_err(NC_ERR_LOCK_DENIED, g_sid_running));
+			struct lyd_node* child;
+			const char* entry_format = NULL;
+			const char* entry_version = NULL;
+			LY_TREE_FOR(nodeset->set.d[j]->child, child)
+			{
+				if(!strcmp(child->schema->name, "format"))
+					entry_format = ((struct lyd_node_leaf_list*)child)->value_str;
+				else if(!strcmp(child->schema->name, "version"))
+					entry_version = ((struct lyd_node_leaf_list*)child)->value_str;
+			}
+			if(entry_format && strchr(entry_format, ':'))
+				entry_format = strchr(entry_format, ':') + 1;
+			if(!entry_format || !entry_version || strcmp(entry_format, format))
+				continue;
+			if(!found_version)
+				found_version = strdup(entry_version);
+			matches++;
 		}
+		ly_set_free(nodeset);
+		ds_unpin(provided[i]);
 	}
-	else if (!strcmp(nodeset->set.d[0]->schema->name, "candidate"))
+	
+	if(!matches)
 	{
-		pthread_mutex_lock(&g_sidmutex_candidate);
-		if(g_sid_candidate == 0)
-		{
-			// Do NOT unlock here or the write operation may be interrupted.
-			target_node = g_node_candidate;
-			syncflag_candidate = 1;
-		}
-		else
-		{
-			pthread_mutex_unlock(&g_sidmutex_candidate);
-			return nc_server_reply_err(nc_err(NC_ERR_LOCK_DENIED, g_sid_candidate));
-		}
+		struct nc_server_error* e = nc_err(NC_ERR_INVALID_VALUE, NC_ERR_TYPE_APP);
+		nc_err_set_msg(e, "[RPC Handler] The requested schema does not exist.", "en");
+		return nc_server_reply_err(e);
 	}
-	else
-		printf("[RPC Handler] <copy-config> Unexpected <target>.\n");	
+	/* RFC 6022 3.1.1 : several revisions and no <version> to choose one. */
+	if(matches > 1)
+	{
+		free(found_version);
+		struct nc_server_error* e = nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP);
+		nc_err_set_app_tag(e, "data-not-unique");
+		nc_err_set_msg(e, "[RPC Handler] More than one schema matches the request.", "en");
+		return nc_server_reply_err(e);
+	}
+	
+	const struct lys_module* module = ly_ctx_get_module(ctx, identifier, found_version[0] ? found_version : NULL, 0);
+	free(found_version);
+	char* model = NULL;
+	if(!module || lys_print_mem(&model, module, strcmp(format, "yin") ? LYS_OUT_YANG : LYS_OUT_YIN, NULL, 0, 0))
+		return nc_server_reply_err(nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP));
+	
+	struct lyd_node* reply = lyd_dup(rpc, 0);
+	lyd_new_output_anydata(reply, NULL, "data", model, LYD_ANYDATA_STRING);
+	return nc_server_reply_data(reply, NC_WD_EXPLICIT, NC_PARAMTYPE_FREE);
+}
+
+struct nc_server_reply* rpc_callback_edit(struct lyd_node* rpc, struct nc_session *session)
+{
+	rpc_trace trace(rpc, session);
+	
+	/* Processing target argument */
+	struct datastore* target_ds = rpc_get_datastore(rpc, "/ietf-netconf:edit-config/target/*");
+	if(!target_ds)
+	{
+		LOGGER_RPC(LOGGER_LEVEL_WARNING, nc_session_get_id(session), rpc->schema->name, -1, "Unexpected <target>.");
+		return nc_server_reply_err(nc_err(NC_ERR_OP_NOT_SUPPORTED, NC_ERR_TYPE_PROT));
+	}
+	struct ly_set* nodeset = NULL;
+	
+	/* Processing options, all of them default when absent. */
+	enum edit_op default_op = EDIT_OP_MERGE;
+	const char* value = rpc_leaf_value(rpc, "default-operation");
+	if(value && !strcmp(value, "replace"))
+		default_op = EDIT_OP_REPLACE;
+	else if(value && !strcmp(value, "none"))
+		default_op = EDIT_OP_NONE;
+	
+	int test_only = 0;
+	int test = 1;
+	value = rpc_leaf_value(rpc, "test-option");
+	if(value && !strcmp(value, "set"))
+		test = 0;
+	else if(value && !strcmp(value, "test-only"))
+		test_only = 1;
+	
+	enum edit_error_option error_option = EDIT_STOP_ON_ERROR;
+	value = rpc_leaf_value(rpc, "error-option");
+	if(value && !strcmp(value, "continue-on-error"))
+		error_option = EDIT_CONTINUE_ON_ERROR;
+	else if(value && !strcmp(value, "rollback-on-error"))
+		error_option = EDIT_ROLLBACK_ON_ERROR;
+	
+	/* Processing config argument, <url> is not supported. */
+	struct lyd_node* edit = NULL;
+	nodeset = lyd_find_path(rpc, "config");
+	if(!nodeset || !nodeset->number)
+	{
+		ly_set_free(nodeset);
+		return nc_server_reply_err(nc_err(NC_ERR_OP_NOT_SUPPORTED, NC_ERR_TYPE_PROT));
+	}
+	struct lyd_node_anydata* anydata = (struct lyd_node_anydata*)nodeset->set.d[0];
 	ly_set_free(nodeset);
+	if(anydata->value_type == LYD_ANYDATA_XML && anydata->value.xml)
+	{
+		/* Keeps the "operation" attributes, no config validation of the edit itself. */
+		edit = lyd_parse_xml(ctx, &anydata->value.xml, LYD_OPT_EDIT | LYD_OPT_STRICT);
+		if(!edit)
+			return nc_server_reply_err(nc_err_libyang(ctx));
+	}
 	
-	/* Processing source argument */
-	nodeset = lyd_find_path(rpc, "/ietf-netconf:copy-config/source/*");
-	if (!strcmp(nodeset->set.d[0]->schema->name, "running"))
+	/* Exclusive writer until the guard goes out of scope. */
+	ds_write_guard writer(target_ds);
+	uint32_t lock_sid = writer.denied(nc_session_get_id(session));
+	if(lock_sid)
 	{
-		if(target_node == g_node_running)
-			return nc_server_reply_ok();
-		else
-			source_data = lyd_dup(g_node_running, LYD_DUP_OPT_RECURSIVE);
+		lyd_free_withsiblings(edit);
+		return nc_server_reply_err(nc_err(NC_ERR_LOCK_DENIED, lock_sid));
 	}
-	else if (!strcmp(nodeset->set.d[0]->schema->name, "candidate"))
+	
+	/* Targeted changes on the writable version, nothing else of the datastore is touched. */
+	struct lyd_node** root = writer.begin();
+	struct edit_log log;
+	edit_log_init(&log, root, error_option);
+	int rollback = edit_apply(&log, edit, default_op) && error_option != EDIT_CONTINUE_ON_ERROR;
+	
+	/* test-then-set and test-only : the touched subtrees must be valid. */
+	if(!rollback && test && edit_validate(&log))
 	{
-		if(target_node == g_node_candidate)
-			return nc_server_reply_ok();
+		struct nc_server_error* e = nc_err_libyang(ctx);
+		if(log.reply)
+			nc_server_reply_add_err(log.reply, e);
 		else
-			source_data = lyd_dup(g_node_candidate, LYD_DUP_OPT_RECURSIVE);
+			log.reply = nc_server_reply_err(e);
+		rollback = 1;
+	}
+	
+	if(rollback || test_only || !log.count)
+	{
+		edit_rollback(&log);
+		writer.abort();
+	}
+	else
+	{
+		/* Only the changed nodes are journaled. */
+		edit_journal(&log, target_ds);
+		writer.publish();
+		ds_notify(target_ds, &log, session);
 	}
-	else if (!strcmp(nodeset->set.d[0]->schema->name, "config"))
-	{	
+	edit_finish(&log);
+	
+	lyd_free_withsiblings(edit);
+	return log.reply ? log.reply : nc_server_reply_ok();
+}
+
+/* 
+ * Running becomes target, under its write guard : only the delta between them is applied,
+ * validated, journaled and sent as netconf-config-change. NULL on success, otherwise the
+ * error reply. The work follows the size of the delta, target is never copied as a whole.
+ */
+static struct nc_server_reply* rpc_running_apply(ds_write_guard* writer, struct lyd_node* target, struct nc_session* session, const char* name)
+{
+	struct lyd_node** running = writer->begin();
+	if(!*running && !target)
+	{
+		writer->abort();
+		return NULL;
+	}
+	struct lyd_difflist* diff = lyd_diff(*running, target, 0);
+	if(!diff)
+		return nc_server_reply_err(nc_err_libyang(ctx));
+	struct edit_log log;
+	edit_log_init(&log, running, EDIT_ROLLBACK_ON_ERROR);
+	int failed = edit_apply_diff(&log, diff);
+	lyd_free_diff(diff);
+	/* Only the top-level subtrees holding a change are validated, on a scratch copy. */
+	int invalid = !failed && log.count && edit_validate(&log);
+	
+	if(failed || invalid || !log.count)
+	{
+		edit_rollback(&log);
+		writer->abort();
+	}
+	else
+	{
+		LOGGER_RPC(LOGGER_LEVEL_INFO, nc_session_get_id(session), name, -1, "%d changes applied to running.", log.count);
+		edit_journal(&log, &g_ds_running);
+		writer->publish();
+		ds_notify(&g_ds_running, &log, session);
+	}
+	edit_finish(&log);
+	if(invalid)
+		return nc_server_reply_err(nc_err_libyang(ctx));
+	return failed ? log.reply : NULL;
+}
+
+struct nc_server_reply* rpc_callback_copy(struct lyd_node* rpc, struct nc_session *session)
+{
+	rpc_trace trace(rpc, session);
+	struct lyd_node* source_data = NULL;
+	struct ly_set* nodeset = NULL;
+	
+	/* Processing target argument */
+	struct datastore* target_ds = rpc_get_datastore(rpc, "/ietf-netconf:copy-config/target/*");
+	if(!target_ds)
+	{
+		LOGGER_RPC(LOGGER_LEVEL_WARNING, nc_session_get_id(session), rpc->schema->name, -1, "Unexpected <target>.");
+		return nc_server_reply_err(nc_err(NC_ERR_OP_NOT_SUPPORTED, NC_ERR_TYPE_PROT));
+	}
+	
+	/* Processing source argument, datastore sources are shared from a pinned snapshot. */
+	struct datastore* source_ds = rpc_get_datastore(rpc, "/ietf-netconf:copy-config/source/*");
+	if(!source_ds)
+	{
+		nodeset = lyd_find_path(rpc, "/ietf-netconf:copy-config/source/config");
+		if(!nodeset || !nodeset->number)
+		{
+			LOGGER_RPC(LOGGER_LEVEL_WARNING, nc_session_get_id(session), rpc->schema->name, -1, "Unexpected <source>.");
+			ly_set_free(nodeset);
+			return nc_server_reply_err(nc_err(NC_ERR_OP_NOT_SUPPORTED, NC_ERR_TYPE_PROT));
+		}
 		/* Get struct lyd_node_anydata */
 		struct lyd_node_anydata* anydata = (struct lyd_node_anydata*)nodeset->set.d[0];
 		
 		/* Reconstruct YANG Data Instance node, to get correct YANG Schema node */
+		ly_errno = LY_SUCCESS;
 		if(anydata -> value_type == LYD_ANYDATA_XML)
 			source_data = lyd_parse_xml(ctx, &anydata->value.xml, LYD_OPT_CONFIG);
-		
+		ly_set_free(nodeset);
+		/* An empty <config/> empties the target, an invalid one must not. */
+		if(!source_data && ly_errno != LY_SUCCESS)
+			return nc_server_reply_err(nc_err_libyang(ctx));
 	}
-	else
-		printf("[RPC Handler] <copy-config> Unexpected <source>.\n");	
-	ly_set_free(nodeset);
 	
-	
-	/* Merge Configuration */
-	lyd_merge(target_node, source_data, LYD_OPT_EXPLICIT);
-	
-	/* Synchronizing Configuration Files */
-	if(syncflag_running)
+	/* Exclusive writer until the guard goes out of scope. */
+	ds_write_guard writer(target_ds);
+	uint32_t lock_sid = writer.denied(nc_session_get_id(session));
+	if(lock_sid)
 	{
-		syncflag_running = 0;
-		lyd_print_path("./configs/userconfig.xml", g_node_running, LYD_XML, LYP_FORMAT);
-		pthread_mutex_unlock(&g_sidmutex_running);
+		lyd_free_withsiblings(source_data);
+		return nc_server_reply_err(nc_err(NC_ERR_LOCK_DENIED, lock_sid));
 	}
-	if(syncflag_candidate)
+	if(source_ds == target_ds)
+		return nc_server_reply_ok();
+	
+	if(target_ds == &g_ds_running)
 	{
-		syncflag_candidate = 0;
-		lyd_print_path("./configs/userconfig_candidate.xml", g_node_candidate, LYD_XML, LYP_FORMAT);
-		pthread_mutex_unlock(&g_sidmutex_candidate);
+		/* The rollback of a pending confirmed commit would silently undo the copy. */
+		if(confirm_pending())
+		{
+			lyd_free_withsiblings(source_data);
+			struct nc_server_error* e = nc_err(NC_ERR_IN_USE, NC_ERR_TYPE_PROT);
+			nc_err_set_msg(e, "[RPC Handler] A confirmed commit is pending, confirm or cancel it first.", "en");
+			return nc_server_reply_err(e);
+		}
+		/* Applied as a delta like <commit>, so running changes are journaled and notified. */
+		struct ds_snapshot* source = source_ds ? ds_pin(source_ds) : NULL;
+		struct nc_server_reply* reply = rpc_running_apply(&writer, source ? source->root : source_data, session, "copy-config");
+		if(source)
+			ds_unpin(source);
+		lyd_free_withsiblings(source_data);
+		return reply ? reply : nc_server_reply_ok();
 	}
 	
-	/* Use lyd_free_withsiblings here, 'cause additional info is added in config. */
-	lyd_free_withsiblings(source_data);
+	/* 
+	 * The source replaces the whole target, e.g. running saved to startup. Neither tree is
+	 * copied, the target borrows the source version until its next write.
+	 */
+	if(source_ds)
+		writer.share(ds_pin(source_ds));
+	else
+		writer.replace(source_data);
+	
+	/* Synchronizing Configuration Files, the new version is journaled by the persistence thread. */
+	persist_submit(target_ds, PERSIST_REPLACE, NULL, ds_pin(target_ds));
 	return nc_server_reply_ok();
 }
 
 struct nc_server_reply* rpc_callback_delete(struct lyd_node* rpc, struct nc_session *session)
 {
-	printf("<delete-config> RPC Received.\n");
+	rpc_trace trace(rpc, session);
+	
+	/* ietf-netconf only allows startup (and url), the candidate is reset by <discard-changes>. */
+	struct datastore* target_ds = rpc_get_datastore(rpc, "/ietf-netconf:delete-config/target/*");
+	if(target_ds != &g_ds_startup)
+	{
+		LOGGER_RPC(LOGGER_LEVEL_WARNING, nc_session_get_id(session), rpc->schema->name, -1, "Unexpected <target>.");
+		return nc_server_reply_err(nc_err(NC_ERR_OP_NOT_SUPPORTED, NC_ERR_TYPE_PROT));
+	}
 	
+	ds_write_guard writer(target_ds);
+	uint32_t lock_sid = writer.denied(nc_session_get_id(session));
+	if(lock_sid)
+		return nc_server_reply_err(nc_err(NC_ERR_LOCK_DENIED, lock_sid));
+	/* The empty version is published at once, the old tree is freed off this thread. */
+	writer.replace(NULL);
+	persist_submit(target_ds, PERSIST_REPLACE, NULL, NULL);
 	return nc_server_reply_ok();
 }
 
 struct nc_server_reply* rpc_callback_lock(struct lyd_node* rpc,struct nc_session *session)
 {
-	printf("<lock> RPC Received.\n");
+	rpc_trace trace(rpc, session);
 	
 	/* Processing target argument, check permission */
-	struct ly_set* nodeset = lyd_find_path(rpc, "/ietf-netconf:lock/target/*");
-	if (!strcmp(nodeset->set.d[0]->schema->name, "running"))
-	{
-		ly_set_free(nodeset);
-		
-		/* Lock the datastore sid mutex. */
-		pthread_mutex_lock(&g_sidmutex_running);
-		if(g_sid_running == 0)
-		{
-			g_sid_running = nc_session_get_id(session);
-			pthread_mutex_unlock(&g_sidmutex_running);
-			return nc_server_reply_ok();
-		}
-		else
-		{
-			pthread_mutex_unlock(&g_sidmutex_running);
-			return nc_server_reply_err(nc_err(NC_ERR_LOCK_DENIED, g_sid_running));
-		}
-	}
-	else if (!strcmp(nodeset->set.d[0]->schema->name, "candidate"))
+	struct datastore* ds = rpc_get_datastore(rpc, "/ietf-netconf:lock/target/*");
+	if(!ds)
 	{
-		ly_set_free(nodeset);
-		
-		/* Lock the datastore sid mutex. */
-		pthread_mutex_lock(&g_sidmutex_candidate);
-		if(g_sid_candidate == 0)
-		{
-			g_sid_candidate = nc_session_get_id(session);
-			pthread_mutex_unlock(&g_sidmutex_candidate);
-			return nc_server_reply_ok();
-		}
-		else
-		{
-			pthread_mutex_unlock(&g_sidmutex_candidate);
-			return nc_server_reply_err(nc_err(NC_ERR_LOCK_DENIED, g_sid_candidate));
-		}
+		LOGGER_RPC(LOGGER_LEVEL_WARNING, nc_session_get_id(session), rpc->schema->name, -1, "Unexpected <target>.");
+		return nc_server_reply_err(nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP));
 	}
-	else
-		printf("[RPC Handler] <lock> Unexpected <target>.\n");	
-	ly_set_free(nodeset);
-	return nc_server_reply_err(nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP));
+	
+	/* Lock ownership only, readers and writers are not blocked by it. */
+	uint32_t lock_sid = ds_lock(ds, nc_session_get_id(session));
+	if(lock_sid)
+		return nc_server_reply_err(nc_err(NC_ERR_LOCK_DENIED, lock_sid));
+	registry_lock_taken(registry_of(session), ds);
+	return nc_server_reply_ok();
 }
 
 struct nc_server_reply* rpc_callback_unlock(struct lyd_node* rpc,struct nc_session *session)
 {
-	printf("<unlock> RPC Received.\n");
+	rpc_trace trace(rpc, session);
 	
 	/* Processing target argument, check permission */
-	struct ly_set* nodeset = lyd_find_path(rpc, "/ietf-netconf:unlock/target/*");
-	if (!strcmp(nodeset->set.d[0]->schema->name, "running"))
+	struct datastore* ds = rpc_get_datastore(rpc, "/ietf-netconf:unlock/target/*");
+	if(!ds)
 	{
-		ly_set_free(nodeset);
-		pthread_mutex_lock(&g_sidmutex_running);
-		if(g_sid_running == nc_session_get_id(session))
-		{
-			g_sid_running = 0;
-			pthread_mutex_unlock(&g_sidmutex_running);
-			return nc_server_reply_ok();
-		}
-		else
-		{
-			struct nc_server_error* e;
-			if(!g_sid_running)
-			{
-				e = nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP);
-		    	nc_err_set_msg(e, "[RPC Handler] The <running> lock is not active.", "en");
-		    }
-		    else
-		    {
-		    	e = nc_err(NC_ERR_LOCK_DENIED, g_sid_running);
-		    }
-			pthread_mutex_unlock(&g_sidmutex_running);
-		    return nc_server_reply_err(e);
-		}
+		LOGGER_RPC(LOGGER_LEVEL_WARNING, nc_session_get_id(session), rpc->schema->name, -1, "Unexpected <target>.");
+		return nc_server_reply_err(nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP));
 	}
-	else if (!strcmp(nodeset->set.d[0]->schema->name, "candidate"))
+	
+	uint32_t lock_sid = 0;
+	if(!ds_unlock(ds, nc_session_get_id(session), &lock_sid))
 	{
-		ly_set_free(nodeset);
-		pthread_mutex_lock(&g_sidmutex_candidate);
-		if(g_sid_candidate == nc_session_get_id(session))
-		{
-			g_sid_candidate = 0;
-			pthread_mutex_unlock(&g_sidmutex_candidate);
-			return nc_server_reply_ok();
-		}
-		else
-		{
-			struct nc_server_error* e;
-			if(!g_sid_candidate)
-			{
-				e = nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP);
-		    	nc_err_set_msg(e, "[RPC Handler] The <candidate> lock is not active.", "en");
-		    }
-		    else
-		    {
-		    	e = nc_err(NC_ERR_LOCK_DENIED, g_sid_candidate);
-		    }
-			pthread_mutex_unlock(&g_sidmutex_candidate);
-		    return nc_server_reply_err(e);
-		}
+		registry_lock_dropped(registry_of(session), ds);
+		return nc_server_reply_ok();
+	}
+	
+	struct nc_server_error* e;
+	if(!lock_sid)
+	{
+		e = nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP);
+		nc_err_set_msg(e, "[RPC Handler] The datastore lock is not active.", "en");
 	}
 	else
-		printf("[RPC Handler] <lock> Unexpected <target>.\n");	
-	ly_set_free(nodeset);
-	return nc_server_reply_err(nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP));
+	{
+		e = nc_err(NC_ERR_LOCK_DENIED, lock_sid);
+	}
+	return nc_server_reply_err(e);
 }
 
 /* disconnect command.
@@ -302,15 +670,18 @@ struct nc_server_reply* rpc_callback_close(struct lyd_node* rpc, struct nc_sessi
 
 struct nc_server_reply* rpc_callback_kill(struct lyd_node* rpc, struct nc_session *session)
 {
+	rpc_trace trace(rpc, session);
 	struct ly_set* nodeset = lyd_find_path(rpc, "session-id");
 	if (!nodeset || (nodeset->number != 1) || (nodeset->set.d[0]->schema->nodetype != LYS_LEAF))
 	{
+		ly_set_free(nodeset);
         struct nc_server_error* e = nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP);
         nc_err_set_msg(e, "[RPC Handler] Invalid Argument.", "en");
         return nc_server_reply_err(e);
     }
 	
 	uint32_t target_sid = ((struct lyd_node_leaf_list*)nodeset->set.d[0])->value.uint32;
+	ly_set_free(nodeset);
     if (target_sid == nc_session_get_id(session))
     {
         struct nc_server_error* e = nc_err(NC_ERR_INVALID_VALUE, NC_ERR_TYPE_PROT);
@@ -318,14 +689,16 @@ struct nc_server_reply* rpc_callback_kill(struct lyd_node* rpc, struct nc_sessio
         return nc_server_reply_err(e);
     }
 	
-	struct nc_session* target_session = NULL;
-	for (int i = 0; (target_session = nc_ps_get_session(g_pollsession, i)); ++i)
-	{
-        if (nc_session_get_id(target_session) == target_sid)
-            break;
-    }
+	/* The target session must not be freed by another worker while it is marked. */
+	struct registry_session* target = registry_get(target_sid);
+	struct nc_session* target_session = target ? registry_lock(target) : NULL;
 	if (!target_session) 
 	{
+		if(target)
+		{
+			registry_unlock(target);
+			registry_put(target);
+		}
         struct nc_server_error* e = nc_err(NC_ERR_INVALID_VALUE, NC_ERR_TYPE_PROT);
         nc_err_set_msg(e, "Session with the specified \"session-id\" not found.", "en");
         return  nc_server_reply_err(e);
@@ -334,30 +707,132 @@ struct nc_server_reply* rpc_callback_kill(struct lyd_node* rpc, struct nc_sessio
 	nc_session_set_status(target_session, NC_STATUS_INVALID);
     nc_session_set_term_reason(target_session, NC_SESSION_TERM_KILLED);
     nc_session_set_killed_by(target_session, nc_session_get_id(session));
+	registry_unlock(target);
+	registry_put(target);
 	
     return nc_server_reply_ok();
 }
 
 struct nc_server_reply* rpc_callback_commit(struct lyd_node* rpc,struct nc_session *session)
 {
-	printf("<commit> RPC Received.\n");
-	pthread_mutex_lock(&g_sidmutex_running);
-	if(g_sid_running == 0)
+	rpc_trace trace(rpc, session);
+	uint32_t session_id = nc_session_get_id(session);
+	int confirmed = rpc_leaf_value(rpc, "/ietf-netconf:commit/confirmed") != NULL;
+	const char* value = rpc_leaf_value(rpc, "/ietf-netconf:commit/confirm-timeout");
+	uint32_t timeout = value ? strtoul(value, NULL, 10) : CONFIRM_TIMEOUT_DEFAULT;
+	const char* persist = rpc_leaf_value(rpc, "/ietf-netconf:commit/persist");
+	const char* persist_id = rpc_leaf_value(rpc, "/ietf-netconf:commit/persist-id");
+	
+	ds_write_guard writer(&g_ds_running);
+	uint32_t lock_sid = writer.denied(session_id);
+	if(lock_sid)
+	    return nc_server_reply_err(nc_err(NC_ERR_LOCK_DENIED, lock_sid));
+	struct nc_server_error* e = confirm_check(session_id, persist_id);
+	if(e)
+		return nc_server_reply_err(e);
+	
+	ds_read_guard candidate(&g_ds_candidate);
+	
+	/* 
+	 * Only a confirmed commit keeps the replaced version for its rollback, and only the first one,
+	 * a retained version is copied by the next write instead of being written in place.
+	 */
+	int pending = confirm_pending();
+	uint64_t checkpoint = (confirmed && !pending) ? ds_checkpoint(&g_ds_running) : 0;
+	
+	/* Running becomes the candidate. */
+	struct nc_server_reply* reply = rpc_running_apply(&writer, candidate.root(), session, "commit");
+	if(reply)
+		return reply;
+	
+	if(confirmed)
+		confirm_start(checkpoint, session_id, persist, timeout);
+	else if(pending)
+		confirm_accept();
+	return nc_server_reply_ok();
+}
+
+struct nc_server_reply* rpc_callback_discard(struct lyd_node* rpc,struct nc_session *session)
+{
+	rpc_trace trace(rpc, session);
+	
+	ds_write_guard writer(&g_ds_candidate);
+	uint32_t lock_sid = writer.denied(nc_session_get_id(session));
+	if(lock_sid)
+		return nc_server_reply_err(nc_err(NC_ERR_LOCK_DENIED, lock_sid));
+	
+	/* The candidate shares the running version, the discarded changes are freed off this thread. */
+	writer.share(ds_pin(&g_ds_running));
+	persist_submit(&g_ds_candidate, PERSIST_REPLACE, NULL, ds_pin(&g_ds_candidate));
+	return nc_server_reply_ok();
+}
+
+struct nc_server_reply* rpc_callback_cancel_commit(struct lyd_node* rpc,struct nc_session *session)
+{
+	rpc_trace trace(rpc, session);
+	const char* persist_id = rpc_leaf_value(rpc, "/ietf-netconf:cancel-commit/persist-id");
+	
+	ds_write_guard writer(&g_ds_running);
+	struct nc_server_error* e = NULL;
+	if(!confirm_pending())
 	{
-		lyd_merge(g_node_running, g_node_candidate, LYD_OPT_EXPLICIT);
-		lyd_print_path("./configs/userconfig.xml", g_node_running, LYD_XML, LYP_FORMAT);
-		pthread_mutex_unlock(&g_sidmutex_running);
-		return nc_server_reply_ok();
+		e = nc_err(NC_ERR_OP_FAILED, NC_ERR_TYPE_APP);
+		nc_err_set_msg(e, "[RPC Handler] No confirmed commit is pending.", "en");
 	}
 	else
 	{
-		pthread_mutex_unlock(&g_sidmutex_running);
-	    return nc_server_reply_err(nc_err(NC_ERR_LOCK_DENIED, g_sid_running));
+		e = confirm_check(nc_session_get_id(session), persist_id);
 	}
+	if(e)
+		return nc_server_reply_err(e);
+	
+	/* The checkpoint is written back as a new version, journaled and notified. */
+	confirm_cancel();
+	return nc_server_reply_ok();
 }
 
 struct nc_server_reply* rpc_callback_subscribe(struct lyd_node* rpc,struct nc_session *session)
 {
-	printf("<create-subscription> RPC Received.\n");
+	rpc_trace trace(rpc, session);
+	struct nc_server_error* e;
+	const char* stream = rpc_leaf_value(rpc, "/notifications:create-subscription/stream");
+	if(!stream)
+		stream = NOTIF_STREAM_NETCONF;
+	if(strcmp(stream, NOTIF_STREAM_NETCONF))
+	{
+		e = nc_err(NC_ERR_INVALID_VALUE, NC_ERR_TYPE_PROT);
+		nc_err_set_msg(e, "[RPC Handler] Unknown notification stream.", "en");
+		return nc_server_reply_err(e);
+	}
+	
+	/* Replay, RFC 5277 2.1.1 */
+	const char* value = rpc_leaf_value(rpc, "/notifications:create-subscription/startTime");
+	time_t start_time = value ? nc_datetime2time(value) : 0;
+	value = rpc_leaf_value(rpc, "/notifications:create-subscription/stopTime");
+	time_t stop_time = value ? nc_datetime2time(value) : 0;
+	if(start_time && !replay_enabled())
+	{
+		e = nc_err(NC_ERR_OP_NOT_SUPPORTED, NC_ERR_TYPE_PROT);
+		nc_err_set_msg(e, "[RPC Handler] Notification replay is disabled.", "en");
+		return nc_server_reply_err(e);
+	}
+	if(start_time > time(NULL))
+		return nc_server_reply_err(nc_err(NC_ERR_BAD_ELEM, NC_ERR_TYPE_PROT, "startTime"));
+	if(stop_time && (!start_time || stop_time < start_time))
+		return nc_server_reply_err(nc_err(NC_ERR_BAD_ELEM, NC_ERR_TYPE_PROT, "stopTime"));
+	
+	struct rpc_filter filter;
+	e = filter_parse(ctx, rpc, &filter);
+	if(e)
+	{
+		filter_free(&filter);
+		return nc_server_reply_err(e);
+	}
+	if(notif_subscribe(session, stream, &filter, start_time, stop_time))
+	{
+		e = nc_err(NC_ERR_IN_USE, NC_ERR_TYPE_PROT);
+		nc_err_set_msg(e, "[RPC Handler] The session is subscribed already.", "en");
+		return nc_server_reply_err(e);
+	}
 	return nc_server_reply_ok();
 }
@@ -3,6 +3,10 @@
 /* Function Prototypes of Mandatory RPC Processsing Callbacks */
 /* <get> and <get-config> operation */
 struct nc_server_reply* rpc_callback_get(struct lyd_node* rpc, struct nc_session *session);
+/* Called by a worker thread once nc_ps_poll() returned, the reply of its last <get> has been sent. */
+void rpc_reply_sent(void);
+/* <get-schema> operation, resolved against ietf-netconf-monitoring /netconf-state/schemas */
+struct nc_server_reply* rpc_callback_get_schema(struct lyd_node* rpc, struct nc_session *session);
 
 /* <edit-config> , <copy-config> and <delete-config> operation */
 /* Co-operates with Filewatch Subsystem. */
@@ -22,6 +26,10 @@ struct nc_server_reply* rpc_callback_kill(struct lyd_node* rpc, struct nc_sessio
 /* Function Prototypes of Optional RPC Processsing Callbacks */
 /* <commit> operation, needs CANDIDATE feature */
 struct nc_server_reply* rpc_callback_commit(struct lyd_node* rpc, struct nc_session *session);
+/* <discard-changes> operation, needs CANDIDATE feature */
+struct nc_server_reply* rpc_callback_discard(struct lyd_node* rpc, struct nc_session *session);
+/* <cancel-commit> operation, needs CONFIRMED-COMMIT feature */
+struct nc_server_reply* rpc_callback_cancel_commit(struct lyd_node* rpc, struct nc_session *session);
 
 struct nc_server_reply* rpc_callback_subscribe(struct lyd_node* rpc,struct nc_session *session);
 #endif
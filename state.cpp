@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <nc_server.h>
+#include "datastore.h"
+#include "filter.h"
+#include "state.h"
+#include "logger.h"
+
+/* One registered provider, its cache is guarded by state_mutex. */
+struct state_provider
+{
+	const char* top;
+	int ttl;
+	state_provider_cb cb;
+	void* arg;
+	struct ds_snapshot* cache;
+	/* Monotonic millisec after which cache is rebuilt. */
+	uint64_t expires;
+	/* Queued or being rebuilt, collectors wait on state_done_cond. */
+	int refreshing;
+	uint64_t builds;
+	struct state_provider* next;
+};
+
+static struct state_provider state_providers[STATE_PROVIDERS_MAX];
+static int state_provider_count = 0;
+
+static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* FIFO of providers to refresh, drained by the State Threads. */
+static pthread_cond_t state_job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t state_done_cond = PTHREAD_COND_INITIALIZER;
+static struct state_provider* state_head = NULL;
+static struct state_provider* state_tail = NULL;
+static int state_stop = 0;
+
+static uint64_t state_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int state_register(const char* top, int ttl, state_provider_cb cb, void* arg)
+{
+	if(state_provider_count == STATE_PROVIDERS_MAX)
+	{
+		LOGGER_ERROR("State Thread", "Too many state providers.");
+		return 1;
+	}
+	struct state_provider* provider = &state_providers[state_provider_count++];
+	provider->top = top;
+	provider->ttl = ttl;
+	provider->cb = cb;
+	provider->arg = arg;
+	provider->cache = NULL;
+	provider->expires = 0;
+	provider->refreshing = 0;
+	provider->builds = 0;
+	provider->next = NULL;
+	return 0;
+}
+
+int state_collect(const struct rpc_filter* filter, struct ds_snapshot** snaps)
+{
+	struct state_provider* selected[STATE_PROVIDERS_MAX];
+	int count = 0;
+	for(int i = 0; i < state_provider_count; i++)
+		if(filter_selects(filter, state_providers[i].top))
+			selected[count++] = &state_providers[i];
+	if(!count)
+		return 0;
+	
+	pthread_mutex_lock(&state_mutex);
+	/* Queue every expired provider first, so they are all rebuilt at once. */
+	uint64_t now = state_now();
+	int queued = 0;
+	for(int i = 0; i < count; i++)
+	{
+		struct state_provider* provider = selected[i];
+		if(provider->refreshing || (provider->cache && now < provider->expires))
+			continue;
+		provider->refreshing = 1;
+		provider->next = NULL;
+		if(state_tail)
+			state_tail->next = provider;
+		else
+			state_head = provider;
+		state_tail = provider;
+		queued++;
+	}
+	if(queued)
+		pthread_cond_broadcast(&state_job_cond);
+	
+	int pinned = 0;
+	for(int i = 0; i < count; i++)
+	{
+		struct state_provider* provider = selected[i];
+		/* Refreshed by another collector or by us, the result is shared either way. */
+		while(provider->refreshing && !state_stop)
+			pthread_cond_wait(&state_done_cond, &state_mutex);
+		if(provider->cache && provider->cache->root)
+		{
+			provider->cache->refcount++;
+			snaps[pinned++] = provider->cache;
+		}
+	}
+	pthread_mutex_unlock(&state_mutex);
+	return pinned;
+}
+
+void* state_thread_entry(void* arg)
+{
+	LOGGER_INFO("State Thread", "Started.");
+	pthread_mutex_lock(&state_mutex);
+	while(1)
+	{
+		while(!state_head && !state_stop)
+			pthread_cond_wait(&state_job_cond, &state_mutex);
+		if(!state_head)
+			break;
+		struct state_provider* provider = state_head;
+		state_head = provider->next;
+		if(!state_head)
+			state_tail = NULL;
+		uint64_t version = ++provider->builds;
+		pthread_mutex_unlock(&state_mutex);
+	
+		/* Built off the lock, other providers are rebuilt by the other State Threads. */
+		struct ds_snapshot* snap = ds_snapshot_new(provider->cb(provider->arg), version);
+	
+		pthread_mutex_lock(&state_mutex);
+		struct ds_snapshot* old = provider->cache;
+		provider->cache = snap;
+		/* The TTL runs from the end of the build, a slow provider is not rebuilt back to back. */
+		provider->expires = state_now() + provider->ttl;
+		provider->refreshing = 0;
+		pthread_cond_broadcast(&state_done_cond);
+		pthread_mutex_unlock(&state_mutex);
+	
+		/* Collectors still holding the previous tree free it with their last unpin. */
+		if(old)
+			ds_unpin(old);
+		pthread_mutex_lock(&state_mutex);
+	}
+	pthread_mutex_unlock(&state_mutex);
+	nc_thread_destroy();
+	return NULL;
+}
+
+void state_shutdown(void)
+{
+	pthread_mutex_lock(&state_mutex);
+	state_stop = 1;
+	pthread_cond_broadcast(&state_job_cond);
+	pthread_cond_broadcast(&state_done_cond);
+	pthread_mutex_unlock(&state_mutex);
+}
+
+void state_destroy(void)
+{
+	for(int i = 0; i < state_provider_count; i++)
+	{
+		if(state_providers[i].cache)
+			ds_unpin(state_providers[i].cache);
+		state_providers[i].cache = NULL;
+	}
+}
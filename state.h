@@ -0,0 +1,37 @@
+#ifndef STATE_H
+#define STATE_H
+
+/*
+ * Operational State Providers : a provider builds one top-level subtree of the state data
+ * on demand. Its last tree is cached as a snapshot for ttl milliseconds, so however many
+ * clients poll it, it is built at most once per ttl. Expired providers selected by a <get>
+ * are refreshed in parallel by the State Threads, the static state tree is kept alongside.
+ */
+
+/* Build the subtree of the provider, returns its top-level node or NULL. */
+typedef struct lyd_node* (*state_provider_cb)(void* arg);
+
+const int STATE_PROVIDERS_MAX = 16;
+/* Number of State Threads refreshing providers. */
+const int STATE_WORKERS = 4;
+
+/*
+ * Register a provider of the top-level node top ("module:name"), before the State Threads
+ * are started. The static state tree should not hold top as well. Returns non-zero when full.
+ */
+int state_register(const char* top, int ttl, state_provider_cb cb, void* arg);
+
+/* State Thread Entry Prototype */
+void* state_thread_entry(void* arg);
+/* Let every State Thread exit, then state_destroy() once they are joined. */
+void state_shutdown(void);
+void state_destroy(void);
+
+/*
+ * Pin into snaps (STATE_PROVIDERS_MAX entries) the trees of every provider filter may select,
+ * after waiting for the expired ones to be refreshed. Returns the number pinned, release each
+ * one with ds_unpin().
+ */
+int state_collect(const struct rpc_filter* filter, struct ds_snapshot** snaps);
+
+#endif
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include <nc_server.h>
+#include "../datastore.h"
+#include "../metrics.h"
+
+/*
+ * Datastore Stress Test : concurrent readers pinning snapshots while writers publish
+ * increments of /userconfig:testnode/number through ds_write_guard, with checkpoints
+ * forcing copy-on-write. Every reader checks that the tree it pinned never changes
+ * under it and that versions and values never go backwards, the final value must
+ * count every write. Run from the repository root, "make stress".
+ */
+
+const char* STRESS_SEARCH_PATH = "./modules/";
+const int STRESS_READERS_DEFAULT = 8;
+const int STRESS_WRITERS_DEFAULT = 4;
+const int STRESS_WRITES_DEFAULT = 20000;
+/* A checkpoint every STRESS_CHECKPOINT_EVERY writes, the next write copies the tree. */
+const int STRESS_CHECKPOINT_EVERY = 64;
+
+static struct ly_ctx* stress_ctx = NULL;
+static struct datastore stress_ds;
+static int stress_writes = STRESS_WRITES_DEFAULT;
+static std::atomic<int> stress_stop(0);
+static std::atomic<uint64_t> stress_reads(0);
+static std::atomic<uint64_t> stress_violations(0);
+
+static struct lyd_node_leaf_list* stress_leaf(struct lyd_node* root)
+{
+	struct ly_set* nodeset = root ? lyd_find_path(root, "/userconfig:testnode/number") : NULL;
+	struct lyd_node_leaf_list* leaf = (nodeset && nodeset->number) ? (struct lyd_node_leaf_list*)nodeset->set.d[0] : NULL;
+	ly_set_free(nodeset);
+	return leaf;
+}
+
+static long stress_value(struct lyd_node* root)
+{
+	struct lyd_node_leaf_list* leaf = stress_leaf(root);
+	return leaf ? strtol(leaf->value_str, NULL, 10) : -1;
+}
+
+static void stress_violation(const char* what, long a, long b)
+{
+	if(stress_violations++ < 10)
+		fprintf(stderr, "[STRESS] %s (%ld, %ld).\n", what, a, b);
+}
+
+void* stress_reader_entry(void* arg)
+{
+	uint64_t last_version = 0;
+	long last_value = -1;
+	uint64_t reads = 0;
+	while(!stress_stop)
+	{
+		struct ds_snapshot* snap = ds_pin(&stress_ds);
+		long value = stress_value(snap->root);
+		/* Give the writers a chance to touch the pinned tree. */
+		sched_yield();
+		long again = stress_value(snap->root);
+		if(again != value)
+			stress_violation("Pinned snapshot modified", value, again);
+		if(snap->version < last_version)
+			stress_violation("Version went backwards", (long)last_version, (long)snap->version);
+		if(value < last_value)
+			stress_violation("Value went backwards", last_value, value);
+		last_version = snap->version;
+		last_value = value;
+		ds_unpin(snap);
+		reads++;
+	}
+	stress_reads += reads;
+	return NULL;
+}
+
+void* stress_writer_entry(void* arg)
+{
+	long writer_id = (long)arg;
+	for(int i = 0; i < stress_writes; i++)
+	{
+		ds_write_guard writer(&stress_ds);
+		struct lyd_node** root = writer.begin();
+		struct lyd_node_leaf_list* leaf = stress_leaf(*root);
+		if(!leaf)
+		{
+			stress_violation("Leaf missing in the writable tree", writer_id, i);
+			return NULL;
+		}
+		char value[32];
+		snprintf(value, sizeof(value), "%ld", strtol(leaf->value_str, NULL, 10) + 1);
+		if(lyd_change_leaf(leaf, value) < 0)
+		{
+			stress_violation("lyd_change_leaf() failed", writer_id, i);
+			return NULL;
+		}
+		writer.publish();
+		if(!(i % STRESS_CHECKPOINT_EVERY))
+			ds_checkpoint(&stress_ds);
+	}
+	return NULL;
+}
+
+int main(int argc, char** argv)
+{
+	int readers = STRESS_READERS_DEFAULT;
+	int writers = STRESS_WRITERS_DEFAULT;
+	int opt;
+	while((opt = getopt(argc, argv, "r:w:n:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'r':
+				readers = atoi(optarg);
+				break;
+			case 'w':
+				writers = atoi(optarg);
+				break;
+			case 'n':
+				stress_writes = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-r readers] [-w writers] [-n writes per writer]\n", argv[0]);
+				return 2;
+		}
+	}
+	if(readers < 1 || writers < 1 || stress_writes < 1)
+	{
+		fprintf(stderr, "[STRESS] Readers, writers and writes must be positive.\n");
+		return 2;
+	}
+	
+	stress_ctx = ly_ctx_new(STRESS_SEARCH_PATH, LY_CTX_TRUSTED);
+	if(!stress_ctx || !ly_ctx_load_module(stress_ctx, "userconfig", NULL))
+	{
+		fprintf(stderr, "[STRESS] Failed to load userconfig from %s.\n", STRESS_SEARCH_PATH);
+		return 2;
+	}
+	struct lyd_node* root = lyd_new_path(NULL, stress_ctx, "/userconfig:testnode/number", (void*)"0", LYD_ANYDATA_CONSTSTRING, 0);
+	ds_init(&stress_ds, "stress", root);
+	
+	pthread_t reclaim_tid;
+	pthread_create(&reclaim_tid, NULL, ds_reclaim_thread_entry, NULL);
+	pthread_t* reader_tids = new pthread_t[readers];
+	pthread_t* writer_tids = new pthread_t[writers];
+	uint64_t start = metrics_now();
+	for(long i = 0; i < readers; i++)
+		pthread_create(&reader_tids[i], NULL, stress_reader_entry, (void*)i);
+	for(long i = 0; i < writers; i++)
+		pthread_create(&writer_tids[i], NULL, stress_writer_entry, (void*)i);
+	
+	for(int i = 0; i < writers; i++)
+		pthread_join(writer_tids[i], NULL);
+	stress_stop = 1;
+	for(int i = 0; i < readers; i++)
+		pthread_join(reader_tids[i], NULL);
+	double elapsed = (metrics_now() - start) / 1e6;
+	
+	struct ds_snapshot* snap = ds_pin(&stress_ds);
+	long expected = (long)writers * stress_writes;
+	long value = stress_value(snap->root);
+	if(value != expected)
+		stress_violation("Writes lost", expected, value);
+	ds_unpin(snap);
+	/* What the readers paid for in-place writes, and the writers for pinned versions. */
+	uint64_t pin_waits = stress_ds.pin_waits;
+	uint64_t pin_wait_usec = stress_ds.pin_wait_usec;
+	uint64_t copies = stress_ds.copies;
+	
+	ds_destroy(&stress_ds);
+	ds_reclaim_shutdown();
+	pthread_join(reclaim_tid, NULL);
+	ly_ctx_destroy(stress_ctx, NULL);
+	delete[] reader_tids;
+	delete[] writer_tids;
+	
+	printf("[STRESS] %d readers, %d writers : %ld writes, %llu reads in %.2f s, %llu violations.\n", readers, writers, expected,
+		(unsigned long long)stress_reads.load(), elapsed, (unsigned long long)stress_violations.load());
+	printf("[STRESS] %llu pins waited for an in-place write, %.3f ms on average, %llu writes copied the tree.\n",
+		(unsigned long long)pin_waits, pin_waits ? pin_wait_usec / 1e3 / pin_waits : 0.0, (unsigned long long)copies);
+	return stress_violations ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nc_server.h>
+#include "../edit_config.h"
+
+/*
+ * Edit Apply Check : <edit-config> trees applied by edit_apply() to a journal-test tree, each
+ * result must equal its expected tree. With default-operation none, leaves and leaf-lists
+ * without an operation only name nodes and must leave the target untouched.
+ * Run from the repository root, "make check".
+ */
+
+const char* EDIT_SEARCH_PATH = "./tests/modules/";
+/* ietf-netconf, for the operation attribute. */
+const char* EDIT_NETCONF_SEARCH_PATH = "./modules/";
+
+struct edit_case
+{
+	const char* name;
+	enum edit_op default_op;
+	const char* edit;
+	const char* expected;
+};
+
+#define EDIT_NC "xmlns:nc=\"urn:ietf:params:xml:ns:netconf:base:1.0\""
+#define EDIT_ENTRY(name, value) "<entry><name>" name "</name><value>" value "</value></entry>"
+#define EDIT_TREE(content) "<ordered xmlns=\"urn:journal-test\" " EDIT_NC ">" content "</ordered>"
+
+static const char* EDIT_INITIAL = EDIT_TREE(EDIT_ENTRY("a", "1") EDIT_ENTRY("b", "2") "<tag>x</tag>");
+
+static const struct edit_case EDIT_CASES[] =
+{
+	{ "none, plain leaf", EDIT_OP_NONE, EDIT_TREE(EDIT_ENTRY("a", "9")), EDIT_INITIAL },
+	{ "none, plain leaf of a missing entry", EDIT_OP_NONE, EDIT_TREE(EDIT_ENTRY("c", "3")), EDIT_INITIAL },
+	{ "none, plain leaf-list", EDIT_OP_NONE, EDIT_TREE("<tag>x</tag><tag>y</tag>"), EDIT_INITIAL },
+	{ "none, merge below", EDIT_OP_NONE, EDIT_TREE("<entry><name>a</name><value nc:operation=\"merge\">9</value></entry>"),
+		EDIT_TREE(EDIT_ENTRY("a", "9") EDIT_ENTRY("b", "2") "<tag>x</tag>") },
+	{ "merge, plain leaf", EDIT_OP_MERGE, EDIT_TREE(EDIT_ENTRY("b", "7")),
+		EDIT_TREE(EDIT_ENTRY("a", "1") EDIT_ENTRY("b", "7") "<tag>x</tag>") },
+};
+
+/* Non-zero when the trees differ, in content or in the order of user ordered instances. */
+static int edit_differs(struct lyd_node* first, struct lyd_node* second)
+{
+	if(!first || !second)
+		return first != second;
+	struct lyd_difflist* diff = lyd_diff(first, second, 0);
+	if(!diff)
+		return 1;
+	int differs = diff->type[0] != LYD_DIFF_END;
+	lyd_free_diff(diff);
+	return differs;
+}
+
+int main(int argc, char** argv)
+{
+	struct ly_ctx* ctx = ly_ctx_new(EDIT_SEARCH_PATH, LY_CTX_TRUSTED);
+	if(!ctx || ly_ctx_set_searchdir(ctx, EDIT_NETCONF_SEARCH_PATH)
+		|| !ly_ctx_load_module(ctx, "ietf-netconf", NULL) || !ly_ctx_load_module(ctx, "journal-test", NULL))
+	{
+		fprintf(stderr, "[EDIT] Failed to load journal-test and ietf-netconf.\n");
+		return 2;
+	}
+	
+	int failures = 0;
+	for(unsigned int i = 0; i < sizeof(EDIT_CASES) / sizeof(EDIT_CASES[0]); i++)
+	{
+		const struct edit_case* test = &EDIT_CASES[i];
+		struct lyd_node* root = lyd_parse_mem(ctx, EDIT_INITIAL, LYD_XML, LYD_OPT_CONFIG);
+		struct lyd_node* edit = lyd_parse_mem(ctx, test->edit, LYD_XML, LYD_OPT_EDIT | LYD_OPT_STRICT);
+		struct lyd_node* expected = lyd_parse_mem(ctx, test->expected, LYD_XML, LYD_OPT_CONFIG);
+		const char* failure = NULL;
+		if(!root || !edit || !expected)
+			failure = "trees do not parse";
+	
+		struct edit_log log;
+		edit_log_init(&log, &root, EDIT_ROLLBACK_ON_ERROR);
+		if(!failure && edit_apply(&log, edit, test->default_op))
+			failure = "edit rejected";
+		else if(!failure && edit_differs(root, expected))
+			failure = "result differs from the expected tree";
+		if(log.reply)
+			nc_server_reply_free(log.reply);
+		edit_finish(&log);
+	
+		printf("[EDIT] %-36s %s%s\n", test->name, failure ? "FAILED, " : "ok", failure ? failure : "");
+		failures += failure != NULL;
+		lyd_free_withsiblings(root);
+		lyd_free_withsiblings(edit);
+		lyd_free_withsiblings(expected);
+	}
+	
+	ly_ctx_destroy(ctx, NULL);
+	return failures ? 1 : 0;
+}
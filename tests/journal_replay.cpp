@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <nc_server.h>
+#include "../datastore.h"
+#include "../persist.h"
+#include "../edit_config.h"
+
+/*
+ * Journal Replay Check : every case is committed to a persisted datastore the way <commit>
+ * does it, lyd_diff() against the target tree applied by edit_apply_diff() and journaled by
+ * edit_journal(). The journal is then replayed onto the XML file like at boot, and both
+ * the live tree and the replayed one must equal the target, user ordered entries included.
+ * Run from the repository root, "make check".
+ */
+
+const char* JOURNAL_SEARCH_PATH = "./tests/modules/";
+
+struct journal_case
+{
+	const char* name;
+	const char* xml;
+};
+
+#define JOURNAL_ENTRY(name, value) "<entry><name>" name "</name><value>" value "</value></entry>"
+#define JOURNAL_TREE(content) "<ordered xmlns=\"urn:journal-test\">" content "</ordered>"
+
+static const char* JOURNAL_INITIAL = JOURNAL_TREE(JOURNAL_ENTRY("a", "1") JOURNAL_ENTRY("b", "2") JOURNAL_ENTRY("c", "3")
+	JOURNAL_ENTRY("d", "4") "<tag>x</tag><tag>y</tag><tag>z</tag>");
+
+static const struct journal_case JOURNAL_CASES[] =
+{
+	{ "reorder", JOURNAL_TREE(JOURNAL_ENTRY("d", "4") JOURNAL_ENTRY("a", "1") JOURNAL_ENTRY("c", "3")
+		JOURNAL_ENTRY("b", "2") "<tag>x</tag><tag>y</tag><tag>z</tag>") },
+	{ "move to the end", JOURNAL_TREE(JOURNAL_ENTRY("a", "1") JOURNAL_ENTRY("c", "3") JOURNAL_ENTRY("b", "2")
+		JOURNAL_ENTRY("d", "4") "<tag>x</tag><tag>y</tag><tag>z</tag>") },
+	{ "reorder and change", JOURNAL_TREE(JOURNAL_ENTRY("b", "20") JOURNAL_ENTRY("a", "1") JOURNAL_ENTRY("c", "3")
+		JOURNAL_ENTRY("d", "4") "<tag>x</tag><tag>y</tag><tag>z</tag>") },
+	{ "leaf-list reorder", JOURNAL_TREE(JOURNAL_ENTRY("b", "20") JOURNAL_ENTRY("a", "1") JOURNAL_ENTRY("c", "3")
+		JOURNAL_ENTRY("d", "4") "<tag>z</tag><tag>x</tag><tag>y</tag>") },
+	{ "delete, create and reorder", JOURNAL_TREE(JOURNAL_ENTRY("c", "3") JOURNAL_ENTRY("a", "1") JOURNAL_ENTRY("e", "5")
+		"<tag>y</tag><tag>z</tag><tag>w</tag>") },
+	{ "insert in the middle", JOURNAL_TREE(JOURNAL_ENTRY("c", "3") JOURNAL_ENTRY("x", "9") JOURNAL_ENTRY("a", "1")
+		JOURNAL_ENTRY("e", "5") "<tag>y</tag><tag>v</tag><tag>z</tag><tag>w</tag>") },
+	{ "insert at the front", JOURNAL_TREE(JOURNAL_ENTRY("f", "6") JOURNAL_ENTRY("c", "3") JOURNAL_ENTRY("x", "9")
+		JOURNAL_ENTRY("a", "1") JOURNAL_ENTRY("e", "5") "<tag>u</tag><tag>y</tag><tag>v</tag><tag>z</tag><tag>w</tag>") },
+};
+
+static struct datastore journal_ds;
+
+/* Non-zero when the trees differ, in content or in the order of user ordered instances. */
+static int journal_differs(struct lyd_node* first, struct lyd_node* second)
+{
+	if(!first || !second)
+		return first != second;
+	struct lyd_difflist* diff = lyd_diff(first, second, 0);
+	if(!diff)
+		return 1;
+	int differs = diff->type[0] != LYD_DIFF_END;
+	lyd_free_diff(diff);
+	return differs;
+}
+
+/* Commit target into journal_ds, as rpc_callback_commit() does for the candidate. */
+static int journal_commit(struct lyd_node* target)
+{
+	ds_write_guard writer(&journal_ds);
+	struct lyd_node** root = writer.begin();
+	struct lyd_difflist* diff = lyd_diff(*root, target, 0);
+	if(!diff)
+		return 1;
+	struct edit_log log;
+	edit_log_init(&log, root, EDIT_ROLLBACK_ON_ERROR);
+	int failed = edit_apply_diff(&log, diff);
+	lyd_free_diff(diff);
+	if(failed)
+	{
+		edit_rollback(&log);
+		writer.abort();
+	}
+	else
+	{
+		edit_journal(&log, &journal_ds);
+		writer.publish();
+	}
+	edit_finish(&log);
+	if(log.reply)
+		nc_server_reply_free(log.reply);
+	return failed;
+}
+
+int main(int argc, char** argv)
+{
+	struct ly_ctx* ctx = ly_ctx_new(JOURNAL_SEARCH_PATH, LY_CTX_TRUSTED);
+	if(!ctx || !ly_ctx_load_module(ctx, "journal-test", NULL))
+	{
+		fprintf(stderr, "[JOURNAL] Failed to load journal-test from %s.\n", JOURNAL_SEARCH_PATH);
+		return 2;
+	}
+	char dir[] = "/tmp/journal_replayXXXXXX";
+	if(!mkdtemp(dir))
+	{
+		fprintf(stderr, "[JOURNAL] Failed to create a temporary directory.\n");
+		return 2;
+	}
+	char path[PATH_MAX], journal_path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/ordered.xml", dir);
+	snprintf(journal_path, sizeof(journal_path), "%s.journal", path);
+	
+	/* The boot snapshot, everything afterwards only reaches the journal. */
+	struct lyd_node* root = lyd_parse_mem(ctx, JOURNAL_INITIAL, LYD_XML, LYD_OPT_CONFIG);
+	if(!root || lyd_print_path(path, root, LYD_XML, LYP_FORMAT | LYP_WITHSIBLINGS))
+	{
+		fprintf(stderr, "[JOURNAL] Failed to write %s.\n", path);
+		return 2;
+	}
+	g_persist_lyb = 0;
+	ds_init(&journal_ds, "journal", root);
+	persist_attach(&journal_ds, path);
+	pthread_t persist_tid;
+	pthread_create(&persist_tid, NULL, persist_thread_entry, NULL);
+	
+	int failures = 0;
+	for(unsigned int i = 0; i < sizeof(JOURNAL_CASES) / sizeof(JOURNAL_CASES[0]); i++)
+	{
+		const struct journal_case* test = &JOURNAL_CASES[i];
+		struct lyd_node* target = lyd_parse_mem(ctx, test->xml, LYD_XML, LYD_OPT_CONFIG);
+		const char* failure = NULL;
+		if(!target)
+			failure = "target does not parse";
+		else if(journal_commit(target))
+			failure = "diff not applied";
+	
+		/* Replayed like at boot : the XML file, then every record journaled so far. */
+		persist_sync();
+		struct lyd_node* replayed = NULL;
+		if(!failure && persist_load(ctx, path, LYD_OPT_CONFIG, &replayed))
+			failure = "snapshot does not load";
+		if(!failure)
+			persist_replay(ctx, path, &replayed);
+	
+		struct ds_snapshot* snap = ds_pin(&journal_ds);
+		if(!failure && journal_differs(snap->root, target))
+			failure = "live tree differs from the target";
+		else if(!failure && journal_differs(replayed, target))
+			failure = "replayed journal differs from the target";
+		ds_unpin(snap);
+	
+		printf("[JOURNAL] %-28s %s%s\n", test->name, failure ? "FAILED, " : "ok", failure ? failure : "");
+		failures += failure != NULL;
+		lyd_free_withsiblings(replayed);
+		lyd_free_withsiblings(target);
+	}
+	
+	persist_shutdown();
+	pthread_join(persist_tid, NULL);
+	ds_destroy(&journal_ds);
+	ly_ctx_destroy(ctx, NULL);
+	unlink(journal_path);
+	unlink(path);
+	rmdir(dir);
+	return failures ? 1 : 0;
+}
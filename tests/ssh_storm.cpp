@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <atomic>
+#include <nc_client.h>
+#include "../metrics.h"
+
+/*
+ * SSH Connection Storm Benchmark : what the host keys cost a reconnect storm. libnetconf2 1.x
+ * only hands host keys to libssh by path, so libssh reads and parses the key file on every
+ * handshake. First each host key of -H is parsed -i times the way libssh does it, then -c
+ * clients open and close -n password authenticated NETCONF sessions each against the running
+ * server, as fast as they can. Reports the parse cost per key, the handshakes per second and
+ * their latency percentiles. Run from the repository root against a started server,
+ * "make bench BENCH_ARGS='-u user -p password'".
+ */
+
+const char* STORM_SEARCH_PATH = "./modules/";
+const char* STORM_HOST_DEFAULT = "127.0.0.1";
+const int STORM_PORT_DEFAULT = 830;
+const int STORM_CLIENTS_DEFAULT = 8;
+const int STORM_CONNECTIONS_DEFAULT = 50;
+const int STORM_PARSES_DEFAULT = 1000;
+/* Host key types, as offered by the server. */
+static const char* STORM_HOSTKEYS[] = { "ed25519", "ecdsa", "rsa" };
+
+static const char* storm_host = STORM_HOST_DEFAULT;
+static int storm_port = STORM_PORT_DEFAULT;
+static const char* storm_user = NULL;
+static const char* storm_password = NULL;
+static int storm_connections = STORM_CONNECTIONS_DEFAULT;
+static std::atomic<uint64_t> storm_failures(0);
+
+/* Connection latencies of one client, microsec. */
+struct storm_client
+{
+	pthread_t tid;
+	uint64_t* latencies;
+	int count;
+};
+
+static char* storm_password_clb(const char* username, const char* hostname, void* priv)
+{
+	return strdup(storm_password);
+}
+
+/* Every host key is accepted, the benchmark only runs against a known server. */
+static int storm_hostkey_clb(const char* hostname, ssh_session session, void* priv)
+{
+	return 0;
+}
+
+/* What libssh does with a host key path on every handshake. */
+static void storm_parse_hostkeys(const char* dir, int parses)
+{
+	for(unsigned int i = 0; i < sizeof(STORM_HOSTKEYS) / sizeof(STORM_HOSTKEYS[0]); i++)
+	{
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/ssh_host_%s_key", dir, STORM_HOSTKEYS[i]);
+		if(access(path, R_OK))
+			continue;
+		uint64_t start = metrics_now();
+		int failed = 0;
+		for(int j = 0; j < parses && !failed; j++)
+		{
+			ssh_key key = NULL;
+			failed = ssh_pki_import_privkey_file(path, NULL, NULL, NULL, &key) != SSH_OK;
+			if(key)
+				ssh_key_free(key);
+		}
+		if(failed)
+			printf("[STORM] %s does not parse.\n", path);
+		else
+			printf("[STORM] %s : %.1f us per parse.\n", path, (double)(metrics_now() - start) / parses);
+	}
+}
+
+void* storm_client_entry(void* arg)
+{
+	struct storm_client* client = (struct storm_client*)arg;
+	/* Client settings are per thread in libnetconf2. */
+	nc_client_ssh_set_username(storm_user);
+	nc_client_ssh_set_auth_password_clb(storm_password_clb, NULL);
+	nc_client_ssh_set_auth_hostkey_check_clb(storm_hostkey_clb, NULL);
+	nc_client_ssh_set_auth_pref(NC_SSH_AUTH_PUBLICKEY, -1);
+	nc_client_ssh_set_auth_pref(NC_SSH_AUTH_INTERACTIVE, -1);
+	nc_client_ssh_set_auth_pref(NC_SSH_AUTH_PASSWORD, 1);
+	/* One context per client, reused by all its sessions. */
+	struct ly_ctx* ctx = ly_ctx_new(STORM_SEARCH_PATH, LY_CTX_TRUSTED);
+	for(int i = 0; ctx && i < storm_connections; i++)
+	{
+		uint64_t start = metrics_now();
+		struct nc_session* session = nc_connect_ssh(storm_host, storm_port, ctx);
+		if(!session)
+		{
+			storm_failures++;
+			continue;
+		}
+		client->latencies[client->count++] = metrics_now() - start;
+		nc_session_free(session, NULL);
+	}
+	if(ctx)
+		ly_ctx_destroy(ctx, NULL);
+	nc_thread_destroy();
+	return NULL;
+}
+
+static int storm_compare(const void* a, const void* b)
+{
+	uint64_t first = *(const uint64_t*)a, second = *(const uint64_t*)b;
+	return (first > second) - (first < second);
+}
+
+int main(int argc, char** argv)
+{
+	const char* hostkey_dir = "/etc/ssh";
+	int clients = STORM_CLIENTS_DEFAULT;
+	int parses = STORM_PARSES_DEFAULT;
+	int opt;
+	while((opt = getopt(argc, argv, "h:P:u:p:c:n:H:i:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'h':
+				storm_host = optarg;
+				break;
+			case 'P':
+				storm_port = atoi(optarg);
+				break;
+			case 'u':
+				storm_user = optarg;
+				break;
+			case 'p':
+				storm_password = optarg;
+				break;
+			case 'c':
+				clients = atoi(optarg);
+				break;
+			case 'n':
+				storm_connections = atoi(optarg);
+				break;
+			case 'H':
+				hostkey_dir = optarg;
+				break;
+			case 'i':
+				parses = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s -u user -p password [-h host] [-P port] [-c clients] [-n connections per client] [-H dir] [-i parses]\n", argv[0]);
+				return 2;
+		}
+	}
+	if(!storm_user || !storm_password || clients < 1 || storm_connections < 1 || parses < 1 || storm_port < 1 || storm_port > 65535)
+	{
+		fprintf(stderr, "[STORM] A user and a password are required, counts must be positive.\n");
+		return 2;
+	}
+	
+	storm_parse_hostkeys(hostkey_dir, parses);
+	
+	nc_client_init();
+	struct storm_client* storm = new storm_client[clients];
+	uint64_t start = metrics_now();
+	for(int i = 0; i < clients; i++)
+	{
+		storm[i].latencies = new uint64_t[storm_connections];
+		storm[i].count = 0;
+		pthread_create(&storm[i].tid, NULL, storm_client_entry, &storm[i]);
+	}
+	int total = 0;
+	for(int i = 0; i < clients; i++)
+	{
+		pthread_join(storm[i].tid, NULL);
+		total += storm[i].count;
+	}
+	double elapsed = (metrics_now() - start) / 1e6;
+	
+	uint64_t* latencies = new uint64_t[total ? total : 1];
+	int merged = 0;
+	for(int i = 0; i < clients; i++)
+	{
+		memcpy(latencies + merged, storm[i].latencies, storm[i].count * sizeof(uint64_t));
+		merged += storm[i].count;
+		delete[] storm[i].latencies;
+	}
+	qsort(latencies, total, sizeof(uint64_t), storm_compare);
+	printf("[STORM] %d clients : %d sessions in %.2f s (%.1f/s), %llu failed.\n", clients, total, elapsed, total / elapsed,
+		(unsigned long long)storm_failures.load());
+	if(total)
+		printf("[STORM] Connect and authenticate : p50 %.2f ms, p99 %.2f ms, max %.2f ms.\n", latencies[total / 2] / 1e3,
+			latencies[(total * 99) / 100] / 1e3, latencies[total - 1] / 1e3);
+	
+	delete[] latencies;
+	delete[] storm;
+	nc_client_destroy();
+	return (storm_failures || !total) ? 1 : 0;
+}